@@ -6,19 +6,29 @@
 #include "DataStore.h"
 
 #include <set>
+#include <vector>
+#include <chrono>
+
+#if __cplusplus >= 202002L
+#include "Async.h"
+#endif
 
   // four policies: Protocol, Encoding, DataType, Storage
   // Protocol and Storage are class templates - Protocol needs
   // an Encoding class and Storage needs a DataType specified.
+  // The fifth is which kind of DataStore the Application talks
+  // to, anything with DataStore's write/records/recordsSince will
+  // do, channel versions included.
 template<template<class> class ProtocolPolicy, class EncodingPolicy,
-		 class DataType, template<class> class StoragePolicy>
+		 class DataType, template<class> class StoragePolicy,
+		 class DataStorePolicy = DataStore>
 class Application: public ProtocolPolicy<EncodingPolicy>,
 				   public StoragePolicy<DataType>
 {
 public:
 	  // every Application knows it's own address and
 	  // the DataStore that it's connected to.
-	Application(string addr, DataStore& ds);
+	Application(string addr, DataStorePolicy& ds);
 
 	  // heartbeat is how the Application makes its presence
 	  // known to other Applications on the DataStore - it posts
@@ -47,18 +57,57 @@ public:
 	  // number of messages written to DataStore.
 	int broadcast() const;
 
-	  // readMessages reads all data messages on the DataStore, that
-	  // were not put there by me. There are added to our Storage
-	  // (stored locally) and the number of messages stored is returned.
+	  // readMessages reads the data messages written to the DataStore
+	  // since the last time it was called, that were not put there by
+	  // me. There are added to our Storage (stored locally) and the
+	  // number of messages stored is returned.
 	int readMessages();
 
+	  // same as readMessages, but if there's nothing new yet it waits
+	  // for at least minBytes to be written to the DataStore, or for
+	  // maxWait to go by, instead of returning straight away. Only
+	  // works with a DataStore that can be waited on, which means one
+	  // other threads are writing to (ConcurrentDataStore).
+	int waitForMessages(size_t minBytes, chrono::microseconds maxWait);
+
+#if __cplusplus >= 202002L
+	  // coroutine versions of the above, for running thousands of
+	  // Applications on a Scheduler without a thread each. They need
+	  // an AsyncDataStore (see Async.h) as the DataStore.
+
+	  // waits up to maxWait for a heartbeat that wasn't there last time
+	  // and then connects, same as connect
+	Task<int> connectAsync(chrono::microseconds maxWait);
+
+	  // same as broadcast, then lets the readers it woke have a turn
+	Task<int> broadcastAsync() const;
+
+	  // same as readMessages, but if there's nothing new yet it waits
+	  // up to maxWait for something, without holding up the thread
+	Task<int> readMessagesAsync(chrono::microseconds maxWait);
+#endif
+
 private:
 	string m_address;
-	DataStore& m_datastore;
+	DataStorePolicy& m_datastore;
 
 	  // log time to know if I already have a connection and easy
 	  // to erase.
 	set<string> m_connections;
+
+	  // how far readMessages has gotten through the DataStore, so
+	  // messages are only stored once
+	typename DataStorePolicy::Cursor m_cursor;
+
+	  // how far connectAsync has looked through the heartbeats
+	typename DataStorePolicy::Cursor m_heartbeats;
+
+	  // pull the data messages out of records and store the ones that
+	  // aren't mine, returning how many were stored
+	int storeMessages(const RecordView& records);
+
+	  // a data message for everything stored, ready to write
+	vector<string> prepareMessages() const;
 };
 
 #endif
@@ -70,10 +119,10 @@ private:
 
   // intiitalize any private member variables
 template<template<class> class ProtocolPolicy, class EncodingPolicy,
-		 class DataType, template<class> class StoragePolicy>
-Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
 
-::Application(string addr, DataStore& ds)
+::Application(string addr, DataStorePolicy& ds)
    : m_address(addr), m_datastore(ds)    // init member variables
 {
 
@@ -82,40 +131,41 @@ Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
   // function that write this Application's address on the DataStore
   // so that other Applications can connect with it
 template<template<class> class ProtocolPolicy, class EncodingPolicy,
-		 class DataType, template<class> class StoragePolicy>
-string Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+string Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
 
 ::heartbeat() const
 {
 	string msg = this->prepareHeartbeat(m_address);
-	m_datastore.write(msg);
+	m_datastore.write(this->heartbeatChannel(), msg);
 	return msg;
 }
 
   // function that looks at the data currently in the DataStore,
   // checking for any heartbeats it doesn't already know about
 template<template<class> class ProtocolPolicy, class EncodingPolicy,
-		 class DataType, template<class> class StoragePolicy>
-int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
 
 ::connect()
 {
 	  // clear old connections
 	m_connections.clear();
-	  // read the raw data
-	string memData;
-	m_datastore.read(memData);
-
-	  // go through the data, adding any connections to your connections set
-	  // count the number of connects added, start reading rawdata from first
-	  // element - getNextConnection returns true if there is another connection
-	int numAdded = 0, idx = 0;
+	  // look at the heartbeats where they sit in the DataStore, one
+	  // record per heartbeat
+	RecordView heartbeats = m_datastore.records(this->heartbeatChannel().mask());
+
+	  // go through them, adding any connections to your connections set
+	  // count the number of connects added - readConnection returns true
+	  // if the record really is a heartbeat
+	int numAdded = 0;
 	string data;
-	while (this->getNextConnection(idx, memData, data)) {
+	for (const Record& r : heartbeats) {
 		
 		  // try to add it to your connections, set::insert.second is true
 		  // on successful insertion
-		if (data != m_address && m_connections.insert(data).second) {
+		if (this->readConnection(r.data, data) && data != m_address
+			&& m_connections.insert(data).second) {
 			numAdded++;
 		}
 	}
@@ -127,8 +177,8 @@ int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
   // store the data using your storage and return true if it was
   // successful
 template<template<class> class ProtocolPolicy, class EncodingPolicy,
-		 class DataType, template<class> class StoragePolicy>
-int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
 
 ::record(DataType data)
 {
@@ -137,43 +187,103 @@ int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
 
   // broadcast all of the stored data and return how much was sent
 template<template<class> class ProtocolPolicy, class EncodingPolicy,
-		 class DataType, template<class> class StoragePolicy>
-int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
 
 ::broadcast() const
 {
+	  // write them to DataStore all at once
+	m_datastore.write(this->dataChannel(), prepareMessages());
+
+	  // return number of Data elements written
+	return this->size();
+}
+
+template<template<class> class ProtocolPolicy, class EncodingPolicy,
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+vector<string> Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
+
+::prepareMessages() const
+{
+	vector<string> messages;
+	messages.reserve(this->size());
 	for (int i = 0; i < this->size(); i++) {
 		  // data from Storage
 		DataType data = this->get(i);
 		  // prepare message with header
-		string message = this->prepareData(data.to_writeable(), m_address);
-		  // write to DataStore
-		m_datastore.write(message);
+		messages.push_back(this->prepareData(data.to_writeable(), m_address));
 	}
-
-	  // return number of Data elements written
-	return this->size();
+	return messages;
 }
 
 
-  // read all of the data from the DataStore and store it locally
+  // read all of the new data from the DataStore and store it locally
 template<template<class> class ProtocolPolicy, class EncodingPolicy,
-		 class DataType, template<class> class StoragePolicy>
-int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy>
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
 
 ::readMessages()
 {
-	string rawdata;
-	m_datastore.read(rawdata);
+	return storeMessages(m_datastore.recordsSince(m_cursor, this->dataChannel().mask()));
+}
+
+  // block until there's something to read, then read it
+template<template<class> class ProtocolPolicy, class EncodingPolicy,
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
+
+::waitForMessages(size_t minBytes, chrono::microseconds maxWait)
+{
+	m_datastore.waitFor(m_cursor, minBytes, maxWait);
+	return readMessages();
+}
+
+#if __cplusplus >= 202002L
+template<template<class> class ProtocolPolicy, class EncodingPolicy,
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+Task<int> Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
+
+::connectAsync(chrono::microseconds maxWait)
+{
+	co_await m_datastore.readAsync(m_heartbeats, this->heartbeatChannel().mask(), maxWait);
+	co_return connect();
+}
+
+template<template<class> class ProtocolPolicy, class EncodingPolicy,
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+Task<int> Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
+
+::broadcastAsync() const
+{
+	vector<string> messages = prepareMessages();
+	co_await m_datastore.writeAsync(this->dataChannel(), messages);
+	co_return this->size();
+}
+
+template<template<class> class ProtocolPolicy, class EncodingPolicy,
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+Task<int> Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
+
+::readMessagesAsync(chrono::microseconds maxWait)
+{
+	RecordView records = co_await m_datastore.readAsync(m_cursor, this->dataChannel().mask(), maxWait);
+	co_return storeMessages(records);
+}
+#endif
 
+template<template<class> class ProtocolPolicy, class EncodingPolicy,
+		 class DataType, template<class> class StoragePolicy, class DataStorePolicy>
+int Application<ProtocolPolicy, EncodingPolicy, DataType, StoragePolicy, DataStorePolicy>
+
+::storeMessages(const RecordView& records)
+{
 	string data, addr;
-	int idx = 0, numMsgs = 0;
+	int numMsgs = 0;
 
-	  // read the messages one by one, stopping when you've processed
-	  // all the raw data using the protocol
-	while (this->getNextData(idx, rawdata, data, addr)) {
+	  // read the messages one by one, each record is a whole message
+	for (const Record& r : records) {
 		  // store it if it isn't your data
-		if (addr != m_address) {
+		if (this->readData(r.data, data, addr) && addr != m_address) {
 			numMsgs++;
 			this->store(data);
 		}
@@ -0,0 +1,592 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#if __cplusplus < 202002L
+#error "Async.h needs C++20 coroutines, build with -std=c++20"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <deque>
+#include <map>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include "DataStore.h"
+#include "RecordView.h"
+#include "Channel.h"
+using namespace std;
+
+/*
+	Coroutines for running lots of Applications at once on a few threads.
+
+	A Task<T> is a coroutine that hands back a T. It doesn't start until
+	something co_awaits it, and whatever awaits it carries on straight
+	from where the task finished. Its frame is all the stack it has,
+	usually a few hundred bytes.
+
+	A Scheduler runs tasks on however many threads it's given. spawn()
+	starts one, run() works through them until they've all finished.
+	Tasks only ever give up their thread at a co_await, so a task that
+	never waits on anything keeps its thread until it's done.
+
+	AsyncDataStore puts a store on a Scheduler. Waiting for new data
+	(readAsync, or a Subscription) parks the task instead of blocking
+	its thread: writes through the AsyncDataStore wake whoever they
+	might interest straight away, and for writes that went to the store
+	some other way the scheduler checks back every poll interval while
+	anyone is parked. The store has to be safe for however many threads
+	the scheduler has - a DataStore only on a single threaded one, a
+	ConcurrentDataStore on any - and both have to outlast the run.
+*/
+
+template<class T = void>
+class Task;
+
+  // what every Task's promise has, whatever it returns
+struct TaskPromiseBase {
+	exception_ptr error;
+	coroutine_handle<> continuation;
+
+	  // when it's done, carry on with whoever was waiting on it
+	struct Final {
+		bool await_ready() noexcept { return false; }
+		template<class P>
+		coroutine_handle<> await_suspend(coroutine_handle<P> h) noexcept {
+			coroutine_handle<> c = h.promise().continuation;
+			return c ? c : noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	suspend_always initial_suspend() noexcept { return {}; }
+	Final final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = current_exception(); }
+};
+
+template<class T>
+struct TaskPromise : TaskPromiseBase {
+	optional<T> value;
+	template<class U>
+	void return_value(U&& v) { value.emplace(forward<U>(v)); }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+	void return_void() {}
+};
+
+template<class T>
+class Task {
+public:
+	struct promise_type : TaskPromise<T> {
+		Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+	};
+
+	Task(Task&& other) : m_h(exchange(other.m_h, nullptr)) {}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() {
+		if (m_h) {
+			m_h.destroy();
+		}
+	}
+
+	  // co_await starts it, and gives back what it co_returned or
+	  // throws what it threw. Only await a Task once.
+	bool await_ready() const noexcept { return false; }
+	coroutine_handle<> await_suspend(coroutine_handle<> waiting) noexcept {
+		m_h.promise().continuation = waiting;
+		return m_h;
+	}
+	T await_resume() {
+		if (m_h.promise().error) {
+			rethrow_exception(m_h.promise().error);
+		}
+		if constexpr (!is_void_v<T>) {
+			return move(*m_h.promise().value);
+		}
+	}
+
+private:
+	explicit Task(coroutine_handle<promise_type> h) : m_h(h) {}
+	coroutine_handle<promise_type> m_h;
+};
+
+class Scheduler {
+public:
+	using Clock = chrono::steady_clock;
+	using TimerId = pair<Clock::time_point, unsigned long long>;
+
+	  // run() uses threads threads, the one it's called on included
+	Scheduler(int threads = 1);
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+
+	  // start t on the next run(), or on this one if it's going
+	void spawn(Task<void> t);
+
+	  // run tasks until every spawned one has finished. If any threw,
+	  // the first thing thrown comes out of here once they're done.
+	void run();
+
+	  // a co_await that goes to the back of the line, to let
+	  // everything else that's ready have a turn
+	auto yield() {
+		struct Awaiter {
+			Scheduler* s;
+			bool await_ready() { return false; }
+			void await_suspend(coroutine_handle<> h) { s->schedule(h); }
+			void await_resume() {}
+		};
+		return Awaiter{this};
+	}
+
+	  // a co_await that comes back after d, without holding up a thread
+	auto sleepFor(chrono::microseconds d) {
+		struct Awaiter {
+			Scheduler* s;
+			Clock::time_point when;
+			bool await_ready() { return Clock::now() >= when; }
+			void await_suspend(coroutine_handle<> h) { s->at(when, [s = s, h]() { s->schedule(h); }); }
+			void await_resume() {}
+		};
+		return Awaiter{this, Clock::now() + d};
+	}
+
+	  // resume h on one of the scheduler's threads
+	void schedule(coroutine_handle<> h);
+
+	  // call f on one of the scheduler's threads at when, unless it's
+	  // cancelled first
+	TimerId at(Clock::time_point when, function<void()> f);
+	void cancel(TimerId id);
+
+	  // f gets called whenever a thread runs out of things to do, and
+	  // every poll interval after that while it's idle and f returns
+	  // true (there's something it's still watching for)
+	int addPoller(function<bool()> f);
+	void removePoller(int id);
+	void setPollInterval(chrono::microseconds d) { m_pollInterval = d; }
+
+	  // how many times a task has been picked up, all told
+	unsigned long long resumes() const { return m_resumes.load(); }
+
+private:
+	  // what a spawned Task runs inside of, it cleans up after itself
+	struct Detached {
+		struct promise_type {
+			Detached get_return_object() { return {}; }
+			suspend_never initial_suspend() noexcept { return {}; }
+			suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { terminate(); }
+		};
+	};
+	static Detached launch(Scheduler* s, Task<void> t);
+
+	int m_threads;
+	chrono::microseconds m_pollInterval;
+
+	mutex m_lock;
+	condition_variable m_wake;
+	deque<coroutine_handle<>> m_ready;
+	map<TimerId, function<void()>> m_timers;
+	unsigned long long m_nextTimer;
+	map<int, function<bool()>> m_pollers;
+	int m_nextPoller;
+	long m_live;
+	exception_ptr m_error;
+	atomic<unsigned long long> m_resumes;
+
+	void work();
+};
+
+Scheduler::Scheduler(int threads)
+ : m_threads(max(threads, 1)), m_pollInterval(chrono::milliseconds(1)), m_nextTimer(0),
+   m_nextPoller(0), m_live(0), m_resumes(0)
+{ }
+
+Scheduler::Detached Scheduler::launch(Scheduler* s, Task<void> t)
+{
+	  // don't start running it on spawn's thread
+	co_await s->yield();
+	try {
+		co_await t;
+	}
+	catch (...) {
+		lock_guard<mutex> lock(s->m_lock);
+		if (!s->m_error) {
+			s->m_error = current_exception();
+		}
+	}
+
+	lock_guard<mutex> lock(s->m_lock);
+	if (--s->m_live == 0) {
+		s->m_wake.notify_all();
+	}
+}
+
+void Scheduler::spawn(Task<void> t)
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_live++;
+	}
+	launch(this, move(t));
+}
+
+void Scheduler::schedule(coroutine_handle<> h)
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_ready.push_back(h);
+	}
+	m_wake.notify_one();
+}
+
+Scheduler::TimerId Scheduler::at(Clock::time_point when, function<void()> f)
+{
+	TimerId id;
+	bool first;
+	{
+		lock_guard<mutex> lock(m_lock);
+		id = TimerId(when, m_nextTimer++);
+		m_timers.emplace(id, move(f));
+		first = m_timers.begin()->first == id;
+	}
+	  // somebody might be asleep until a later one
+	if (first) {
+		m_wake.notify_one();
+	}
+	return id;
+}
+
+void Scheduler::cancel(TimerId id)
+{
+	lock_guard<mutex> lock(m_lock);
+	m_timers.erase(id);
+}
+
+int Scheduler::addPoller(function<bool()> f)
+{
+	lock_guard<mutex> lock(m_lock);
+	m_pollers.emplace(m_nextPoller, move(f));
+	return m_nextPoller++;
+}
+
+void Scheduler::removePoller(int id)
+{
+	lock_guard<mutex> lock(m_lock);
+	m_pollers.erase(id);
+}
+
+void Scheduler::run()
+{
+	vector<thread> helpers;
+	for (int i = 1; i < m_threads; i++) {
+		helpers.push_back(thread(&Scheduler::work, this));
+	}
+	work();
+	for (thread& t : helpers) {
+		t.join();
+	}
+
+	exception_ptr error;
+	{
+		lock_guard<mutex> lock(m_lock);
+		swap(error, m_error);
+	}
+	if (error) {
+		rethrow_exception(error);
+	}
+}
+
+void Scheduler::work()
+{
+	unique_lock<mutex> lock(m_lock);
+	for (;;) {
+		  // timers that are up go first, run without the lock since
+		  // they'll want it to schedule something
+		if (!m_timers.empty() && m_timers.begin()->first.first <= Clock::now()) {
+			function<void()> f = move(m_timers.begin()->second);
+			m_timers.erase(m_timers.begin());
+			lock.unlock();
+			f();
+			lock.lock();
+			continue;
+		}
+
+		if (!m_ready.empty()) {
+			coroutine_handle<> h = m_ready.front();
+			m_ready.pop_front();
+			lock.unlock();
+			m_resumes++;
+			h.resume();
+			lock.lock();
+			continue;
+		}
+
+		if (m_live == 0) {
+			m_wake.notify_all();
+			return;
+		}
+
+		  // nothing to do, see if the pollers can find something
+		vector<function<bool()>> pollers;
+		for (auto& p : m_pollers) {
+			pollers.push_back(p.second);
+		}
+		lock.unlock();
+		bool watching = false;
+		for (auto& p : pollers) {
+			watching = p() || watching;
+		}
+		lock.lock();
+		if (!m_ready.empty()) {
+			continue;
+		}
+
+		Clock::time_point until = Clock::time_point::max();
+		if (!m_timers.empty()) {
+			until = m_timers.begin()->first.first;
+		}
+		if (watching) {
+			until = min(until, Clock::now() + m_pollInterval);
+		}
+		if (until == Clock::time_point::max()) {
+			m_wake.wait(lock);
+		}
+		else {
+			m_wake.wait_until(lock, until);
+		}
+	}
+}
+
+  // whether anything's been written past c yet. It can say yes when
+  // what's new is only on channels the reader doesn't want, or when a
+  // write ahead of it is still being copied in, that just costs it a
+  // look.
+template<class Store>
+bool hasNew(Store& store, const typename Store::Cursor& c)
+{
+	return store.waitFor(c, 1, chrono::microseconds(0));
+}
+
+template<class ClockPolicy>
+bool hasNew(BasicDataStore<ClockPolicy>& store, const typename BasicDataStore<ClockPolicy>::Cursor& c)
+{
+	return c.next < store.nextSequence();
+}
+
+template<class Store>
+class AsyncDataStore {
+public:
+	using Cursor = typename Store::Cursor;
+
+	AsyncDataStore(Store& store, Scheduler& scheduler);
+	~AsyncDataStore();
+
+	AsyncDataStore(const AsyncDataStore&) = delete;
+	AsyncDataStore& operator=(const AsyncDataStore&) = delete;
+
+	Store& store() { return m_store; }
+
+	  // the store's own calls, so an Application can use this as its
+	  // store. Writes wake anyone waiting on them.
+	template<class... Args>
+	auto write(Args&&... args) {
+		if constexpr (is_void_v<decltype(m_store.write(forward<Args>(args)...))>) {
+			m_store.write(forward<Args>(args)...);
+			wake();
+		}
+		else {
+			auto r = m_store.write(forward<Args>(args)...);
+			wake();
+			return r;
+		}
+	}
+	RecordView records(unsigned channels = ALL_CHANNELS) { return m_store.records(channels); }
+	RecordView recordsSince(Cursor& c, unsigned channels = ALL_CHANNELS) {
+		return m_store.recordsSince(c, channels);
+	}
+
+	  // a write to co_await. Writing never has to wait, so it's done
+	  // by the time this returns, but co_awaiting it puts the writer at
+	  // the back of the line so the readers it woke get a turn.
+	auto writeAsync(Channel ch, const vector<string>& data) {
+		write(ch, data);
+		return m_scheduler.yield();
+	}
+	auto writeAsync(Channel ch, const string& data) {
+		write(ch, data);
+		return m_scheduler.yield();
+	}
+
+	  // what's been written on channels since c, waiting up to maxWait
+	  // for something if there's nothing yet. Empty if nothing came.
+	Task<RecordView> readAsync(Cursor& c, unsigned channels, chrono::microseconds maxWait);
+
+	  // a reader with its own cursor, starting from now
+	class Subscription {
+	public:
+		Task<RecordView> next(chrono::microseconds maxWait) {
+			return m_store->readAsync(m_cursor, m_channels, maxWait);
+		}
+		const Cursor& cursor() const { return m_cursor; }
+
+	private:
+		friend class AsyncDataStore;
+		Subscription(AsyncDataStore* s, unsigned channels) : m_store(s), m_channels(channels) {}
+		AsyncDataStore* m_store;
+		unsigned m_channels;
+		Cursor m_cursor;
+	};
+	Subscription subscribe(unsigned channels = ALL_CHANNELS);
+
+private:
+	  // a task parked until there's something past its cursor, or its
+	  // timer goes off. Whichever gets to it first claims it.
+	struct Waiter {
+		coroutine_handle<> h;
+		const Cursor* cursor;
+		Scheduler::TimerId timer;
+		atomic<bool> claimed;
+		Waiter(coroutine_handle<> handle, const Cursor* c) : h(handle), cursor(c), claimed(false) {}
+		bool claim() { return !claimed.exchange(true); }
+	};
+
+	  // what readAsync co_awaits between looks at the store
+	struct NewData {
+		AsyncDataStore* s;
+		const Cursor* c;
+		Scheduler::Clock::time_point deadline;
+		bool await_ready() { return hasNew(s->m_store, *c); }
+		void await_suspend(coroutine_handle<> h) { s->park(h, c, deadline); }
+		void await_resume() {}
+	};
+
+	Store& m_store;
+	Scheduler& m_scheduler;
+	int m_poller;
+
+	mutex m_lock;
+	vector<shared_ptr<Waiter>> m_waiters;
+
+	void park(coroutine_handle<> h, const Cursor* c, Scheduler::Clock::time_point deadline);
+	void resume(const shared_ptr<Waiter>& w);
+	void wake();
+	bool poll();
+};
+
+template<class Store>
+AsyncDataStore<Store>::AsyncDataStore(Store& store, Scheduler& scheduler)
+ : m_store(store), m_scheduler(scheduler)
+{
+	m_poller = m_scheduler.addPoller([this]() { return poll(); });
+}
+
+template<class Store>
+AsyncDataStore<Store>::~AsyncDataStore()
+{
+	m_scheduler.removePoller(m_poller);
+}
+
+template<class Store>
+Task<RecordView> AsyncDataStore<Store>::readAsync(Cursor& c, unsigned channels, chrono::microseconds maxWait)
+{
+	auto deadline = Scheduler::Clock::now() + maxWait;
+	for (;;) {
+		RecordView r = m_store.recordsSince(c, channels);
+		if (!r.empty() || Scheduler::Clock::now() >= deadline) {
+			co_return r;
+		}
+		co_await NewData{this, &c, deadline};
+	}
+}
+
+template<class Store>
+typename AsyncDataStore<Store>::Subscription AsyncDataStore<Store>::subscribe(unsigned channels)
+{
+	Subscription sub(this, channels);
+	m_store.recordsSince(sub.m_cursor, channels);
+	return sub;
+}
+
+template<class Store>
+void AsyncDataStore<Store>::park(coroutine_handle<> h, const Cursor* c, Scheduler::Clock::time_point deadline)
+{
+	shared_ptr<Waiter> w = make_shared<Waiter>(h, c);
+
+	  // claims that aren't from a write are made under the lock, so
+	  // poll never looks at the cursor of a task that's running again
+	lock_guard<mutex> lock(m_lock);
+	m_waiters.push_back(w);
+	w->timer = m_scheduler.at(deadline, [this, w]() {
+		lock_guard<mutex> lock(m_lock);
+		if (w->claim()) {
+			m_scheduler.schedule(w->h);
+		}
+	});
+
+	  // a write that came in between looking and parking didn't see
+	  // us waiting, so look again
+	if (hasNew(m_store, *c)) {
+		resume(w);
+	}
+}
+
+template<class Store>
+void AsyncDataStore<Store>::resume(const shared_ptr<Waiter>& w)
+{
+	if (w->claim()) {
+		m_scheduler.cancel(w->timer);
+		m_scheduler.schedule(w->h);
+	}
+}
+
+template<class Store>
+void AsyncDataStore<Store>::wake()
+{
+	vector<shared_ptr<Waiter>> waiters;
+	{
+		lock_guard<mutex> lock(m_lock);
+		if (m_waiters.empty()) {
+			return;
+		}
+		waiters.swap(m_waiters);
+	}
+	for (const shared_ptr<Waiter>& w : waiters) {
+		resume(w);
+	}
+}
+
+template<class Store>
+bool AsyncDataStore<Store>::poll()
+{
+	lock_guard<mutex> lock(m_lock);
+	size_t keep = 0;
+	for (size_t i = 0; i < m_waiters.size(); i++) {
+		shared_ptr<Waiter>& w = m_waiters[i];
+		if (w->claimed.load()) {
+			continue;
+		}
+		if (hasNew(m_store, *w->cursor)) {
+			resume(w);
+			continue;
+		}
+		m_waiters[keep++] = w;
+	}
+	m_waiters.resize(keep);
+	return keep > 0;
+}
+
+#endif
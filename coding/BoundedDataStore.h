@@ -0,0 +1,248 @@
+#ifndef BOUNDEDDATASTORE_H
+#define BOUNDEDDATASTORE_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <limits>
+#include "DataStore.h"
+using namespace std;
+
+/*
+	The spec's DataStore is limitless - everything stays until it expires,
+	so with a long persistence memory only goes up. A BoundedDataStore is a
+	DataStore with a budget, in live bytes and/or live entries. A write
+	that puts it over budget evicts entries until it's back under, and the
+	EvictionPolicy decides which ones go.
+
+	An EvictionPolicy is told about every write with
+		void admitted(unsigned long long seq, const string& data, unsigned long long firstSeq)
+	and asked for victims with
+		bool nextVictim(unsigned long long& seq)
+	It doesn't have to keep track of what has expired since - the store
+	skips any victim that isn't live anymore and asks again. firstSeq is
+	the oldest sequence number still in the store, so policies can throw
+	away what they're holding below it.
+
+	Evicted entries look just like expired ones to readers: they're gone
+	from read() and view(), and readSince counts them in a cursor's missed.
+	Since a write can evict, and evicting gives back chunks, a view is
+	only good until the next write here, not just the next read the way
+	it is on a DataStore.
+
+	With setDurable, what comes back from the log is told to the policy
+	and held to the budget the same as new writes. Evictions aren't in
+	the log, so whatever was evicted before a restart can come back and
+	get evicted again.
+*/
+template<class EvictionPolicy, class ClockPolicy = SteadyClock>
+class BoundedDataStore: public BasicDataStore<ClockPolicy>, public EvictionPolicy
+{
+public:
+	static constexpr size_t UNLIMITED = numeric_limits<size_t>::max();
+
+	  // p is the persistence, same as DataStore. maxBytes and maxEntries
+	  // are how much live data is allowed at once. ClockPolicy is the
+	  // same as BasicDataStore's.
+	BoundedDataStore(int p, size_t maxBytes, size_t maxEntries = UNLIMITED)
+	 : BasicDataStore<ClockPolicy>(p), m_maxBytes(maxBytes), m_maxEntries(maxEntries),
+	   m_evictedBytes(0), m_evictedEntries(0)
+	{ }
+
+	  // same as DataStore's, except older data may be evicted to make
+	  // room - which also ends any view still being held
+	unsigned long long write(string data)             { return write(Channel(0), data, this->m_persistence); }
+	unsigned long long write(string data, double ttl) { return write(Channel(0), data, ttl); }
+	unsigned long long write(Channel ch, string data) { return write(ch, data, this->m_persistence); }
+	unsigned long long write(Channel ch, string data, double ttl) { return write(ch, &data, 1, ttl); }
+	unsigned long long write(const vector<string>& data) {
+		return write(Channel(0), data.data(), data.size(), this->m_persistence);
+	}
+	unsigned long long write(Channel ch, const vector<string>& data) {
+		return write(ch, data.data(), data.size(), this->m_persistence);
+	}
+	unsigned long long write(Channel ch, const string* data, size_t n, double ttl);
+
+	  // the eviction policies go by write order, which dedup doesn't keep
+	void setDedup(bool) = delete;
+
+	  // same as DataStore's, but what comes back from the log still has
+	  // to fit the budget
+	void setDurable(string dir, chrono::microseconds maxCommitDelay = chrono::milliseconds(2));
+
+	  // live data currently held, what the budget is checked against
+	size_t bytes() const   { return this->m_size; }
+	size_t entries() const { return this->m_entries.size() - this->m_dead; }
+
+	  // what's actually allocated for data. Evicting from the middle of
+	  // the log doesn't free anything until the front catches up with it,
+	  // so this can run ahead of bytes() - size the budget with it in mind.
+	  // (Compression can take it the other way.)
+	size_t footprint() const { return this->memoryUsed(); }
+
+	  // running totals of what had to be thrown out to stay in budget
+	unsigned long long evictedBytes() const   { return m_evictedBytes; }
+	unsigned long long evictedEntries() const { return m_evictedEntries; }
+
+private:
+	size_t m_maxBytes;
+	size_t m_maxEntries;
+	unsigned long long m_evictedBytes;
+	unsigned long long m_evictedEntries;
+
+	bool overBudget() const { return bytes() > m_maxBytes || entries() > m_maxEntries; }
+	  // throw out what the policy says until it's back under budget
+	void evict();
+};
+
+template<class EvictionPolicy, class ClockPolicy>
+unsigned long long BoundedDataStore<EvictionPolicy, ClockPolicy>::write(Channel ch, const string* data, size_t n, double ttl)
+{
+	unsigned long long seq = BasicDataStore<ClockPolicy>::write(ch, data, n, ttl);
+	for (size_t i = 0; i < n; i++) {
+		EvictionPolicy::admitted(seq + i, data[i], this->m_firstSeq);
+	}
+
+	if (overBudget()) {
+		evict();
+	}
+	return seq;
+}
+
+template<class EvictionPolicy, class ClockPolicy>
+void BoundedDataStore<EvictionPolicy, ClockPolicy>::setDurable(string dir, chrono::microseconds maxCommitDelay)
+{
+	BasicDataStore<ClockPolicy>::setDurable(dir, maxCommitDelay);
+
+	  // the policy hears about what came back in the order it was
+	  // written, same as if it had been written just now
+	double now = this->elapsed();
+	for (size_t i = 0; i < this->m_entries.size(); i++) {
+		const typename BasicDataStore<ClockPolicy>::entry& e = this->m_entries[i];
+		if (!this->expired(e, now)) {
+			EvictionPolicy::admitted(this->m_firstSeq + i, string(this->m_data.at(e.start), e.size),
+									 this->m_firstSeq);
+		}
+	}
+	if (overBudget()) {
+		evict();
+	}
+}
+
+template<class EvictionPolicy, class ClockPolicy>
+void BoundedDataStore<EvictionPolicy, ClockPolicy>::evict()
+{
+	  // anything that expired on its own is the cheapest thing to lose
+	this->cleanData();
+
+	double now = this->elapsed();
+	unsigned long long victim;
+	while (overBudget() && EvictionPolicy::nextVictim(victim)) {
+		if (victim < this->m_firstSeq) {
+			continue;
+		}
+		typename BasicDataStore<ClockPolicy>::entry& e = this->m_entries[victim - this->m_firstSeq];
+		if (this->expired(e, now)) {
+			continue;
+		}
+		m_evictedBytes += e.size;
+		m_evictedEntries++;
+		this->kill(e);
+	}
+
+	  // evicting from the front lets the log give chunks back right away
+	this->dropFront(now);
+}
+
+/*
+	Eviction policies
+*/
+
+  // plain FIFO: throw out the oldest live data first. Since writes
+  // come in oldest first this keeps everything live in one stretch.
+class OldestFirst {
+public:
+	void admitted(unsigned long long seq, const string&, unsigned long long firstSeq) {
+		while (!m_order.empty() && m_order.front() < firstSeq) {
+			m_order.pop_front();
+		}
+		m_order.push_back(seq);
+	}
+
+	bool nextVictim(unsigned long long& seq) {
+		if (m_order.empty()) {
+			return false;
+		}
+		seq = m_order.front();
+		m_order.pop_front();
+		return true;
+	}
+
+private:
+	deque<unsigned long long> m_order;
+};
+
+  // throw out the biggest entries first, so as few entries as possible
+  // are lost for the bytes freed. Entries are kept in buckets by power
+  // of two size (oldest first within a bucket), which is close enough
+  // to largest-first and keeps everything O(1).
+class SizeAware {
+public:
+	void admitted(unsigned long long seq, const string& data, unsigned long long firstSeq) {
+		int b = 0;
+		while (b < BUCKETS - 1 && (size_t(2) << b) <= data.size()) {
+			b++;
+		}
+		deque<unsigned long long>& bucket = m_buckets[b];
+		while (!bucket.empty() && bucket.front() < firstSeq) {
+			bucket.pop_front();
+		}
+		bucket.push_back(seq);
+	}
+
+	bool nextVictim(unsigned long long& seq) {
+		for (int b = BUCKETS - 1; b >= 0; b--) {
+			if (!m_buckets[b].empty()) {
+				seq = m_buckets[b].front();
+				m_buckets[b].pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	static constexpr int BUCKETS = 32;
+	deque<unsigned long long> m_buckets[BUCKETS];
+};
+
+  // heartbeats get posted over and over, so losing an old one costs
+  // nothing - the next one is on its way. Throw those out first (oldest
+  // first), and only then start on everything else. Heartbeats are
+  // spotted by SimpleProtocol's header.
+class HeartbeatsFirst {
+public:
+	void admitted(unsigned long long seq, const string& data, unsigned long long firstSeq) {
+		deque<unsigned long long>& q = data.compare(0, 4, "HTBT") == 0 ? m_heartbeats : m_rest;
+		while (!q.empty() && q.front() < firstSeq) {
+			q.pop_front();
+		}
+		q.push_back(seq);
+	}
+
+	bool nextVictim(unsigned long long& seq) {
+		deque<unsigned long long>& q = !m_heartbeats.empty() ? m_heartbeats : m_rest;
+		if (q.empty()) {
+			return false;
+		}
+		seq = q.front();
+		q.pop_front();
+		return true;
+	}
+
+private:
+	deque<unsigned long long> m_heartbeats;
+	deque<unsigned long long> m_rest;
+};
+
+#endif
@@ -0,0 +1,422 @@
+#ifndef BUFFEREDDATASTORE_H
+#define BUFFEREDDATASTORE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <string_view>
+#include "ConcurrentDataStore.h"
+#include "Stats.h"
+using namespace std;
+
+/*
+	BufferedDataStore sits in front of a ConcurrentDataStore and takes
+	writers off its append point. Every thread that writes gets a buffer
+	of its own, so a write is a clock read and a push under a lock no
+	other writer touches. A merger thread collects the buffers and
+	publishes what's in them to the store, one write per run of the same
+	channel instead of one per message.
+
+	Writes are stamped when they're made, and the log ends up in the
+	order of the stamps, whichever threads they came from (ties go by
+	thread, and a thread's own writes stay in the order it made them,
+	so a batched write stays together). That takes a watermark: each
+	round the merger reads the clock before emptying the buffers, so
+	anything written after that has a later stamp, and only publishes
+	what's older than it. The rest waits for the next round.
+
+	A round happens every maxDelay, or as soon as any thread has
+	maxBatch writes waiting. That's the trade-off: a longer delay and a
+	bigger batch go easier on the store and let more writers through,
+	but a write takes longer to show up to readers. stats() says how
+	long it's been taking.
+
+	A thread's buffer goes once the thread has and everything in it has
+	been published, so threads coming and going don't leave the merger
+	more and more buffers to look through.
+
+	Reads go straight to the store, so they only see what's been
+	published - flush() first to be sure of seeing everything written
+	so far, your own writes included.
+*/
+class BufferedDataStore {
+public:
+	using Cursor = ConcurrentDataStore::Cursor;
+
+	BufferedDataStore(ConcurrentDataStore& store,
+					  chrono::microseconds maxDelay = chrono::microseconds(200),
+					  size_t maxBatch = 256);
+	  // publishes everything that's left
+	~BufferedDataStore();
+
+	BufferedDataStore(const BufferedDataStore&) = delete;
+	BufferedDataStore& operator=(const BufferedDataStore&) = delete;
+
+	ConcurrentDataStore& store() { return m_store; }
+
+	  // safe from any number of threads
+	void write(string data) { write(Channel(0), &data, 1); }
+	void write(Channel ch, string data) { write(ch, &data, 1); }
+	void write(const vector<string>& data) { write(Channel(0), data.data(), data.size()); }
+	void write(Channel ch, const vector<string>& data) { write(ch, data.data(), data.size()); }
+	void write(Channel ch, const string* data, size_t n);
+
+	  // wait until everything written before this was called is in
+	  // the store
+	void flush();
+
+	void read(string& data) { m_store.read(data); }
+	DataView view(unsigned channels = ALL_CHANNELS) { return m_store.view(channels); }
+	DataView readSince(Cursor& c, unsigned channels = ALL_CHANNELS) { return m_store.readSince(c, channels); }
+	RecordView records(unsigned channels = ALL_CHANNELS) { return m_store.records(channels); }
+	RecordView recordsSince(Cursor& c, unsigned channels = ALL_CHANNELS) {
+		return m_store.recordsSince(c, channels);
+	}
+	bool waitFor(const Cursor& c, size_t minBytes, chrono::microseconds maxWait) {
+		return m_store.waitFor(c, minBytes, maxWait);
+	}
+
+	  // publishLatency is from a write being made to it being in the
+	  // store, for every write. buffers is how many there are right now.
+	struct Stats {
+		unsigned long long writes;
+		unsigned long long published;
+		unsigned long long rounds;
+		unsigned long long storeWrites;
+		size_t buffers;
+		LatencyHistogram publishLatency;
+
+		  // how many messages went into the store per call to it
+		double batchSize() const { return storeWrites ? double(published) / storeWrites : 0; }
+	};
+	Stats stats() const;
+
+private:
+	using Clock = chrono::steady_clock;
+
+	  // where a write's data is in its buffer's bytes
+	struct Pending {
+		int64_t stamp;
+		uint32_t channel;
+		uint32_t size;
+		size_t offset;
+	};
+
+	  // one writer thread's. Only that thread and the merger lock it;
+	  // taken is what the merger has emptied out of it this round and
+	  // is only touched by the merger.
+	struct Buffer {
+		mutex lock;
+		vector<Pending> pending;
+		string bytes;
+		vector<Pending> taken;
+		string takenBytes;
+		unsigned long long writes = 0;
+	};
+
+	ConcurrentDataStore& m_store;
+	chrono::microseconds m_maxDelay;
+	size_t m_maxBatch;
+	  // tells this store's buffers apart from any other's in a thread
+	unsigned long long m_id;
+
+	mutable mutex m_lock;
+	condition_variable m_wake;
+	condition_variable m_published;
+	  // in the order they were made, which is how ties are broken. One
+	  // nobody else holds is from a thread that's gone.
+	vector<shared_ptr<Buffer>> m_buffers;
+	bool m_kick;
+	bool m_stop;
+	  // everything stamped before this has been published
+	int64_t m_watermark;
+	  // the latest time someone's flushing up to
+	int64_t m_flushTo;
+	  // set while the merger is waiting without a timeout
+	atomic<bool> m_sleeping;
+	Stats m_stats;
+
+	thread m_thread;
+
+	static int64_t now() {
+		return chrono::duration_cast<chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	}
+
+	Buffer& myBuffer();
+	void kick();
+	void run();
+	  // publish everything stamped before cutoff, returns whether
+	  // anything's left over for next time
+	bool round(int64_t cutoff);
+};
+
+BufferedDataStore::BufferedDataStore(ConcurrentDataStore& store, chrono::microseconds maxDelay,
+									 size_t maxBatch)
+ : m_store(store), m_maxDelay(maxDelay), m_maxBatch(max<size_t>(maxBatch, 1)),
+   m_kick(false), m_stop(false), m_watermark(0), m_flushTo(0), m_sleeping(false), m_stats()
+{
+	static atomic<unsigned long long> ids(0);
+	m_id = ++ids;
+	m_thread = thread(&BufferedDataStore::run, this);
+}
+
+BufferedDataStore::~BufferedDataStore()
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+}
+
+BufferedDataStore::Buffer& BufferedDataStore::myBuffer()
+{
+	  // the buffers this thread has, by store. The last one used is
+	  // kept handy since it's nearly always the one wanted.
+	static thread_local unordered_map<unsigned long long, shared_ptr<Buffer>> mine;
+	static thread_local unsigned long long lastId = 0;
+	static thread_local Buffer* last = nullptr;
+	if (lastId == m_id) {
+		return *last;
+	}
+
+	shared_ptr<Buffer>& b = mine[m_id];
+	if (!b) {
+		  // and forget the ones whose stores are gone
+		for (auto it = mine.begin(); it != mine.end(); ) {
+			if (it->second && it->second.use_count() == 1) {
+				it = mine.erase(it);
+			} else {
+				++it;
+			}
+		}
+		b = make_shared<Buffer>();
+		lock_guard<mutex> lock(m_lock);
+		m_buffers.push_back(b);
+	}
+	lastId = m_id;
+	last = b.get();
+	return *b;
+}
+
+void BufferedDataStore::kick()
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_kick = true;
+	}
+	m_wake.notify_one();
+}
+
+void BufferedDataStore::write(Channel ch, const string* data, size_t n)
+{
+	Buffer& b = myBuffer();
+	bool wasEmpty, full;
+	{
+		lock_guard<mutex> lock(b.lock);
+		  // stamped under the lock, so a buffer is always in stamp order
+		int64_t stamp = now();
+		size_t before = b.pending.size();
+		wasEmpty = before == 0;
+		for (size_t i = 0; i < n; i++) {
+			b.pending.push_back(Pending{stamp, ch.id, uint32_t(data[i].size()), b.bytes.size()});
+			b.bytes += data[i];
+		}
+		b.writes += n;
+		full = before < m_maxBatch && b.pending.size() >= m_maxBatch;
+	}
+
+	  // the merger only needs a nudge if it's got nothing to time, or
+	  // this just took the buffer to maxBatch
+	if (full || (wasEmpty && m_sleeping.load())) {
+		kick();
+	}
+}
+
+void BufferedDataStore::flush()
+{
+	int64_t t = now();
+	unique_lock<mutex> lock(m_lock);
+	m_kick = true;
+	m_flushTo = max(m_flushTo, t);
+	m_wake.notify_one();
+	m_published.wait(lock, [this, t]() { return m_watermark > t; });
+}
+
+BufferedDataStore::Stats BufferedDataStore::stats() const
+{
+	lock_guard<mutex> lock(m_lock);
+	  // m_stats.writes has the ones from buffers that are gone
+	Stats s = m_stats;
+	for (const shared_ptr<Buffer>& b : m_buffers) {
+		lock_guard<mutex> bl(b->lock);
+		s.writes += b->writes;
+	}
+	s.buffers = m_buffers.size();
+	return s;
+}
+
+bool BufferedDataStore::round(int64_t cutoff)
+{
+	vector<shared_ptr<Buffer>> buffers;
+	{
+		  // let go of the buffers of threads that have gone, once
+		  // they're empty - nothing can be added to them anymore
+		lock_guard<mutex> lock(m_lock);
+		auto gone = remove_if(m_buffers.begin(), m_buffers.end(), [this](const shared_ptr<Buffer>& b) {
+			if (b.use_count() != 1) {
+				return false;
+			}
+			lock_guard<mutex> bl(b->lock);
+			if (!b->pending.empty()) {
+				return false;
+			}
+			m_stats.writes += b->writes;
+			return true;
+		});
+		m_buffers.erase(gone, m_buffers.end());
+		buffers = m_buffers;
+	}
+
+	  // take what's older than cutoff out of every buffer. Anything
+	  // written from here on gets a stamp of cutoff or later, so nothing
+	  // that should go before what we take can turn up afterwards. The
+	  // few that are newer get put back, ahead of whatever comes next.
+	bool left = false;
+	for (const shared_ptr<Buffer>& b : buffers) {
+		lock_guard<mutex> lock(b->lock);
+		auto late = partition_point(b->pending.begin(), b->pending.end(),
+									[cutoff](const Pending& p) { return p.stamp < cutoff; });
+		b->taken.clear();
+		b->takenBytes.clear();
+		if (late == b->pending.begin()) {
+			left = left || !b->pending.empty();
+			continue;
+		}
+		size_t keep = late - b->pending.begin();
+		b->taken.swap(b->pending);
+		b->takenBytes.swap(b->bytes);
+		for (size_t i = keep; i < b->taken.size(); i++) {
+			Pending p = b->taken[i];
+			b->pending.push_back(Pending{p.stamp, p.channel, p.size, b->bytes.size()});
+			b->bytes.append(b->takenBytes, p.offset, p.size);
+			left = true;
+		}
+		b->taken.resize(keep);
+	}
+
+	  // merge them by stamp, then by buffer, then by where they were in
+	  // it, and write every run on the same channel in one go
+	using Head = pair<int64_t, uint32_t>;
+	priority_queue<Head, vector<Head>, greater<Head>> heads;
+	vector<size_t> next(buffers.size(), 0);
+	for (uint32_t i = 0; i < buffers.size(); i++) {
+		if (!buffers[i]->taken.empty()) {
+			heads.push(Head(buffers[i]->taken[0].stamp, i));
+		}
+	}
+
+	unsigned long long published = 0, storeWrites = 0;
+	LatencyHistogram latency;
+	vector<string_view> run;
+	uint32_t channel = 0;
+	auto publish = [&]() {
+		if (!run.empty()) {
+			m_store.write(Channel(channel), run.data(), run.size());
+			storeWrites++;
+			run.clear();
+		}
+	};
+	while (!heads.empty()) {
+		uint32_t id = heads.top().second;
+		Buffer& b = *buffers[id];
+		heads.pop();
+		size_t& i = next[id];
+		const Pending& p = b.taken[i];
+		if (p.channel != channel) {
+			publish();
+			channel = p.channel;
+		}
+		run.push_back(string_view(b.takenBytes.data() + p.offset, p.size));
+		published++;
+		if (++i < b.taken.size()) {
+			heads.push(Head(b.taken[i].stamp, id));
+		}
+	}
+	publish();
+	if (published == 0) {
+		return left;
+	}
+
+	  // latencies are to when the round's done, it's when readers can
+	  // see the lot
+	int64_t done = now();
+	for (const shared_ptr<Buffer>& b : buffers) {
+		for (const Pending& p : b->taken) {
+			latency.record(done - p.stamp);
+		}
+	}
+
+	lock_guard<mutex> lock(m_lock);
+	m_stats.published += published;
+	m_stats.rounds++;
+	m_stats.storeWrites += storeWrites;
+	m_stats.publishLatency.add(latency);
+	return left;
+}
+
+void BufferedDataStore::run()
+{
+	unique_lock<mutex> lock(m_lock);
+	for (;;) {
+		bool stopping = m_stop;
+		m_kick = false;
+		lock.unlock();
+
+		int64_t cutoff = now();
+		bool left = round(stopping ? numeric_limits<int64_t>::max() : cutoff);
+
+		lock.lock();
+		m_watermark = cutoff;
+		m_published.notify_all();
+		if (stopping) {
+			break;
+		}
+		  // a round that started in the same tick as a flush doesn't
+		  // cover it
+		if (m_watermark <= m_flushTo) {
+			continue;
+		}
+
+		if (left) {
+			m_wake.wait_for(lock, m_maxDelay, [this]() { return m_kick || m_stop; });
+			continue;
+		}
+
+		  // nothing's waiting, so sleep until a writer says otherwise.
+		  // Writers push before they look at m_sleeping, and we set it
+		  // before we look at the buffers, so one of us sees the other.
+		m_sleeping.store(true);
+		bool any = false;
+		for (const shared_ptr<Buffer>& b : m_buffers) {
+			lock_guard<mutex> bl(b->lock);
+			any = any || !b->pending.empty();
+		}
+		if (!any) {
+			m_wake.wait(lock, [this]() { return m_kick || m_stop; });
+		}
+		m_sleeping.store(false);
+	}
+}
+
+#endif
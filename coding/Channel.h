@@ -0,0 +1,33 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <string>
+#include <stdexcept>
+using namespace std;
+
+/*
+	Writes to a DataStore can be tagged with a Channel, and readers can ask
+	for just the channels they care about, as a mask with a bit per
+	channel. Something only after heartbeats then never has to look at
+	anyone's data. Untagged writes go to channel 0.
+*/
+struct Channel {
+	static constexpr unsigned MAX = 32;
+
+	  // has to be less than MAX, or it's out_of_range - ids can come
+	  // off the wire or the disk, and the stores index by them
+	unsigned id;
+	explicit Channel(unsigned i) : id(i) {
+		if (i >= MAX) {
+			throw out_of_range("Channel: no channel " + to_string(i));
+		}
+	}
+
+	  // the mask bit for reading just this channel
+	unsigned mask() const { return 1u << id; }
+};
+
+  // reads see every channel unless told otherwise
+static constexpr unsigned ALL_CHANNELS = ~0u;
+
+#endif
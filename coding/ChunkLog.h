@@ -0,0 +1,276 @@
+#ifndef CHUNKLOG_H
+#define CHUNKLOG_H
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <time.h>
+#include "Compress.h"
+using namespace std;
+
+/*
+	ChunkLog is the memory behind DataStore. Instead of giving every
+	char its own list node, bytes are appended into fixed-size chunks
+	and chunks that no longer hold anything live go back on a free list
+	to be reused by later writes.
+
+	An append never straddles two chunks - if it doesn't fit in what's
+	left of the last chunk, it starts a new one. That wastes the tail of
+	a chunk now and then but means every write is one memcpy and every
+	entry is one contiguous run of memory. Anything bigger than a chunk
+	gets a chunk of its own, sized to fit.
+
+	Chunks that are done being written to can be packed - compressed
+	with LZCodec and the original memory let go. Reading a packed chunk
+	unpacks a copy of it, which sticks around until dropUnpacked() so
+	pointers into it stay good as long as the DataStore promises its
+	views are.
+*/
+class ChunkLog {
+public:
+	static constexpr size_t CHUNK_SIZE = 4096;
+	  // how many empty chunks we hold on to for reuse
+	static constexpr size_t MAX_FREE = 16;
+
+	  // where an entry lives: the id of its chunk (ids only go up, the
+	  // first chunk ever allocated is 0) and the offset into that chunk
+	struct Loc {
+		unsigned long long chunk;
+		size_t offset;
+		Loc(unsigned long long c = 0, size_t o = 0) : chunk(c), offset(o) {}
+	};
+
+	ChunkLog() : m_firstChunk(0), m_packedUpTo(0), m_held(0), m_unpackedBytes(0) {}
+
+	  // copy n bytes starting at data onto the end of the log and
+	  // return where they ended up
+	Loc append(const char* data, size_t n);
+
+	  // pointer to the first byte of whatever is stored at loc
+	const char* at(Loc loc) const {
+		return dataOf(loc.chunk - m_firstChunk) + loc.offset;
+	}
+
+	  // drop every chunk older than chunk id c, nothing in them can be
+	  // read again
+	void releaseBefore(unsigned long long c);
+
+	  // drop everything
+	void clear() { releaseBefore(m_firstChunk + m_chunks.size()); }
+
+	  // call f(ptr, len) for each contiguous run of bytes from loc to
+	  // the end of the log, in order
+	template<class Func>
+	void forEachRun(Loc from, Func f) const;
+
+	  // number of chunks currently holding data
+	size_t numChunks() const { return m_chunks.size(); }
+
+	  // pack every chunk before id c that hasn't been yet. The last chunk
+	  // is still being written to, so it's never packed.
+	void pack(unsigned long long c);
+
+	  // let go of the unpacked copies readers have made
+	void dropUnpacked();
+
+	  // memory actually holding data: raw chunks, packed chunks and
+	  // unpacked copies (but not the free list)
+	size_t bytesHeld() const { return m_held + m_unpackedBytes; }
+
+	struct Stats {
+		unsigned long long chunksPacked;
+		  // chunks that didn't get enough smaller to be worth it
+		unsigned long long chunksLeftRaw;
+		  // bytes that went into pack() and what came out
+		unsigned long long rawBytes;
+		unsigned long long packedBytes;
+		unsigned long long unpacks;
+		  // CPU time spent packing and unpacking
+		double packMs;
+		double unpackMs;
+		Stats() : chunksPacked(0), chunksLeftRaw(0), rawBytes(0), packedBytes(0),
+				  unpacks(0), packMs(0), unpackMs(0) {}
+		double ratio() const { return rawBytes ? (double)packedBytes / rawBytes : 1; }
+	};
+	const Stats& stats() const { return m_stats; }
+
+private:
+	struct Chunk {
+		  // null once the chunk is packed
+		unique_ptr<char[]> mem;
+		size_t capacity;
+		size_t used;
+		vector<char> packed;
+		mutable unique_ptr<char[]> unpacked;
+		Chunk(unique_ptr<char[]> m, size_t c) : mem(move(m)), capacity(c), used(0) {}
+	};
+
+	  // live chunks, m_chunks[0] has id m_firstChunk
+	deque<Chunk> m_chunks;
+	unsigned long long m_firstChunk;
+
+	  // standard sized chunks waiting to be reused
+	vector<unique_ptr<char[]>> m_free;
+
+	  // push a fresh chunk big enough for n bytes on the end
+	void newChunk(size_t n);
+
+	  // put memory we're done with on the free list if it's worth keeping
+	void recycle(unique_ptr<char[]> mem, size_t capacity);
+
+	  // every chunk before this id has already been looked at by pack
+	unsigned long long m_packedUpTo;
+	  // ids of the chunks that have an unpacked copy
+	mutable vector<unsigned long long> m_unpackedIds;
+
+	size_t m_held;
+	mutable size_t m_unpackedBytes;
+	mutable Stats m_stats;
+
+	  // where a chunk's bytes are, unpacking it if need be
+	const char* dataOf(size_t i) const {
+		return m_chunks[i].mem ? m_chunks[i].mem.get() : unpack(i);
+	}
+	const char* unpack(size_t i) const;
+
+	  // CPU time this thread has used, in milliseconds
+	static double cpuMs() {
+		timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+	}
+};
+
+ChunkLog::Loc ChunkLog::append(const char* data, size_t n)
+{
+	if (m_chunks.empty() || m_chunks.back().used + n > m_chunks.back().capacity) {
+		newChunk(n);
+	}
+
+	Chunk& c = m_chunks.back();
+	Loc loc(m_firstChunk + m_chunks.size() - 1, c.used);
+	if (n > 0) {
+		memcpy(c.mem.get() + c.used, data, n);
+	}
+	c.used += n;
+	return loc;
+}
+
+void ChunkLog::releaseBefore(unsigned long long c)
+{
+	while (!m_chunks.empty() && m_firstChunk < c) {
+		Chunk& front = m_chunks.front();
+		if (front.mem) {
+			m_held -= front.capacity;
+			recycle(move(front.mem), front.capacity);
+		}
+		else {
+			m_held -= front.packed.size();
+		}
+		if (front.unpacked) {
+			m_unpackedBytes -= front.used;
+		}
+		m_chunks.pop_front();
+		m_firstChunk++;
+	}
+}
+
+template<class Func>
+void ChunkLog::forEachRun(Loc from, Func f) const
+{
+	for (size_t i = from.chunk - m_firstChunk; i < m_chunks.size(); i++) {
+		const Chunk& c = m_chunks[i];
+		size_t start = (i == from.chunk - m_firstChunk) ? from.offset : 0;
+		if (c.used > start) {
+			f(dataOf(i) + start, c.used - start);
+		}
+	}
+}
+
+void ChunkLog::newChunk(size_t n)
+{
+	m_held += max(n, CHUNK_SIZE);
+	if (n <= CHUNK_SIZE) {
+		if (!m_free.empty()) {
+			m_chunks.emplace_back(move(m_free.back()), CHUNK_SIZE);
+			m_free.pop_back();
+		}
+		else {
+			m_chunks.emplace_back(unique_ptr<char[]>(new char[CHUNK_SIZE]), CHUNK_SIZE);
+		}
+	}
+	else {
+		m_chunks.emplace_back(unique_ptr<char[]>(new char[n]), n);
+	}
+}
+
+void ChunkLog::recycle(unique_ptr<char[]> mem, size_t capacity)
+{
+	  // only standard sized chunks are worth keeping around,
+	  // oversized ones were made for one particular write
+	if (capacity == CHUNK_SIZE && m_free.size() < MAX_FREE) {
+		m_free.push_back(move(mem));
+	}
+}
+
+void ChunkLog::pack(unsigned long long c)
+{
+	if (m_chunks.empty()) {
+		return;
+	}
+	c = min(c, m_firstChunk + m_chunks.size() - 1);
+
+	for (unsigned long long id = max(m_packedUpTo, m_firstChunk); id < c; id++) {
+		Chunk& chunk = m_chunks[id - m_firstChunk];
+		double start = cpuMs();
+		LZCodec::compress(chunk.mem.get(), chunk.used, chunk.packed);
+
+		  // not worth the trouble of unpacking if it barely shrank
+		if (chunk.packed.size() > chunk.used * 7 / 8) {
+			vector<char>().swap(chunk.packed);
+			m_stats.chunksLeftRaw++;
+		}
+		else {
+			chunk.packed.shrink_to_fit();
+			m_held += chunk.packed.size();
+			m_held -= chunk.capacity;
+			recycle(move(chunk.mem), chunk.capacity);
+			m_stats.chunksPacked++;
+			m_stats.rawBytes += chunk.used;
+			m_stats.packedBytes += chunk.packed.size();
+		}
+		m_stats.packMs += cpuMs() - start;
+	}
+	m_packedUpTo = max(m_packedUpTo, c);
+}
+
+const char* ChunkLog::unpack(size_t i) const
+{
+	const Chunk& c = m_chunks[i];
+	if (!c.unpacked) {
+		double start = cpuMs();
+		c.unpacked.reset(new char[c.used]);
+		LZCodec::decompress(c.packed.data(), c.packed.size(), c.unpacked.get(), c.used);
+		m_unpackedIds.push_back(m_firstChunk + i);
+		m_unpackedBytes += c.used;
+		m_stats.unpacks++;
+		m_stats.unpackMs += cpuMs() - start;
+	}
+	return c.unpacked.get();
+}
+
+void ChunkLog::dropUnpacked()
+{
+	for (size_t i = 0; i < m_unpackedIds.size(); i++) {
+		unsigned long long id = m_unpackedIds[i];
+		if (id >= m_firstChunk && m_chunks[id - m_firstChunk].unpacked) {
+			m_chunks[id - m_firstChunk].unpacked.reset();
+			m_unpackedBytes -= m_chunks[id - m_firstChunk].used;
+		}
+	}
+	m_unpackedIds.clear();
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <chrono>
+#include <time.h>
+using namespace std;
+
+/*
+	Clock policies for the DataStore. Each one has the same elapsed() as
+	Timer - milliseconds since the clock was made - and the store asks it
+	on every write and every read.
+
+	SteadyClock is the real thing, read fresh every time.
+
+	CoarseClock is the kernel's monotonic clock as of the last timer tick
+	(CLOCK_MONOTONIC_COARSE), so it's only good to a few milliseconds but
+	it's just a load out of memory shared with the kernel, no reading the
+	hardware counter. Persistence is in seconds, so that's plenty.
+
+	VirtualClock only moves when it's told to with advance(), so tests and
+	benchmarks can expire things instantly and get the same answer every
+	time.
+*/
+class SteadyClock {
+public:
+	SteadyClock() : m_start(chrono::steady_clock::now()) {}
+
+	double elapsed() const {
+		return chrono::duration<double,milli>(chrono::steady_clock::now() - m_start).count();
+	}
+
+private:
+	chrono::steady_clock::time_point m_start;
+};
+
+class CoarseClock {
+public:
+	CoarseClock() : m_start(read()) {}
+
+	double elapsed() const { return read() - m_start; }
+
+private:
+	double m_start;
+
+	static double read() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+	}
+};
+
+class VirtualClock {
+public:
+	VirtualClock() : m_now(0) {}
+
+	double elapsed() const { return m_now; }
+
+	  // move time forward ms milliseconds
+	void advance(double ms) { m_now += ms; }
+
+private:
+	double m_now;
+};
+
+#endif
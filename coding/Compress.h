@@ -0,0 +1,160 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+using namespace std;
+
+/*
+	LZCodec is a small LZ77 compressor in the style of LZ4: the output is
+	a series of sequences, each one some literal bytes followed by a copy
+	of earlier output (an offset back and a length). Matches are found
+	with a hash table of the last place each 4 byte string was seen, so
+	compressing is one pass and decompressing is just memcpys, which is
+	what matters when a reader is waiting on it.
+
+	The HTBT/DATA headers and addresses repeat constantly in what the
+	Applications write, which is exactly what this is good at.
+
+	Each sequence is a token byte - literal length in the high four bits,
+	match length minus 4 in the low four, 15 meaning more length bytes
+	follow (each adding up to 255) - then the literals, then a two byte
+	offset and any extra match length. The last sequence is literals only.
+*/
+class LZCodec {
+public:
+	  // append the compressed form of in[0..n) to out
+	static void compress(const char* in, size_t n, vector<char>& out);
+
+	  // undo compress, writing exactly outSize bytes to out
+	static void decompress(const char* in, size_t n, char* out, size_t outSize);
+
+private:
+	static constexpr int HASH_BITS = 12;
+	static constexpr size_t MIN_MATCH = 4;
+	static constexpr size_t MAX_OFFSET = 65535;
+
+	static uint32_t read32(const char* p) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+	static uint32_t hash(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+	  // lengths past 15 spill into extra bytes
+	static void putLength(size_t len, vector<char>& out);
+	static size_t getLength(size_t len, const unsigned char*& p);
+
+	static void putSequence(const char* lit, size_t litLen, size_t offset, size_t matchLen,
+							vector<char>& out);
+};
+
+void LZCodec::putLength(size_t len, vector<char>& out)
+{
+	for (; len >= 255; len -= 255) {
+		out.push_back((char)255);
+	}
+	out.push_back((char)len);
+}
+
+size_t LZCodec::getLength(size_t len, const unsigned char*& p)
+{
+	if (len == 15) {
+		unsigned char b;
+		do {
+			b = *p++;
+			len += b;
+		} while (b == 255);
+	}
+	return len;
+}
+
+void LZCodec::putSequence(const char* lit, size_t litLen, size_t offset, size_t matchLen,
+						  vector<char>& out)
+{
+	size_t m = matchLen ? matchLen - MIN_MATCH : 0;
+	out.push_back((char)(((litLen < 15 ? litLen : 15) << 4) | (m < 15 ? m : 15)));
+	if (litLen >= 15) {
+		putLength(litLen - 15, out);
+	}
+	out.insert(out.end(), lit, lit + litLen);
+
+	if (matchLen) {
+		out.push_back((char)(offset & 0xff));
+		out.push_back((char)(offset >> 8));
+		if (m >= 15) {
+			putLength(m - 15, out);
+		}
+	}
+}
+
+void LZCodec::compress(const char* in, size_t n, vector<char>& out)
+{
+	  // where each hashed 4 bytes was last seen, plus one so 0 means never
+	vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+
+	size_t anchor = 0, i = 0;
+	while (n >= MIN_MATCH && i + MIN_MATCH <= n) {
+		uint32_t h = hash(read32(in + i));
+		size_t cand = table[h];
+		table[h] = i + 1;
+
+		if (cand == 0 || i - (cand - 1) > MAX_OFFSET || read32(in + cand - 1) != read32(in + i)) {
+			i++;
+			continue;
+		}
+
+		  // found one, see how far it goes
+		size_t from = cand - 1;
+		size_t len = MIN_MATCH;
+		while (i + len < n && in[from + len] == in[i + len]) {
+			len++;
+		}
+
+		putSequence(in + anchor, i - anchor, i - from, len, out);
+		i += len;
+		anchor = i;
+	}
+
+	  // whatever's left over goes out as literals
+	putSequence(in + anchor, n - anchor, 0, 0, out);
+}
+
+void LZCodec::decompress(const char* in, size_t n, char* out, size_t outSize)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+	const unsigned char* end = p + n;
+	size_t o = 0;
+
+	while (p < end) {
+		unsigned char token = *p++;
+
+		size_t litLen = getLength(token >> 4, p);
+		memcpy(out + o, p, litLen);
+		p += litLen;
+		o += litLen;
+		if (p >= end || o >= outSize) {
+			break;
+		}
+
+		size_t offset = p[0] | (p[1] << 8);
+		p += 2;
+		size_t len = getLength(token & 15, p) + MIN_MATCH;
+
+		  // the copy can overlap what it's writing, so byte by byte
+		  // unless it's far enough back
+		const char* from = out + o - offset;
+		if (offset >= len) {
+			memcpy(out + o, from, len);
+		}
+		else {
+			for (size_t k = 0; k < len; k++) {
+				out[o + k] = from[k];
+			}
+		}
+		o += len;
+	}
+}
+
+#endif
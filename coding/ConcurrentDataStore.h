@@ -0,0 +1,749 @@
+#ifndef CONCURRENTDATASTORE_H
+#define CONCURRENTDATASTORE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <set>
+#include <limits>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include "timer.h"
+#include "DataView.h"
+#include "RecordView.h"
+#include "Channel.h"
+using namespace std;
+
+/*
+	ConcurrentDataStore does everything DataStore does, but any number of
+	threads can write to it and read from it at the same time.
+
+	The data lives in a log made of segments. A writer claims space for
+	its entry by bumping the segment's reserved count with one atomic
+	add, copies its data in and then marks the entry committed, so
+	writers never wait on each other or on readers. When a segment fills
+	up, whoever overflows it links on a new one. Readers walk the log
+	from the head and stop at the first entry that hasn't been committed
+	yet, so they always see a prefix of the log and never a half-written
+	entry.
+
+	Expired entries are skipped by readers. Whole segments are only freed
+	once everything in them has expired, and even then not until every
+	reader and writer that might still be looking at them has left - each
+	of them enters the current epoch before touching the log, and a
+	segment that was unlinked in epoch e is freed once the epoch has moved
+	two past e. A view() keeps its epoch until the view is destroyed.
+
+	Readers that don't want to poll can block in waitSince() until enough
+	has been written. Each waiter registers the log position it's waiting
+	for, and writers only touch the condition variable when they commit
+	past the lowest of those, so when nobody is waiting (or everyone is
+	waiting for a lot) a write costs one extra atomic load.
+*/
+class ConcurrentDataStore {
+public:
+	static constexpr size_t SEGMENT_SIZE = 64 * 1024;
+
+	  // p is the persistence in seconds, same as DataStore
+	ConcurrentDataStore(int p);
+	~ConcurrentDataStore();
+
+	ConcurrentDataStore(const ConcurrentDataStore&) = delete;
+	ConcurrentDataStore& operator=(const ConcurrentDataStore&) = delete;
+
+	  // same idea as DataStore::Cursor - next counts writes in the order
+	  // they sit in the log and missed counts the ones that expired before
+	  // the reader got to them. pos is where the next write starts.
+	struct Cursor {
+		unsigned long long next;
+		unsigned long long missed;
+		unsigned long long pos;
+		Cursor() : next(0), missed(0), pos(0) {}
+	};
+
+	  // safe to call from any number of threads at once. Channels work
+	  // the same as DataStore's, except that reading some channels still
+	  // steps over the other channels' entries - it just doesn't hand
+	  // back their data.
+	void write(string data) { write(Channel(0), &data, 1); }
+	void write(Channel ch, string data) { write(ch, &data, 1); }
+
+	  // write n messages at once. They go in one after the other under
+	  // a single timestamp, with one reservation for all of them, so no
+	  // other writer's messages end up in between.
+	void write(const vector<string>& data) { write(Channel(0), data.data(), data.size()); }
+	void write(Channel ch, const vector<string>& data) { write(ch, data.data(), data.size()); }
+	void write(Channel ch, const string* data, size_t n) { append(ch, data, n); }
+	  // the same, for data the caller keeps somewhere else
+	void write(Channel ch, const string_view* data, size_t n) { append(ch, data, n); }
+	void read(string& data);
+	DataView view(unsigned channels = ALL_CHANNELS);
+	DataView readSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+
+	  // same as DataStore's, one Record per write
+	RecordView records(unsigned channels = ALL_CHANNELS);
+	RecordView recordsSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+	  // the same, but stopping once the records take up about maxBytes in
+	  // the store (there's always at least one, if there's any), with the
+	  // cursor left at the first one it didn't get to. more says whether
+	  // it stopped short.
+	RecordView recordsSince(Cursor& c, unsigned channels, size_t maxBytes, bool& more);
+
+	  // a Snapshot is everything that was live at one moment, frozen -
+	  // nothing written or expired after that changes it. Copies share
+	  // the same data and it's immutable, so any number of threads can
+	  // read one at once. Unlike a view it doesn't hold up reclaiming
+	  // the rest of the store, only the segments it actually points
+	  // into are kept, and only until the last copy is gone. Don't keep
+	  // one past the store itself.
+	class Snapshot {
+	public:
+		Snapshot() : m_time(0) {}
+
+		const RecordView& records() const { return *m_records; }
+		  // the same thing run together, like view()
+		DataView view() const;
+		size_t size() const { return m_records ? m_records->size() : 0; }
+		  // when it was taken, on the store's clock
+		double time() const { return m_time; }
+
+	private:
+		friend class ConcurrentDataStore;
+		shared_ptr<const RecordView> m_records;
+		double m_time;
+	};
+	Snapshot snapshot(unsigned channels = ALL_CHANNELS);
+
+	  // how snapshots are being used - how many have been taken, how
+	  // many are still around, how long they were held on to, and how
+	  // many unlinked segments are only still here because of them
+	struct SnapshotStats {
+		unsigned long long taken;
+		unsigned long long active;
+		double totalPinnedMs;
+		double maxPinnedMs;
+		size_t segmentsHeld;
+	};
+	SnapshotStats snapshotStats() const;
+
+	  // block until at least minBytes of log (headers included) have been
+	  // written past the cursor, or until maxWait has gone by, whichever
+	  // is first. Returns whether there was enough. minBytes of 1 wakes on
+	  // any write, a bigger one batches up the wakeups when writers are
+	  // busy. true is only a hint: it counts bytes writers have finished,
+	  // and a later write can finish before an earlier one, so what
+	  // readSince gets right after can still stop short at the one that
+	  // hasn't. Read, and wait again if that wasn't enough.
+	bool waitFor(const Cursor& c, size_t minBytes, chrono::microseconds maxWait);
+
+	  // waitFor and then readSince. The view can be empty if nothing
+	  // showed up in time, or if the first write past the cursor was
+	  // still being copied in.
+	DataView waitSince(Cursor& c, size_t minBytes, chrono::microseconds maxWait,
+					   unsigned channels = ALL_CHANNELS) {
+		waitFor(c, minBytes, maxWait);
+		return readSince(c, channels);
+	}
+
+	int persistence() const { return m_persistence; }
+
+	  // same as DataStore's - turn off cleaning on reads (and writes)
+	  // and call expire() on your own schedule instead, or hand the
+	  // job to a Reaper thread
+	void setExpireOnRead(bool on) { m_expireOnRead.store(on); }
+	void expire() { cleanData(); }
+
+private:
+	struct Segment {
+		const size_t capacity;
+		  // position of mem[0] in the log as a whole
+		const unsigned long long base;
+		unique_ptr<char[]> mem;
+
+		  // bytes handed out to writers - can run past capacity, anything
+		  // that does didn't fit and went to the next segment
+		atomic<size_t> reserved;
+		  // bytes writers are finished with, reaches capacity once the
+		  // segment is full and every entry in it has been committed
+		atomic<size_t> committed;
+		atomic<unsigned long long> records;
+		  // when the newest entry in here was written
+		atomic<double> newest;
+		atomic<Segment*> next;
+		  // snapshots pointing into here, it can't be freed until
+		  // they're all gone
+		atomic<long> pins;
+
+		  // log order index of the first entry in here, only kept up to
+		  // date for the head
+		unsigned long long firstIndex;
+
+		Segment(size_t cap, unsigned long long b)
+		 : capacity(cap), base(b), mem(new char[cap]()), reserved(0), committed(0),
+		   records(0), newest(0), next(nullptr), pins(0), firstIndex(0) {}
+	};
+
+	  // every entry starts with one of these, padded to 8 bytes. The
+	  // low byte of state is one of the values below, a committed entry
+	  // keeps its channel in the byte above that.
+	struct Header {
+		atomic<uint32_t> state;
+		uint32_t size;
+		double time;
+	};
+	enum { UNCOMMITTED = 0, COMMITTED = 1, PADDING = 2 };
+	static uint32_t kindOf(uint32_t state) { return state & 0xff; }
+	static bool onChannels(uint32_t state, unsigned channels) {
+		return channels & (1u << (state >> 8));
+	}
+	static constexpr size_t HEADER_SIZE = sizeof(Header);
+
+	static size_t entrySize(size_t n) { return HEADER_SIZE + ((n + 7) & ~size_t(7)); }
+
+	  // what the writes all come down to, for strings or string_views
+	template<class Str>
+	void append(Channel ch, const Str* data, size_t n);
+	static Header* headerAt(Segment* s, size_t off) {
+		return reinterpret_cast<Header*>(s->mem.get() + off);
+	}
+
+	int m_persistence;
+	Timer m_time;
+	atomic<bool> m_expireOnRead;
+
+	atomic<Segment*> m_head;
+	atomic<Segment*> m_tail;
+
+	  // epoch based reclamation, see the comment up top
+	atomic<unsigned long long> m_epoch;
+	atomic<long> m_active[2];
+	unsigned long long enterEpoch();
+	void leaveEpoch(unsigned long long e) { m_active[e & 1].fetch_sub(1); }
+
+	  // only one thread cleans at a time, anyone else who shows up
+	  // while it's busy just skips cleaning
+	mutex m_cleanLock;
+	vector<pair<Segment*,unsigned long long>> m_retired;
+
+	  // the log positions everyone in waitSince is waiting for, and the
+	  // lowest of them, which is what writers check against
+	mutex m_waitLock;
+	condition_variable m_wakeup;
+	multiset<unsigned long long> m_waitingFor;
+	atomic<unsigned long long> m_wakeAt;
+
+	  // how many bytes into the log writers have committed, counting
+	  // from the start of the newest segment. Writes commit in whatever
+	  // order they finish, so this isn't a prefix - there can be a write
+	  // before it still being copied in.
+	unsigned long long committedUpTo();
+
+	atomic<unsigned long long> m_snapshotsTaken;
+	atomic<unsigned long long> m_snapshotsActive;
+	atomic<double> m_pinnedMs;
+	atomic<double> m_maxPinnedMs;
+	atomic<size_t> m_segmentsHeld;
+	void unpin(const vector<Segment*>& segments, double since);
+
+	  // follow s->next, linking on a new segment with room for need
+	  // bytes if nobody has yet. linked is set if we were the ones who
+	  // linked it on.
+	Segment* nextSegment(Segment* s, size_t need, bool& linked);
+
+	  // unlink segments that are entirely expired and free the ones no
+	  // one can be looking at anymore
+	void cleanData();
+
+	bool expired(double t, double now) const { return t + m_persistence * 1000 <= now; }
+
+	  // a full segment whose newest entry has expired can be skipped
+	  // without looking at any of its entries, which is what keeps
+	  // reads cheap when the cleaner is running behind
+	bool skippable(Segment* s, Segment* last, double now) const {
+		return s != last && s->committed.load() == s->capacity && expired(s->newest.load(), now);
+	}
+
+	  // call f(data, size, time) for every live committed entry on the
+	  // channels in the mask, in log order. If visited isn't null every
+	  // segment looked in goes on the end of it.
+	template<class Func>
+	void forEachLive(unsigned channels, Func f, vector<Segment*>* visited = nullptr);
+
+	  // same, but only the entries the cursor hasn't seen, moving it
+	  // along as we go, and stopping before the one that would take the
+	  // total past maxBytes. True if it stopped there. Callers have to be
+	  // in an epoch.
+	template<class Func>
+	bool forEachSince(Cursor& c, unsigned channels, Func f,
+					  size_t maxBytes = numeric_limits<size_t>::max());
+
+	  // readers stop at wherever the tail was when they started, or
+	  // they could spend forever chasing writers
+	size_t endOf(Segment* s, Segment* last, size_t lastEnd) const {
+		return s == last ? lastEnd : min(s->reserved.load(), s->capacity);
+	}
+};
+
+ConcurrentDataStore::ConcurrentDataStore(int p)
+ : m_persistence(p), m_expireOnRead(true), m_epoch(2),
+   m_wakeAt(numeric_limits<unsigned long long>::max()),
+   m_snapshotsTaken(0), m_snapshotsActive(0), m_pinnedMs(0), m_maxPinnedMs(0),
+   m_segmentsHeld(0)
+{
+	Segment* s = new Segment(SEGMENT_SIZE, 0);
+	m_head.store(s);
+	m_tail.store(s);
+	m_active[0].store(0);
+	m_active[1].store(0);
+}
+
+ConcurrentDataStore::~ConcurrentDataStore()
+{
+	Segment* s = m_head.load();
+	while (s != nullptr) {
+		Segment* next = s->next.load();
+		delete s;
+		s = next;
+	}
+	for (size_t i = 0; i < m_retired.size(); i++) {
+		delete m_retired[i].first;
+	}
+}
+
+unsigned long long ConcurrentDataStore::enterEpoch()
+{
+	for (;;) {
+		unsigned long long e = m_epoch.load();
+		m_active[e & 1].fetch_add(1);
+		  // if the epoch moved on while we were registering, whoever
+		  // moved it may not have seen us, so try again
+		if (m_epoch.load() == e) {
+			return e;
+		}
+		m_active[e & 1].fetch_sub(1);
+	}
+}
+
+ConcurrentDataStore::Segment* ConcurrentDataStore::nextSegment(Segment* s, size_t need, bool& linked)
+{
+	Segment* next = s->next.load();
+	if (next == nullptr) {
+		Segment* fresh = new Segment(max(SEGMENT_SIZE, need), s->base + s->capacity);
+		if (s->next.compare_exchange_strong(next, fresh)) {
+			next = fresh;
+			linked = true;
+		}
+		else {
+			delete fresh;  // somebody beat us to it, next is theirs
+		}
+	}
+
+	  // help the tail along so other writers don't all come through here
+	Segment* expected = s;
+	m_tail.compare_exchange_strong(expected, next);
+	return next;
+}
+
+template<class Str>
+void ConcurrentDataStore::append(Channel ch, const Str* data, size_t n)
+{
+	size_t need = 0;
+	for (size_t i = 0; i < n; i++) {
+		need += entrySize(data[i].size());
+	}
+	if (need == 0) {
+		return;
+	}
+	double now = m_time.elapsed();
+
+	bool linked = false;
+	unsigned long long e = enterEpoch();
+	Segment* s = m_tail.load();
+	for (;;) {
+		size_t off = s->reserved.fetch_add(need);
+
+		if (off + need <= s->capacity) {
+			size_t at = off;
+			for (size_t i = 0; i < n; i++) {
+				Header* h = headerAt(s, at);
+				h->size = data[i].size();
+				h->time = now;
+				memcpy(s->mem.get() + at + HEADER_SIZE, data[i].data(), data[i].size());
+				at += entrySize(data[i].size());
+			}
+
+			double newest = s->newest.load();
+			while (newest < now && !s->newest.compare_exchange_weak(newest, now)) {}
+			s->records.fetch_add(n);
+
+			  // the release makes everything above visible to a reader
+			  // that sees the entry as committed
+			for (size_t i = 0; i < n; i++) {
+				headerAt(s, off)->state.store(COMMITTED | (ch.id << 8), memory_order_release);
+				off += entrySize(data[i].size());
+			}
+
+			  // wake anyone whose wait we just got past
+			if (s->base + s->committed.fetch_add(need) + need >= m_wakeAt.load()) {
+				{ lock_guard<mutex> lock(m_waitLock); }
+				m_wakeup.notify_all();
+			}
+			break;
+		}
+
+		  // we're the first one who didn't fit, so the rest of this
+		  // segment is ours to mark as padding
+		if (off < s->capacity) {
+			if (off + HEADER_SIZE <= s->capacity) {
+				headerAt(s, off)->state.store(PADDING, memory_order_release);
+			}
+			s->committed.fetch_add(s->capacity - off);
+		}
+		s = nextSegment(s, need, linked);
+	}
+	leaveEpoch(e);
+
+	  // once a segment's worth of data has gone by, it's worth seeing if
+	  // the oldest ones can go - readers aren't the only ones who clean
+	  // or a store nobody reads from would grow forever
+	if (linked && m_expireOnRead.load()) {
+		cleanData();
+	}
+}
+
+template<class Func>
+void ConcurrentDataStore::forEachLive(unsigned channels, Func f, vector<Segment*>* visited)
+{
+	double now = m_time.elapsed();
+	Segment* s = m_head.load();
+	Segment* last = m_tail.load();
+	size_t lastEnd = min(last->reserved.load(), last->capacity);
+	for (;; s = s->next.load()) {
+		if (skippable(s, last, now)) {
+			continue;
+		}
+		if (visited) {
+			visited->push_back(s);
+		}
+		size_t end = endOf(s, last, lastEnd);
+		size_t off = 0;
+		while (off + HEADER_SIZE <= end) {
+			Header* h = headerAt(s, off);
+			uint32_t state = h->state.load(memory_order_acquire);
+			if (kindOf(state) == UNCOMMITTED) {
+				return;
+			}
+			if (kindOf(state) == PADDING) {
+				break;
+			}
+			if (onChannels(state, channels) && !expired(h->time, now)) {
+				f(s->mem.get() + off + HEADER_SIZE, h->size, h->time);
+			}
+			off += entrySize(h->size);
+		}
+		if (s == last) {
+			return;
+		}
+	}
+}
+
+void ConcurrentDataStore::read(string& data)
+{
+	if (m_expireOnRead.load()) {
+		cleanData();
+	}
+	data.clear();
+	unsigned long long e = enterEpoch();
+	forEachLive(ALL_CHANNELS, [&data](const char* p, size_t n, double) { data.append(p, n); });
+	leaveEpoch(e);
+}
+
+DataView ConcurrentDataStore::view(unsigned channels)
+{
+	if (m_expireOnRead.load()) {
+		cleanData();
+	}
+	DataView v;
+	unsigned long long e = enterEpoch();
+	forEachLive(channels, [&v](const char* p, size_t n, double) { v.append(p, n); });
+	  // nothing the view points into can be freed until it's gone
+	v.pin(shared_ptr<const void>(nullptr, [this, e](const void*) { leaveEpoch(e); }));
+	return v;
+}
+
+DataView ConcurrentDataStore::readSince(Cursor& c, unsigned channels)
+{
+	if (m_expireOnRead.load()) {
+		cleanData();
+	}
+	DataView v;
+	unsigned long long e = enterEpoch();
+	forEachSince(c, channels, [&v](const char* p, size_t n, double) { v.append(p, n); });
+	v.pin(shared_ptr<const void>(nullptr, [this, e](const void*) { leaveEpoch(e); }));
+	return v;
+}
+
+RecordView ConcurrentDataStore::records(unsigned channels)
+{
+	if (m_expireOnRead.load()) {
+		cleanData();
+	}
+	RecordView r;
+	unsigned long long e = enterEpoch();
+	forEachLive(channels, [&r](const char* p, size_t n, double t) { r.append(p, n, t); });
+	r.pin(shared_ptr<const void>(nullptr, [this, e](const void*) { leaveEpoch(e); }));
+	return r;
+}
+
+RecordView ConcurrentDataStore::recordsSince(Cursor& c, unsigned channels)
+{
+	if (m_expireOnRead.load()) {
+		cleanData();
+	}
+	RecordView r;
+	unsigned long long e = enterEpoch();
+	forEachSince(c, channels, [&r](const char* p, size_t n, double t) { r.append(p, n, t); });
+	r.pin(shared_ptr<const void>(nullptr, [this, e](const void*) { leaveEpoch(e); }));
+	return r;
+}
+
+RecordView ConcurrentDataStore::recordsSince(Cursor& c, unsigned channels, size_t maxBytes, bool& more)
+{
+	if (m_expireOnRead.load()) {
+		cleanData();
+	}
+	RecordView r;
+	unsigned long long e = enterEpoch();
+	more = forEachSince(c, channels, [&r](const char* p, size_t n, double t) { r.append(p, n, t); },
+						maxBytes);
+	r.pin(shared_ptr<const void>(nullptr, [this, e](const void*) { leaveEpoch(e); }));
+	return r;
+}
+
+template<class Func>
+bool ConcurrentDataStore::forEachSince(Cursor& c, unsigned channels, Func f, size_t maxBytes)
+{
+	double now = m_time.elapsed();
+	size_t taken = 0;
+	bool full = false;
+
+	  // segments before the head are gone along with everything in them
+	Segment* s = m_head.load();
+	Segment* last = m_tail.load();
+	size_t lastEnd = min(last->reserved.load(), last->capacity);
+	if (c.pos < s->base) {
+		c.missed += s->firstIndex - c.next;
+		c.next = s->firstIndex;
+		c.pos = s->base;
+	}
+	while (s != last && c.pos >= s->base + s->capacity) {
+		s = s->next.load();
+	}
+
+	for (;;) {
+		  // a whole expired segment we haven't started on yet only
+		  // needs its entry count
+		if (c.pos == s->base && skippable(s, last, now)) {
+			c.missed += s->records.load();
+			c.next += s->records.load();
+			s = s->next.load();
+			c.pos = s->base;
+			continue;
+		}
+
+		size_t end = endOf(s, last, lastEnd);
+		size_t off = c.pos - s->base;
+		while (off + HEADER_SIZE <= end) {
+			Header* h = headerAt(s, off);
+			uint32_t state = h->state.load(memory_order_acquire);
+			if (kindOf(state) == UNCOMMITTED) {
+				end = 0;
+				break;
+			}
+			if (kindOf(state) == PADDING) {
+				off = s->capacity;
+				break;
+			}
+			if (onChannels(state, channels)) {
+				if (expired(h->time, now)) {
+					c.missed++;
+				}
+				else if (taken > 0 && taken + entrySize(h->size) > maxBytes) {
+					  // leave it for next time
+					full = true;
+					end = 0;
+					break;
+				}
+				else {
+					taken += entrySize(h->size);
+					f(s->mem.get() + off + HEADER_SIZE, h->size, h->time);
+				}
+			}
+			c.next++;
+			off += entrySize(h->size);
+		}
+		c.pos = s->base + off;
+
+		  // only move on once we've used up this whole segment
+		Segment* next = s->next.load();
+		if (end == 0 || s == last || next == nullptr || off + HEADER_SIZE <= s->capacity) {
+			break;
+		}
+		c.pos = next->base;
+		s = next;
+	}
+	return full;
+}
+
+unsigned long long ConcurrentDataStore::committedUpTo()
+{
+	unsigned long long e = enterEpoch();
+	Segment* s = m_tail.load();
+	unsigned long long pos = s->base + s->committed.load();
+	leaveEpoch(e);
+	return pos;
+}
+
+bool ConcurrentDataStore::waitFor(const Cursor& c, size_t minBytes, chrono::microseconds maxWait)
+{
+	auto deadline = chrono::steady_clock::now() + maxWait;
+	unsigned long long target = c.pos + minBytes;
+
+	unique_lock<mutex> lock(m_waitLock);
+	auto me = m_waitingFor.insert(target);
+	m_wakeAt.store(*m_waitingFor.begin());
+
+	  // m_wakeAt is stored before we look at how far writers have got,
+	  // and writers commit before they look at m_wakeAt, so either we see
+	  // their write here or they see us waiting and wake us
+	while (committedUpTo() < target
+		   && m_wakeup.wait_until(lock, deadline) != cv_status::timeout) {}
+	bool enough = committedUpTo() >= target;
+
+	m_waitingFor.erase(me);
+	m_wakeAt.store(m_waitingFor.empty() ? numeric_limits<unsigned long long>::max()
+										: *m_waitingFor.begin());
+	return enough;
+}
+
+void ConcurrentDataStore::cleanData()
+{
+	unique_lock<mutex> lock(m_cleanLock, try_to_lock);
+	if (!lock.owns_lock()) {
+		return;
+	}
+
+	double now = m_time.elapsed();
+	Segment* s = m_head.load();
+
+	  // a segment can go once something comes after it, every entry in
+	  // it is committed and even the newest one has expired
+	while (s->next.load() != nullptr && s->committed.load() == s->capacity
+		   && expired(s->newest.load(), now)) {
+		Segment* next = s->next.load();
+		next->firstIndex = s->firstIndex + s->records.load();
+
+		Segment* expected = s;
+		m_tail.compare_exchange_strong(expected, next);
+		m_head.store(next);
+
+		m_retired.push_back(make_pair(s, m_epoch.load()));
+		s = next;
+	}
+
+	  // move the epoch along if nobody is left from two epochs ago,
+	  // twice if we can, which is what it takes to free what we just
+	  // unlinked
+	unsigned long long epoch = m_epoch.load();
+	for (int i = 0; i < 2 && m_active[(epoch + 1) & 1].load() == 0; i++) {
+		m_epoch.store(++epoch);
+	}
+
+	  // anything unlinked at least two epochs ago can't be seen anymore,
+	  // except by a snapshot
+	size_t kept = 0, held = 0;
+	for (size_t i = 0; i < m_retired.size(); i++) {
+		bool old = m_retired[i].second + 2 <= epoch;
+		if (old && m_retired[i].first->pins.load() == 0) {
+			delete m_retired[i].first;
+		}
+		else {
+			held += old;
+			m_retired[kept++] = m_retired[i];
+		}
+	}
+	m_retired.resize(kept);
+	m_segmentsHeld.store(held);
+}
+
+  // the pins go on while we're still in the epoch, so nothing we saw
+  // can have been freed yet, and the cleaner won't free anything pinned
+  // after that
+ConcurrentDataStore::Snapshot ConcurrentDataStore::snapshot(unsigned channels)
+{
+	if (m_expireOnRead.load()) {
+		cleanData();
+	}
+	shared_ptr<RecordView> r = make_shared<RecordView>();
+	vector<Segment*> pinned;
+
+	unsigned long long e = enterEpoch();
+	double now = m_time.elapsed();
+	forEachLive(channels, [&r](const char* p, size_t n, double t) { r->append(p, n, t); }, &pinned);
+	for (size_t i = 0; i < pinned.size(); i++) {
+		pinned[i]->pins.fetch_add(1);
+	}
+	leaveEpoch(e);
+
+	m_snapshotsTaken.fetch_add(1);
+	m_snapshotsActive.fetch_add(1);
+	r->pin(shared_ptr<const void>(nullptr, [this, pinned, now](const void*) { unpin(pinned, now); }));
+
+	Snapshot snap;
+	snap.m_records = r;
+	snap.m_time = now;
+	return snap;
+}
+
+void ConcurrentDataStore::unpin(const vector<Segment*>& segments, double since)
+{
+	for (size_t i = 0; i < segments.size(); i++) {
+		segments[i]->pins.fetch_sub(1);
+	}
+	m_snapshotsActive.fetch_sub(1);
+
+	double held = m_time.elapsed() - since;
+	double total = m_pinnedMs.load();
+	while (!m_pinnedMs.compare_exchange_weak(total, total + held)) {}
+	double most = m_maxPinnedMs.load();
+	while (most < held && !m_maxPinnedMs.compare_exchange_weak(most, held)) {}
+}
+
+ConcurrentDataStore::SnapshotStats ConcurrentDataStore::snapshotStats() const
+{
+	SnapshotStats stats;
+	stats.taken = m_snapshotsTaken.load();
+	stats.active = m_snapshotsActive.load();
+	stats.totalPinnedMs = m_pinnedMs.load();
+	stats.maxPinnedMs = m_maxPinnedMs.load();
+	stats.segmentsHeld = m_segmentsHeld.load();
+	return stats;
+}
+
+DataView ConcurrentDataStore::Snapshot::view() const
+{
+	DataView v;
+	if (m_records) {
+		for (const Record& r : *m_records) {
+			v.append(r.data.data(), r.data.size());
+		}
+		v.pin(m_records);
+	}
+	return v;
+}
+
+#endif
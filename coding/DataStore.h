@@ -1,46 +1,220 @@
 #ifndef DATASTORE_H
 #define DATASTORE_H
 
-#include <list>
 #include <string>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <string_view>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <limits>
 #include <iostream>
-#include "timer.h"
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "Clock.h"
+#include "ChunkLog.h"
+#include "DataView.h"
+#include "RecordView.h"
+#include "TimingWheel.h"
+#include "Channel.h"
+#include "Stats.h"
+#include "WriteAheadLog.h"
 using namespace std;
 
-class DataStore {
+/*
+	ClockPolicy is where the store gets the time from, see Clock.h.
+	DataStore is the one on the real clock, which is what you want
+	unless you're testing or benchmarking.
+*/
+template<class ClockPolicy>
+class BasicDataStore: public ClockPolicy
+{
 public:
-	DataStore(int p)
-	 : m_persistence(p)
+	BasicDataStore(int p)
+	 : m_persistence(p), m_size(0), m_firstSeq(0), m_expireOnRead(true),
+	   m_dead(0), m_custom(0), m_compressAfter(-1), m_dedup(false), m_wallBase(0)
 	{ }
 
+    // a Cursor remembers how far one reader has gotten through the
+    // store, like an offset into a Kafka topic. next is the sequence
+    // number of the first write the reader hasn't seen yet. If the
+    // reader falls so far behind that writes expire before it gets to
+    // them, readSince skips ahead and adds how many it lost to missed.
+  struct Cursor {
+    unsigned long long next;
+    unsigned long long missed;
+    Cursor() : next(0), missed(0) {}
+  };
+
     // write numChars characters to the network,
     // when this function completes, the network will
     // have a copy of each char between data[0] and
     // data[numChars-1] for persistence() milliseconds.
-  void write(string data) {
-    	// add the written data into your data
-  	list<char>::iterator it = m_data.insert(m_data.end(), data.begin(), data.end());
-      // push back the clean up entry into the entries.
-    m_entries.push(entry(it, data.size(), m_time.elapsed()));
+    // Every write gets the next sequence number (starting
+    // at 0), which is returned.
+  unsigned long long write(string data) {
+    return write(Channel(0), data, m_persistence);
+  }
+
+    // same as write, except this data only lasts ttl seconds
+    // instead of persistence() seconds
+  unsigned long long write(string data, double ttl) {
+    return write(Channel(0), data, ttl);
+  }
+
+    // same as the two above, but the write goes on channel ch.
+    // Sequence numbers are shared by all the channels.
+  unsigned long long write(Channel ch, string data) {
+    return write(ch, data, m_persistence);
+  }
+  unsigned long long write(Channel ch, string data, double ttl) {
+    return write(ch, &data, 1, ttl);
+  }
+
+    // write n messages at once, same as writing them one after the
+    // other but they all share one timestamp and there's only one
+    // trip through here. They get consecutive sequence numbers and
+    // the first one is returned - except with dedup on, where a repeat
+    // keeps the number of the entry it refreshed (and if it's the
+    // first, that's what's returned), and only the new ones get the
+    // next numbers in order.
+  unsigned long long write(const vector<string>& data) {
+    return write(Channel(0), data.data(), data.size(), m_persistence);
+  }
+  unsigned long long write(Channel ch, const vector<string>& data) {
+    return write(ch, data.data(), data.size(), m_persistence);
   }
+  unsigned long long write(Channel ch, const string* data, size_t n, double ttl);
 
     // read all data currently in the network,
     // when this function returns, the string s refers
     // to contains a copy of all data in DataStore
-    // BIG PROBLEM WITH m_data AS LIST: this takes
-    // linear time to the number of characters...!
   void read(string& data) {
-      // first remove any outdated data
-    cleanData();
-  	  // fill their array with data
+    StatTimer timer(m_stats.readLatency);
+      // first get rid of any outdated data
+    prepareRead();
+  	  // fill their array with data, a run at a time
     data.clear();
-    list<char>::iterator it = m_data.begin();
-    for (; it != m_data.end(); ++it) {
-      data.push_back(*it);
+    data.reserve(m_size);
+    forEachLive(0, [&data](const char* p, size_t n) {
+      data.append(p, n);
+    });
+    DATASTORE_STAT(m_stats.read(data.size()));
+  }
+
+    // same as read but without the copy - the view points straight
+    // into the store's chunks. It stays good until the next call that
+    // can expire data (read or view), so parse it and let it go.
+    // channels is a mask of which channels to include.
+  DataView view(unsigned channels = ALL_CHANNELS) {
+    StatTimer timer(m_stats.readLatency);
+    prepareRead();
+    DataView v;
+    forEachLive(0, channels, [&v](const char* p, size_t n) {
+      v.append(p, n);
+    });
+    DATASTORE_STAT(m_stats.read(v.size()));
+    return v;
+  }
+
+    // view of only the writes the cursor hasn't seen yet, moving the
+    // cursor up to the end of the store. Same rules as view for how
+    // long the result is good for. Writes on channels that aren't in
+    // the mask don't count towards missed, unless they had already
+    // come off the front of the store - there's no telling what
+    // channel those were on anymore.
+  DataView readSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+
+    // same as view and readSince, but write by write - every write
+    // comes back as its own Record with its length and the time it was
+    // written, instead of being run together with the rest
+  RecordView records(unsigned channels = ALL_CHANNELS) {
+    StatTimer timer(m_stats.readLatency);
+    prepareRead();
+    RecordView r;
+    size_t bytes = 0;
+    forEachEntry(0, channels, [this, &r, &bytes](const entry& e) {
+      r.append(m_data.at(e.start), e.size, e.timeEntered);
+      bytes += e.size;
+    });
+    DATASTORE_STAT(m_stats.read(bytes));
+    return r;
+  }
+  RecordView recordsSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+
+    // only what was written from t0 through t1, in milliseconds on the
+    // store's clock (the same as elapsed() and Record::time), like the
+    // last few hundred milliseconds of heartbeats. The first write in
+    // the range is found by binary search, so a short range costs about
+    // the same however much is in the store. Same rules as view for how
+    // long the result is good for. With dedup on, a write that only
+    // refreshed an entry counts as when that entry was written.
+  DataView readRange(double t0, double t1, unsigned channels = ALL_CHANNELS);
+  RecordView recordsRange(double t0, double t1, unsigned channels = ALL_CHANNELS);
+
+    // by default every read cleans out expired data before it
+    // looks at anything. Turn that off to expire on your own
+    // schedule instead (from a timer, an event loop, ...) by calling
+    // expire(), so a read after a quiet spell doesn't get stuck
+    // paying for everything that expired in the meantime. Reads then
+    // just skip over anything expired that hasn't been cleaned yet.
+  void setExpireOnRead(bool on) { m_expireOnRead = on; }
+  void expire() { cleanData(); }
+
+    // with long persistence most of the store is old data nobody
+    // looks at much. With this on, whenever the store cleans up it
+    // also compresses every chunk whose newest write is at least
+    // seconds old. Reading compressed data unpacks a copy that lasts
+    // until the next clean up, same as a view. Negative turns it off,
+    // which is the default.
+  void setCompressAfter(double seconds) { m_compressAfter = seconds; }
+
+    // how well compression is doing and what it's costing, to tune
+    // setCompressAfter by
+  const ChunkLog::Stats& compressionStats() const { return m_data.stats(); }
+
+    // bytes of memory holding data right now, compressed or not
+  size_t memoryUsed() const { return m_data.bytesHeld(); }
+
+    // most of what gets written is the same few messages over and over
+    // (heartbeats, rebroadcasts). With dedup on, writing something that
+    // is already live on the same channel doesn't add a new entry - the
+    // one that's there just lasts longer, and its sequence number is
+    // what the write returns. Readers following a cursor don't see the
+    // repeat. So the front of the store isn't held up forever by one
+    // message being refreshed, once an entry is half way through its
+    // life a repeat moves it to the end as a new entry instead.
+  void setDedup(bool on) { m_dedup = on; }
+
+    // keep a write-ahead log in dir so what's written survives the
+    // process dying (see WriteAheadLog.h). Whatever the log already
+    // has that hasn't expired yet is put back in the store first, so
+    // this has to come before any writes. Writes don't wait for the
+    // disk - each one is on it within about maxCommitDelay, and sync()
+    // waits until everything written so far is. Throws runtime_error
+    // if the log can't be opened.
+  void setDurable(string dir, chrono::microseconds maxCommitDelay = chrono::milliseconds(2));
+  void sync() {
+    if (m_wal) {
+      m_wal->sync();
     }
   }
 
+    // how the log is doing, all zeros if the store isn't durable
+  WalStats durabilityStats() const { return m_wal ? m_wal->stats() : WalStats(); }
+
+    // what the store has done so far and how long it took, plus how
+    // it looks right now - see Stats.h
+  StoreStats stats() const;
+
+    // sequence number the next write will get
+  unsigned long long nextSequence() const {
+    return m_firstSeq + m_entries.size();
+  }
+
     // returns an integer representing the number of
     // milliseconds the network holds onto data written
     // to it for
@@ -53,82 +227,597 @@ public:
     printEntries();
   }
 
-private:
+  // BoundedDataStore evicts entries itself, so it gets at these
+protected:
 
-	list<char> m_data;
+	ChunkLog m_data;
 	int m_persistence;
-  Timer m_time;
+    // number of live characters across all entries
+  size_t m_size;
 
   struct entry {
-    list<char>::iterator start;
+    ChunkLog::Loc start;
     int size;
     double timeEntered;
-    entry(list<char>::iterator it, int s, double t)
-     : start(it), size(s), timeEntered(t) {}
+    double expiresAt;
+      // whether it's still around - an entry that expires while
+      // something older is still live has to wait its turn to
+      // come off the front
+    bool live;
+      // whether it was written with its own ttl
+    bool custom;
+    unsigned char channel;
+    entry(ChunkLog::Loc loc, int s, double t, double e, bool c, unsigned char ch)
+     : start(loc), size(s), timeEntered(t), expiresAt(e), live(true), custom(c),
+       channel(ch) {}
   };
 
     // need to remember where each data starts and end and
-    // when it was inserted for cleaning up
-  queue<entry> m_entries;
+    // when it was inserted for cleaning up. The entry at the
+    // front has sequence number m_firstSeq, the one after it
+    // m_firstSeq+1 and so on.
+  deque<entry> m_entries;
+  unsigned long long m_firstSeq;
+
+    // the sequence numbers of the entries on each channel, in order,
+    // so reading one channel never has to look at the others
+  deque<unsigned long long> m_channels[Channel::MAX];
+
+  bool m_expireOnRead;
+
+    // every entry is waiting in here (by sequence number) for its
+    // expiry, one tick per millisecond
+  TimingWheel<unsigned long long> m_wheel;
+    // entries that have expired but are stuck behind live ones, and
+    // live entries that were written with their own ttl
+  size_t m_dead;
+  size_t m_custom;
+
+    // in seconds, negative if we don't compress
+  double m_compressAfter;
+
+    // with dedup on, the latest sequence number written for each
+    // payload hash. Entries that have gone stay in here until a sweep
+    // finds them, so anything in it has to be checked.
+  bool m_dedup;
+  unordered_map<size_t, unsigned long long> m_latest;
+
+  static size_t hashOf(Channel ch, const string& data) {
+    return hash<string_view>()(data) ^ (size_t(ch.id) * 0x9e3779b97f4a7c15ULL);
+  }
+
+    // if data is live on ch already and young enough, push its expiry
+    // out to expiresAt and set seq to it. Otherwise retire any old copy
+    // and return false so it gets written again.
+  bool refresh(Channel ch, const string& data, double now, double expiresAt,
+               unsigned long long& seq);
+
+    // drop hashes of entries that are gone, once there are enough of them
+  void sweepLatest();
+
+    // put one message on the end, or with dedup on maybe just refresh
+    // the copy that's there, and return its sequence number
+  unsigned long long put(Channel ch, const string& data, double now, double expiresAt, bool custom);
+
+    // with setDurable, the log, and the wall clock time when elapsed()
+    // was 0, so times in the log mean something after a restart
+  unique_ptr<WriteAheadLog> m_wal;
+  double m_wallBase;
+
+  static double wallNow() {
+    return chrono::duration<double,milli>(chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  StoreStats m_stats;
+
+    // compress whatever has gone cold
+  void packCold(double now);
+
+  bool expired(const entry& e, double now) const {
+    return !e.live || e.expiresAt <= now;
+  }
+
+    // when nothing in m_entries has died out of order and everyone
+    // has the same ttl, entries expire front to back and everything
+    // live is one contiguous stretch of the log
+  bool inOrder() const { return m_dead == 0 && m_custom == 0; }
+
+    // mark an entry as gone and take it out of the counts
+  void kill(entry& e);
+
+    // clean up first if reads are meant to
+  void prepareRead() {
+    if (m_expireOnRead) {
+      cleanData();
+    }
+  }
+
+    // call f(ptr, len) for each run of live data in entries from
+    // index i on, returning the number of entries skipped because
+    // they expired
+  template<class Func>
+  size_t forEachLive(size_t i, Func f) const;
+
+    // same, but only for entries on the channels in the mask
+  template<class Func>
+  size_t forEachLive(size_t i, unsigned channels, Func f) const;
+
+    // call f(entry) for each live entry on the channels in the mask
+    // from index i on (up to but not including index end), one at a
+    // time, returning the number skipped
+  template<class Func>
+  size_t forEachEntry(size_t i, unsigned channels, Func f,
+                      size_t end = numeric_limits<size_t>::max()) const;
+
+    // the index of the first entry written at or after t0, and of the
+    // first written after t1
+  pair<size_t, size_t> rangeOf(double t0, double t1) const;
+
+    // get ready to read from where the cursor is up to, catching it
+    // up past anything that's gone, and return the index of the
+    // first entry it hasn't seen
+  size_t startFrom(Cursor& c);
 
     // function that goes through the data, removing any data
     // that is too old (timeEntered > m_persistence)
   void cleanData();
 
+    // pop whatever is expired or dead off the front and hand back
+    // the chunks that frees up
+  void dropFront(double now);
+
     // useful helper print functions
   void printData() const;
   void printEntries() const;
 };
 
-// this runs in time linear to the number of entries and
-// number of characters removed but actually still better than using
-// a vector since that runs in time linear to number of
-// characters removed plus number of characters after last one
-// removed. So that's good.
-void DataStore::cleanData() {
+template<class ClockPolicy>
+unsigned long long BasicDataStore<ClockPolicy>::write(Channel ch, const string* data, size_t n, double ttl) {
+  StatTimer timer(m_stats.writeLatency);
+    // everything in one write goes in at the same time, so the
+    // clock only gets read once
+  double now = this->elapsed();
+  double expiresAt = now + ttl * 1000;
+  bool custom = ttl != m_persistence;
+  unsigned long long first = nextSequence();
+  size_t bytes = 0;
+
+    // into the log first - append throws if the log can't be written,
+    // and then none of this should have been seen
+  if (m_wal) {
+    m_wal->append(ch.id, data, n, m_wallBase + now, ttl * 1000);
+  }
+  for (size_t i = 0; i < n; i++) {
+    bytes += data[i].size();
+    unsigned long long seq = put(ch, data[i], now, expiresAt, custom);
+    if (i == 0) {
+      first = seq;
+    }
+  }
+  DATASTORE_STAT(m_stats.wrote(n, bytes));
+  return first;
+}
+
+template<class ClockPolicy>
+unsigned long long BasicDataStore<ClockPolicy>::put(Channel ch, const string& data, double now,
+                                                    double expiresAt, bool custom) {
+  unsigned long long seq;
+  if (m_dedup && refresh(ch, data, now, expiresAt, seq)) {
+    return seq;
+  }
+  seq = nextSequence();
+
+	  // copy the written data onto the end of the log in one go
+  ChunkLog::Loc loc = m_data.append(data.data(), data.size());
+  m_size += data.size();
+
+    // push back the clean up entry into the entries, and get
+    // the wheel to tell us when it's up
+  m_entries.push_back(entry(loc, data.size(), now, expiresAt, custom, ch.id));
+  m_channels[ch.id].push_back(seq);
+  m_wheel.schedule(seq, (unsigned long long)ceil(expiresAt));
+  if (m_dedup) {
+    m_latest[hashOf(ch, data)] = seq;
+  }
+  if (custom) {
+    m_custom++;
+  }
+  return seq;
+}
+
+template<class ClockPolicy>
+void BasicDataStore<ClockPolicy>::setDurable(string dir, chrono::microseconds maxCommitDelay) {
+  if (m_wal || nextSequence() != 0) {
+    throw runtime_error("DataStore: setDurable has to come before anything is written");
+  }
+  m_wal.reset(new WriteAheadLog(dir, maxCommitDelay));
+  double now = this->elapsed();
+  m_wallBase = wallNow() - now;
+
+    // back in they go, each at the time it was first written. They're
+    // already in the log so they don't get written to it again. The
+    // wall clock can go backwards between writes, but the entries have
+    // to stay in time order, so a time earlier than the one before it
+    // (or later than now) is moved up to it.
+  double last = numeric_limits<double>::lowest();
+  m_wal->replay(m_wallBase + now, [this, &last, now](const WriteAheadLog::Record& r) {
+    double entered = min(max(r.written - m_wallBase, last), now);
+    last = entered;
+    put(Channel(r.channel), string(r.data), entered, entered + r.ttl, r.ttl != m_persistence * 1000.0);
+  });
+}
+
+template<class ClockPolicy>
+bool BasicDataStore<ClockPolicy>::refresh(Channel ch, const string& data, double now,
+                                          double expiresAt, unsigned long long& seq) {
+  auto it = m_latest.find(hashOf(ch, data));
+  if (it == m_latest.end() || it->second < m_firstSeq) {
+    return false;
+  }
+  entry& e = m_entries[it->second - m_firstSeq];
+  if (expired(e, now) || e.channel != ch.id || (size_t)e.size != data.size()
+      || memcmp(m_data.at(e.start), data.data(), data.size()) != 0) {
+    return false;
+  }
+
+    // past half way, so it goes to the back instead
+  if (now - e.timeEntered >= (e.expiresAt - e.timeEntered) / 2) {
+    kill(e);
+    return false;
+  }
+
+    // it doesn't expire in write order anymore, which is what custom
+    // entries are already handled as
+  e.expiresAt = max(e.expiresAt, expiresAt);
+  if (!e.custom) {
+    e.custom = true;
+    m_custom++;
+  }
+  seq = it->second;
+  DATASTORE_STAT(m_stats.deduplicated++);
+  return true;
+}
 
-  // if it was entered more than m_persistence seconds (x1000 = ms) ago
-  // remove it
+template<class ClockPolicy>
+void BasicDataStore<ClockPolicy>::sweepLatest() {
+  if (m_latest.size() < 64 || m_latest.size() < 2 * (m_entries.size() - m_dead)) {
+    return;
+  }
+  for (auto it = m_latest.begin(); it != m_latest.end(); ) {
+    if (it->second < m_firstSeq || !m_entries[it->second - m_firstSeq].live) {
+      it = m_latest.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+template<class ClockPolicy>
+void BasicDataStore<ClockPolicy>::kill(entry& e) {
+  e.live = false;
+  m_size -= e.size;
+  m_dead++;
+  if (e.custom) {
+    m_custom--;
+  }
+}
+
+// the timing wheel hands us whatever has expired, at O(1) a piece.
+// Those entries get marked dead, and then any dead ones at the front
+// come off. The characters themselves are never touched - the head of
+// the log just moves past them, and once the head has moved out of a
+// chunk the whole chunk goes back on the free list. Then, since views
+// from before this are no longer good, anything that was unpacked to
+// read can go, and anything that's gone cold gets packed.
+template<class ClockPolicy>
+void BasicDataStore<ClockPolicy>::cleanData() {
+
+  StatTimer timer(m_stats.cleanLatency);
+  DATASTORE_STAT(m_stats.cleanups++);
+
+  double now = this->elapsed();
+  vector<unsigned long long> refreshed;
+  m_wheel.advance((unsigned long long)now, [this, now, &refreshed](unsigned long long seq) {
+      // it may already have come off the front on its own
+    if (seq >= m_firstSeq && m_entries[seq - m_firstSeq].live) {
+      entry& e = m_entries[seq - m_firstSeq];
+        // or been refreshed by a duplicate since it was scheduled
+      if (e.expiresAt > now) {
+        refreshed.push_back(seq);
+        return;
+      }
+      kill(e);
+      DATASTORE_STAT(m_stats.expired(e.size));
+    }
+  });
+  for (size_t i = 0; i < refreshed.size(); i++) {
+    m_wheel.schedule(refreshed[i],
+        (unsigned long long)ceil(m_entries[refreshed[i] - m_firstSeq].expiresAt));
+  }
+  dropFront(now);
+  if (m_dedup) {
+    sweepLatest();
+  }
+  if (m_wal) {
+    m_wal->expire(m_wallBase + now);
+  }
+
+  m_data.dropUnpacked();
+  if (m_compressAfter >= 0) {
+    packCold(now);
+  }
+}
+
+// entries go in oldest first, so a binary search finds the first one
+// that's still warm, and every chunk before its chunk is cold
+template<class ClockPolicy>
+void BasicDataStore<ClockPolicy>::packCold(double now) {
+  double cutoff = now - m_compressAfter * 1000;
+  auto warm = partition_point(m_entries.begin(), m_entries.end(),
+                [cutoff](const entry& e) { return e.timeEntered <= cutoff; });
+  if (warm == m_entries.begin()) {
+    return;
+  }
+  m_data.pack(warm == m_entries.end() ? m_entries.back().start.chunk + 1
+                                      : warm->start.chunk);
+}
+
+template<class ClockPolicy>
+void BasicDataStore<ClockPolicy>::dropFront(double now) {
   while (!m_entries.empty()) {
     entry& f = m_entries.front();
 
-      // if the entry is still valid, then all the ones after it
-      // are too, so stop
-    if (f.timeEntered + m_persistence * 1000 > m_time.elapsed()) {
-      return;
+      // the wheel only goes to the last whole millisecond, so
+      // double check the front ourselves
+    if (!expired(f, now)) {
+      break;
     }
-
-      // remove all characters starting at the entries start
-      // and ending after size characters have been removed
-    list<char>::iterator del = f.start;
-    for (int i = 0; i < f.size; i++) {
-      del = m_data.erase(del);
+    if (f.live) {
+      kill(f);
+      DATASTORE_STAT(m_stats.expired(f.size));
     }
 
       // remove this entry and go to the next one
-    m_entries.pop();
+    m_dead--;
+    m_channels[f.channel].pop_front();
+    m_entries.pop_front();
+    m_firstSeq++;
+  }
+
+    // hand back any chunks the head has moved past
+  if (m_entries.empty()) {
+    m_data.clear();
+  }
+  else {
+    m_data.releaseBefore(m_entries.front().start.chunk);
   }
 }
 
-void DataStore::printData() const {
-  cout << " -- printData --" << endl;
-  list<char>::const_iterator it = m_data.begin();
-  for (; it != m_data.end(); ++it) {
-    cout << *it;
+// when entries are in order, everything live is one stretch from the
+// first live entry to the end. If we cleaned on the way in that's the
+// front. Otherwise the front is usually still good, which is one
+// comparison, and if it isn't a binary search finds the first live one.
+// Entries that have died out of order mean checking them one by one.
+template<class ClockPolicy>
+template<class Func>
+size_t BasicDataStore<ClockPolicy>::forEachLive(size_t i, Func f) const {
+  double now = this->elapsed();
+
+  if (inOrder()) {
+    size_t first = i;
+    if (first < m_entries.size() && expired(m_entries[first], now)) {
+      first = partition_point(m_entries.begin() + i, m_entries.end(),
+                [this, now](const entry& e) { return expired(e, now); })
+              - m_entries.begin();
+    }
+    if (first < m_entries.size()) {
+      m_data.forEachRun(m_entries[first].start, f);
+    }
+    return first - i;
+  }
+
+  size_t skipped = 0;
+  for (; i < m_entries.size(); i++) {
+    const entry& e = m_entries[i];
+    if (expired(e, now)) {
+      skipped++;
+    }
+    else {
+      f(m_data.at(e.start), e.size);
+    }
+  }
+  return skipped;
+}
+
+template<class ClockPolicy>
+template<class Func>
+size_t BasicDataStore<ClockPolicy>::forEachLive(size_t i, unsigned channels, Func f) const {
+  if (channels == ALL_CHANNELS) {
+    return forEachLive(i, f);
+  }
+  return forEachEntry(i, channels, [this, &f](const entry& e) {
+    f(m_data.at(e.start), e.size);
+  });
+}
+
+// the channels' sequence numbers are merged back into write order,
+// starting from the first of each at or after index i. With one channel
+// there's nothing to merge, it's just a walk down that channel.
+template<class ClockPolicy>
+template<class Func>
+size_t BasicDataStore<ClockPolicy>::forEachEntry(size_t i, unsigned channels, Func f,
+                                                 size_t end) const {
+  double now = this->elapsed();
+  size_t skipped = 0;
+  end = min(end, m_entries.size());
+
+  if (channels == ALL_CHANNELS) {
+    for (; i < end; i++) {
+      if (expired(m_entries[i], now)) {
+        skipped++;
+      }
+      else {
+        f(m_entries[i]);
+      }
+    }
+    return skipped;
+  }
+
+  unsigned long long from = m_firstSeq + i, to = m_firstSeq + end;
+
+  const deque<unsigned long long>* lists[Channel::MAX];
+  size_t at[Channel::MAX];
+  int n = 0;
+  for (unsigned ch = 0; ch < Channel::MAX; ch++) {
+    if ((channels & (1u << ch)) && !m_channels[ch].empty()) {
+      lists[n] = &m_channels[ch];
+      at[n] = lower_bound(m_channels[ch].begin(), m_channels[ch].end(), from)
+              - m_channels[ch].begin();
+      n++;
+    }
+  }
+
+  for (;;) {
+    int next = -1;
+    for (int l = 0; l < n; l++) {
+      if (at[l] < lists[l]->size()
+          && (next < 0 || (*lists[l])[at[l]] < (*lists[next])[at[next]])) {
+        next = l;
+      }
+    }
+    if (next < 0 || (*lists[next])[at[next]] >= to) {
+      return skipped;
+    }
+
+    const entry& e = m_entries[(*lists[next])[at[next]++] - m_firstSeq];
+    if (expired(e, now)) {
+      skipped++;
+    }
+    else {
+      f(e);
+    }
+  }
+}
+
+template<class ClockPolicy>
+size_t BasicDataStore<ClockPolicy>::startFrom(Cursor& c) {
+  prepareRead();
+
+    // anything before the oldest write we still have has already
+    // expired, so the reader will never see it
+  if (c.next < m_firstSeq) {
+    c.missed += m_firstSeq - c.next;
+    c.next = m_firstSeq;
   }
+  return min<unsigned long long>(c.next - m_firstSeq, m_entries.size());
+}
+
+template<class ClockPolicy>
+DataView BasicDataStore<ClockPolicy>::readSince(Cursor& c, unsigned channels) {
+  StatTimer timer(m_stats.readLatency);
+  size_t from = startFrom(c);
+
+    // and neither will it see anything after that which expired
+  DataView v;
+  c.missed += forEachLive(from, channels, [&v](const char* p, size_t n) {
+    v.append(p, n);
+  });
+  c.next = nextSequence();
+  DATASTORE_STAT(m_stats.read(v.size()));
+  return v;
+}
+
+template<class ClockPolicy>
+RecordView BasicDataStore<ClockPolicy>::recordsSince(Cursor& c, unsigned channels) {
+  StatTimer timer(m_stats.readLatency);
+  size_t from = startFrom(c);
+
+  RecordView r;
+  size_t bytes = 0;
+  c.missed += forEachEntry(from, channels, [this, &r, &bytes](const entry& e) {
+    r.append(m_data.at(e.start), e.size, e.timeEntered);
+    bytes += e.size;
+  });
+  c.next = nextSequence();
+  DATASTORE_STAT(m_stats.read(bytes));
+  return r;
+}
+
+// entries go in oldest first, the same as for packCold, so they're
+// already an index by time and the ends of a range are two binary
+// searches away
+template<class ClockPolicy>
+pair<size_t, size_t> BasicDataStore<ClockPolicy>::rangeOf(double t0, double t1) const {
+  auto first = partition_point(m_entries.begin(), m_entries.end(),
+                 [t0](const entry& e) { return e.timeEntered < t0; });
+  auto last = partition_point(first, m_entries.end(),
+                [t1](const entry& e) { return e.timeEntered <= t1; });
+  return make_pair(first - m_entries.begin(), last - m_entries.begin());
+}
+
+template<class ClockPolicy>
+DataView BasicDataStore<ClockPolicy>::readRange(double t0, double t1, unsigned channels) {
+  StatTimer timer(m_stats.readLatency);
+  prepareRead();
+  pair<size_t, size_t> range = rangeOf(t0, t1);
+
+  DataView v;
+  forEachEntry(range.first, channels, [this, &v](const entry& e) {
+    v.append(m_data.at(e.start), e.size);
+  }, range.second);
+  DATASTORE_STAT(m_stats.read(v.size()));
+  return v;
+}
+
+template<class ClockPolicy>
+RecordView BasicDataStore<ClockPolicy>::recordsRange(double t0, double t1, unsigned channels) {
+  StatTimer timer(m_stats.readLatency);
+  prepareRead();
+  pair<size_t, size_t> range = rangeOf(t0, t1);
+
+  RecordView r;
+  size_t bytes = 0;
+  forEachEntry(range.first, channels, [this, &r, &bytes](const entry& e) {
+    r.append(m_data.at(e.start), e.size, e.timeEntered);
+    bytes += e.size;
+  }, range.second);
+  DATASTORE_STAT(m_stats.read(bytes));
+  return r;
+}
+
+template<class ClockPolicy>
+StoreStats BasicDataStore<ClockPolicy>::stats() const {
+  StoreStats s = m_stats;
+  s.liveEntries = m_entries.size() - m_dead;
+  s.liveBytes = m_size;
+  s.memoryUsed = memoryUsed();
+  return s;
+}
+
+template<class ClockPolicy>
+void BasicDataStore<ClockPolicy>::printData() const {
+  cout << " -- printData --" << endl;
+  forEachLive(0, [](const char* p, size_t n) {
+    cout.write(p, n);
+  });
   cout << endl;
 }
 
-void DataStore::printEntries() const {
+template<class ClockPolicy>
+void BasicDataStore<ClockPolicy>::printEntries() const {
   cout << " -- printEntries --" << endl;
-  queue<entry> temp(m_entries);
-  int numEntries = temp.size();
-  while (numEntries-- > 0) {
-    entry f = temp.front();
-    cout << *(f.start) << " " << f.timeEntered << " ";
+  for (const entry& f : m_entries) {
+    if (f.live) {
+      cout << string(m_data.at(f.start), f.size) << " " << f.timeEntered
+           << "-" << f.expiresAt << " ";
+    }
   }
   cout << endl;
-  cout << "totalsize: " << m_entries.size() << " data size: " << m_data.size() << endl; 
+  cout << "totalsize: " << m_entries.size() << " data size: " << m_size
+       << " chunks: " << m_data.numChunks() << endl;
 }
 
+using DataStore = BasicDataStore<SteadyClock>;
+
 #endif
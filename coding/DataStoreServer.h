@@ -0,0 +1,579 @@
+#ifndef DATASTORESERVER_H
+#define DATASTORESERVER_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "ConcurrentDataStore.h"
+#include "Wire.h"
+using namespace std;
+
+/*
+	DataStoreServer puts a ConcurrentDataStore on a Unix domain socket so
+	Applications in any process on the machine can use it through a
+	RemoteDataStore. It speaks the protocol in Wire.h.
+
+	It's one thread running one epoll loop over every connection. Each
+	time a connection is readable what it has sent is read in a few big
+	reads and the whole requests in it are answered, so pipelined
+	requests cost one read and (usually) one send for the lot. Replies
+	queue up per connection and go out with one sendmsg over as many of
+	them as fit in an iovec array, so nothing gets copied into one big
+	buffer first. Anything the socket won't take waits for EPOLLOUT.
+
+	No one connection gets to hog the loop or the memory: only so many
+	of its requests are answered per round, with the rest left for the
+	next one, and once it has MAX_QUEUED bytes of replies it isn't
+	reading, nothing more is read from it or answered until it reads
+	some.
+
+	Subscribers get pushed whatever is new after every round of the
+	loop that wrote something, unless they're that far behind already,
+	in which case they catch up once they've read some.
+
+	The store is only touched from the loop's thread, but since it's a
+	ConcurrentDataStore other threads in the server process can use it
+	too (a Reaper, say).
+*/
+class DataStoreServer {
+public:
+	  // listen on the socket at path, replacing whatever is there already.
+	  // Throws runtime_error if it can't.
+	DataStoreServer(ConcurrentDataStore& ds, string path);
+	~DataStoreServer();
+
+	DataStoreServer(const DataStoreServer&) = delete;
+	DataStoreServer& operator=(const DataStoreServer&) = delete;
+
+	  // serve until stop() is called
+	void run();
+
+	  // make run() return, from any thread
+	void stop();
+
+	  // running totals, for whoever is watching
+	unsigned long long requests() const { return m_requests.load(); }
+	unsigned long long connections() const { return m_accepted.load(); }
+
+private:
+	static constexpr size_t READ_SIZE = 64 * 1024;
+	static constexpr int MAX_IOV = 64;
+	  // reads and requests for one connection in one round of the loop
+	static constexpr int MAX_READS = 4;
+	static constexpr int MAX_REQUESTS = 256;
+	  // replies a connection can have waiting before it's ignored
+	static constexpr size_t MAX_QUEUED = 8 << 20;
+	  // about the most records one RECORDS_REPLY carries, anything past
+	  // that they have to ask for again
+	static constexpr size_t REPLY_BYTES = 4 << 20;
+
+	struct Connection {
+		int fd;
+		string in;
+		deque<string> out;
+		  // how much of out.front() has gone already, and how much of
+		  // out is still to go
+		size_t sent;
+		size_t queued;
+		  // what epoll is watching it for
+		uint32_t events;
+		bool subscribed;
+		  // a subscriber that got skipped for being too far behind
+		bool behind;
+		unsigned channels;
+		ConcurrentDataStore::Cursor cursor;
+		Connection()
+		 : fd(-1), sent(0), queued(0), events(EPOLLIN), subscribed(false), behind(false),
+		   channels(0) {}
+		bool full() const { return queued >= MAX_QUEUED; }
+	};
+
+	ConcurrentDataStore& m_ds;
+	string m_path;
+	int m_listen;
+	int m_epoll;
+	int m_wake;
+	atomic<bool> m_stop;
+	atomic<unsigned long long> m_requests;
+	atomic<unsigned long long> m_accepted;
+
+	unordered_map<int, Connection> m_conns;
+	  // connections with whole requests left over from the last round
+	unordered_set<int> m_busy;
+	  // set when a round of the loop wrote anything, so subscribers
+	  // need looking at
+	bool m_wrote;
+
+	void acceptAll();
+
+	  // read what's there and answer it. False means the connection is
+	  // finished with.
+	bool readFrom(Connection& c);
+	  // answer what whole requests have come in, as many as it gets
+	  // this round
+	bool serve(Connection& c);
+	bool hasRequest(const Connection& c) const;
+	bool handle(Connection& c, uint32_t op, const char* body, size_t size);
+
+	  // queue up a RECORDS_REPLY for what's new since the cursor. False
+	  // if one record on its own is too big to send.
+	bool replyRecords(Connection& c, const RecordView& r, const ConcurrentDataStore::Cursor& cursor,
+					  bool more);
+	void fail(Connection& c, string message);
+	void queue(Connection& c, string reply) {
+		c.queued += reply.size();
+		c.out.push_back(move(reply));
+	}
+
+	  // send what's queued. False if the connection broke.
+	bool flush(Connection& c);
+	  // have epoll watch for whatever the connection is ready for now
+	void watch(Connection& c);
+	void drop(int fd);
+
+	void pushToSubscribers();
+};
+
+DataStoreServer::DataStoreServer(ConcurrentDataStore& ds, string path)
+ : m_ds(ds), m_path(path), m_listen(-1), m_epoll(-1), m_wake(-1), m_stop(false),
+   m_requests(0), m_accepted(0), m_wrote(false)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw runtime_error("DataStoreServer: socket path too long: " + path);
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	  // clear out a socket left behind by a server that didn't get to
+	  // clean up, but nothing else - a typo in the path shouldn't cost
+	  // anybody a file
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path.c_str());
+	}
+
+	m_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listen < 0 || bind(m_listen, (sockaddr*)&addr, sizeof(addr)) != 0
+		|| listen(m_listen, SOMAXCONN) != 0) {
+		string why = strerror(errno);
+		if (m_listen >= 0) {
+			close(m_listen);
+		}
+		throw runtime_error("DataStoreServer: can't listen on " + path + ": " + why);
+	}
+
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = m_listen;
+	bool ok = m_epoll >= 0 && m_wake >= 0
+			  && epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_listen, &ev) == 0;
+	ev.data.fd = m_wake;
+	if (!ok || epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev) != 0) {
+		  // the destructor won't run, so nothing else will close these
+		string why = strerror(errno);
+		if (m_wake >= 0) {
+			close(m_wake);
+		}
+		if (m_epoll >= 0) {
+			close(m_epoll);
+		}
+		close(m_listen);
+		unlink(path.c_str());
+		throw runtime_error("DataStoreServer: can't set up polling for " + path + ": " + why);
+	}
+}
+
+DataStoreServer::~DataStoreServer()
+{
+	for (auto& c : m_conns) {
+		close(c.first);
+	}
+	close(m_wake);
+	close(m_epoll);
+	close(m_listen);
+	unlink(m_path.c_str());
+}
+
+void DataStoreServer::stop()
+{
+	m_stop.store(true);
+	uint64_t one = 1;
+	ssize_t ignored = ::write(m_wake, &one, sizeof(one));
+	(void)ignored;
+}
+
+void DataStoreServer::run()
+{
+	epoll_event events[64];
+	while (!m_stop.load()) {
+		  // don't sit waiting while there are requests left to answer
+		int n = epoll_wait(m_epoll, events, 64, m_busy.empty() && !m_wrote ? -1 : 0);
+		if (n < 0 && errno != EINTR) {
+			throw runtime_error(string("DataStoreServer: epoll_wait: ") + strerror(errno));
+		}
+
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == m_listen) {
+				acceptAll();
+				continue;
+			}
+			if (fd == m_wake) {
+				continue;
+			}
+
+			auto it = m_conns.find(fd);
+			if (it == m_conns.end()) {
+				continue;
+			}
+			Connection& c = it->second;
+			bool ok = !(events[i].events & EPOLLERR);
+			if (ok && (events[i].events & (EPOLLIN | EPOLLHUP)) && (c.events & EPOLLIN)) {
+				ok = readFrom(c);
+			}
+			if (ok) {
+				ok = flush(c);
+			}
+			if (!ok) {
+				drop(fd);
+				continue;
+			}
+			  // it's read enough of what it had to be worth carrying on with
+			if (!c.full() && hasRequest(c)) {
+				m_busy.insert(fd);
+			}
+			if (!c.full() && c.behind) {
+				m_wrote = true;
+			}
+		}
+
+		  // then another turn for everyone with requests left over
+		vector<int> busy(m_busy.begin(), m_busy.end());
+		m_busy.clear();
+		for (int fd : busy) {
+			auto it = m_conns.find(fd);
+			if (it == m_conns.end() || it->second.full()) {
+				continue;
+			}
+			Connection& c = it->second;
+			if (!(serve(c) && flush(c))) {
+				drop(fd);
+			}
+			else if (!c.full() && hasRequest(c)) {
+				m_busy.insert(fd);
+			}
+		}
+
+		if (m_wrote) {
+			m_wrote = false;
+			pushToSubscribers();
+		}
+	}
+}
+
+void DataStoreServer::acceptAll()
+{
+	for (;;) {
+		int fd = accept4(m_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			  // we'd never hear from it, so don't keep it - but the
+			  // clients that are already connected carry on
+			close(fd);
+			continue;
+		}
+		Connection& c = m_conns[fd];
+		c.fd = fd;
+		m_accepted.fetch_add(1);
+	}
+}
+
+bool DataStoreServer::readFrom(Connection& c)
+{
+	char buf[READ_SIZE];
+	bool open = true;
+	for (int reads = 0; reads < MAX_READS; reads++) {
+		ssize_t got = ::read(c.fd, buf, READ_SIZE);
+		if (got > 0) {
+			c.in.append(buf, got);
+			continue;
+		}
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		  // they may have hung up right after sending, answer what they
+		  // sent anyway
+		open = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+		break;
+	}
+
+	if (!serve(c)) {
+		return false;
+	}
+	if (!open) {
+		flush(c);
+	}
+	return open;
+}
+
+bool DataStoreServer::serve(Connection& c)
+{
+	  // answer whole requests until it's had its turn, then keep
+	  // whatever is left for next time
+	size_t used = 0;
+	uint32_t op;
+	size_t size;
+	bool bad = false;
+	for (int n = 0; n < MAX_REQUESTS && !c.full()
+		 && Wire::frameAt(c.in.data() + used, c.in.size() - used, op, size, bad); n++) {
+		m_requests.fetch_add(1);
+		if (!handle(c, op, c.in.data() + used + Wire::HEADER_SIZE, size)) {
+			return false;
+		}
+		used += Wire::HEADER_SIZE + size;
+	}
+	if (bad) {
+		fail(c, "frame too big");
+		return false;
+	}
+	c.in.erase(0, used);
+	return true;
+}
+
+bool DataStoreServer::hasRequest(const Connection& c) const
+{
+	uint32_t op;
+	size_t size;
+	bool bad;
+	return Wire::frameAt(c.in.data(), c.in.size(), op, size, bad) || bad;
+}
+
+bool DataStoreServer::handle(Connection& c, uint32_t op, const char* body, size_t size)
+{
+	if (c.subscribed) {
+		fail(c, "subscribed connections can't make requests");
+		return false;
+	}
+
+	Wire::Reader r(body, size);
+	if (op == Wire::WRITE) {
+		uint32_t channel = r.get32();
+		uint32_t count = r.get32();
+		vector<string> data;
+		for (uint32_t i = 0; r.ok() && i < count; i++) {
+			string_view s = r.getBytes();
+			data.push_back(string(s));
+		}
+		if (!r.ok() || channel >= Channel::MAX) {
+			fail(c, "bad WRITE");
+			return false;
+		}
+		m_ds.write(Channel(channel), data);
+		m_wrote = true;
+
+		string reply;
+		Wire::Writer w(reply, Wire::OK);
+		w.end();
+		queue(c, move(reply));
+		return true;
+	}
+
+	unsigned channels = r.get32();
+	ConcurrentDataStore::Cursor cursor;
+	if (op == Wire::RECORDS_SINCE || op == Wire::SUBSCRIBE) {
+		cursor.next = r.get64();
+		cursor.missed = r.get64();
+		cursor.pos = r.get64();
+	}
+	if (!r.ok()) {
+		fail(c, "bad request");
+		return false;
+	}
+
+	if (op == Wire::RECORDS || op == Wire::RECORDS_SINCE) {
+		  // RECORDS is the same as from a cursor that hasn't seen anything
+		bool more;
+		RecordView records = m_ds.recordsSince(cursor, channels, REPLY_BYTES, more);
+		return replyRecords(c, records, cursor, more);
+	}
+	else if (op == Wire::SUBSCRIBE) {
+		c.subscribed = true;
+		c.channels = channels;
+		c.cursor = cursor;
+		  // start them off with whatever is already there
+		m_wrote = true;
+	}
+	else {
+		fail(c, "unknown op");
+		return false;
+	}
+	return true;
+}
+
+bool DataStoreServer::replyRecords(Connection& c, const RecordView& records,
+								   const ConcurrentDataStore::Cursor& cursor, bool more)
+{
+	  // only a single record can go past REPLY_BYTES, and it can't be
+	  // split
+	if (records.size() == 1 && records[0].data.size() > Wire::MAX_FRAME - 64) {
+		fail(c, "record too big to send");
+		return false;
+	}
+
+	string reply;
+	Wire::Writer w(reply, Wire::RECORDS_REPLY);
+	w.put64(cursor.next);
+	w.put64(cursor.missed);
+	w.put64(cursor.pos);
+	w.put32(more);
+	w.put32(records.size());
+	for (const Record& r : records) {
+		w.putDouble(r.time);
+		w.putBytes(r.data.data(), r.data.size());
+	}
+	w.end();
+	queue(c, move(reply));
+	return true;
+}
+
+void DataStoreServer::fail(Connection& c, string message)
+{
+	string reply;
+	Wire::Writer w(reply, Wire::ERROR);
+	w.putBytes(message.data(), message.size());
+	w.end();
+	queue(c, move(reply));
+	  // one last try at telling them why
+	flush(c);
+}
+
+bool DataStoreServer::flush(Connection& c)
+{
+	while (!c.out.empty()) {
+		iovec iov[MAX_IOV];
+		int n = 0;
+		for (auto it = c.out.begin(); it != c.out.end() && n < MAX_IOV; ++it, ++n) {
+			size_t skip = n == 0 ? c.sent : 0;
+			iov[n].iov_base = &(*it)[skip];
+			iov[n].iov_len = it->size() - skip;
+		}
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		ssize_t sent = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		  // take off whatever went completely
+		c.queued -= sent;
+		size_t left = sent;
+		while (left > 0) {
+			size_t rest = c.out.front().size() - c.sent;
+			if (left < rest) {
+				c.sent += left;
+				break;
+			}
+			left -= rest;
+			c.out.pop_front();
+			c.sent = 0;
+		}
+	}
+
+	watch(c);
+	return true;
+}
+
+  // only ask about writability while there's something waiting, and
+  // only read more once what's been read already is answered and they're
+  // reading the answers
+void DataStoreServer::watch(Connection& c)
+{
+	uint32_t events = 0;
+	if (!c.full() && !hasRequest(c)) {
+		events |= EPOLLIN;
+	}
+	if (!c.out.empty()) {
+		events |= EPOLLOUT;
+	}
+	if (c.events == events) {
+		return;
+	}
+	c.events = events;
+	epoll_event ev;
+	ev.events = events;
+	ev.data.fd = c.fd;
+	epoll_ctl(m_epoll, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void DataStoreServer::drop(int fd)
+{
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	m_conns.erase(fd);
+	m_busy.erase(fd);
+}
+
+void DataStoreServer::pushToSubscribers()
+{
+	vector<int> broken;
+	for (auto& entry : m_conns) {
+		Connection& c = entry.second;
+		if (!c.subscribed) {
+			continue;
+		}
+		  // they'll get it once they've read what they've got
+		c.behind = c.full();
+		if (c.behind) {
+			continue;
+		}
+		bool more;
+		RecordView records = m_ds.recordsSince(c.cursor, c.channels, REPLY_BYTES, more);
+		if (records.empty()) {
+			continue;
+		}
+		  // the rest goes next round
+		if (more) {
+			m_wrote = true;
+		}
+		if (!replyRecords(c, records, c.cursor, more) || !flush(c)) {
+			broken.push_back(entry.first);
+		}
+	}
+	for (int fd : broken) {
+		drop(fd);
+	}
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef DATAVIEW_H
+#define DATAVIEW_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+using namespace std;
+
+/*
+	A DataView is what DataStore::view() hands back instead of a copy of
+	everything in the store. It's a list of spans pointing straight into
+	the store's memory, in the order the data was written. It looks
+	enough like a const string (size, operator[], substr, compare) that
+	the Protocol can parse it exactly the same way it parses the string
+	read() fills in.
+
+	A view doesn't own the memory it points into, so it's only good until
+	the store next expires data (the next read(), view(), etc). Stores that
+	can't promise that - anything shared between threads - pin whatever
+	the view points into and the pin is released when the view goes away.
+*/
+class DataView {
+public:
+	DataView() : m_size(0), m_last(0) {}
+
+	  // add n bytes starting at p to the end of the view. Runs that pick
+	  // up right where the last one left off are merged into it.
+	void append(const char* p, size_t n);
+
+	  // keep whatever p points to alive for as long as this view is
+	void pin(shared_ptr<const void> p) { m_pins.push_back(move(p)); }
+
+	size_t size() const  { return m_size; }
+	bool   empty() const { return m_size == 0; }
+	const vector<string_view>& spans() const { return m_spans; }
+
+	  // the char at position i, or '\0' past the end
+	char operator[](size_t i) const;
+
+	  // same as the string versions: copy out [pos, pos+n) and compare
+	  // [pos, pos+n) against s without copying
+	string substr(size_t pos, size_t n = string::npos) const;
+	int    compare(size_t pos, size_t n, const string& s) const;
+
+	  // copy the whole view out into one string
+	string str() const { return substr(0); }
+
+private:
+	vector<string_view> m_spans;
+	  // m_starts[i] is the position of the first char of m_spans[i]
+	vector<size_t> m_starts;
+	size_t m_size;
+
+	vector<shared_ptr<const void>> m_pins;
+
+	  // the Protocol walks a view front to back, so remember which span
+	  // we landed in last and look there first
+	mutable size_t m_last;
+
+	  // index of the span holding position i (i < m_size)
+	size_t spanOf(size_t i) const;
+};
+
+void DataView::append(const char* p, size_t n)
+{
+	if (n == 0) {
+		return;
+	}
+
+	if (!m_spans.empty() && m_spans.back().data() + m_spans.back().size() == p) {
+		m_spans.back() = string_view(m_spans.back().data(), m_spans.back().size() + n);
+	}
+	else {
+		m_spans.push_back(string_view(p, n));
+		m_starts.push_back(m_size);
+	}
+	m_size += n;
+}
+
+size_t DataView::spanOf(size_t i) const
+{
+	if (i >= m_starts[m_last] && i < m_starts[m_last] + m_spans[m_last].size()) {
+		return m_last;
+	}
+	if (m_last + 1 < m_spans.size() && i >= m_starts[m_last+1]
+		&& i < m_starts[m_last+1] + m_spans[m_last+1].size()) {
+		return ++m_last;
+	}
+
+	  // binary search for the last span starting at or before i
+	size_t lo = 0, hi = m_spans.size();
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (m_starts[mid] <= i) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return m_last = lo;
+}
+
+char DataView::operator[](size_t i) const
+{
+	if (i >= m_size) {
+		return '\0';
+	}
+	size_t s = spanOf(i);
+	return m_spans[s][i - m_starts[s]];
+}
+
+string DataView::substr(size_t pos, size_t n) const
+{
+	string result;
+	if (pos >= m_size) {
+		return result;
+	}
+	n = min(n, m_size - pos);
+	result.reserve(n);
+
+	size_t s = spanOf(pos);
+	size_t off = pos - m_starts[s];
+	while (n > 0) {
+		size_t take = min(n, m_spans[s].size() - off);
+		result.append(m_spans[s].data() + off, take);
+		n -= take;
+		off = 0;
+		s++;
+	}
+	return result;
+}
+
+int DataView::compare(size_t pos, size_t n, const string& str) const
+{
+	n = (pos >= m_size) ? 0 : min(n, m_size - pos);
+
+	size_t i = 0;
+	if (n > 0) {
+		size_t s = spanOf(pos);
+		size_t off = pos - m_starts[s];
+		for (; i < n && i < str.size(); i++, off++) {
+			if (off == m_spans[s].size()) {
+				s++;
+				off = 0;
+			}
+			if (m_spans[s][off] != str[i]) {
+				return (unsigned char)m_spans[s][off] < (unsigned char)str[i] ? -1 : 1;
+			}
+		}
+	}
+
+	if (n == str.size()) {
+		return 0;
+	}
+	return n < str.size() ? -1 : 1;
+}
+
+#endif
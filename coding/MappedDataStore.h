@@ -0,0 +1,418 @@
+#ifndef MAPPEDDATASTORE_H
+#define MAPPEDDATASTORE_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <stdexcept>
+#include <filesystem>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "DataView.h"
+#include "RecordView.h"
+#include "Channel.h"
+using namespace std;
+
+/*
+	MappedDataStore keeps its data in files instead of on the heap, so
+	whatever is in it survives the process going away and can grow past
+	what fits in memory - the kernel pages the files in and out for us.
+
+	The log is a directory of segment files, each one preallocated at a
+	fixed size and mapped into memory. Writes are copied straight into the
+	mapping of the newest segment; when that fills up a new one is made.
+	Every entry is stored with a header holding its size, its channel and
+	the wall clock time it was written, so when the store is opened again
+	it can walk the files, rebuild its index and still know what has
+	expired and who it was for.
+	Reads hand back views straight into the mappings. Segment files are
+	deleted once everything in them has expired.
+
+	Segment files are named after the sequence number of their first
+	entry, so sequence numbers (and cursors) carry on across restarts.
+*/
+class MappedDataStore {
+public:
+	static constexpr size_t SEGMENT_SIZE = 1 << 20;
+
+	  // open the store kept in directory dir, creating it if there isn't
+	  // one yet. p is the persistence in seconds. Throws runtime_error if
+	  // the files can't be created or mapped.
+	MappedDataStore(string dir, int p, size_t segmentSize = SEGMENT_SIZE);
+	~MappedDataStore();
+
+	MappedDataStore(const MappedDataStore&) = delete;
+	MappedDataStore& operator=(const MappedDataStore&) = delete;
+
+	  // same as DataStore::Cursor
+	struct Cursor {
+		unsigned long long next;
+		unsigned long long missed;
+		Cursor() : next(0), missed(0) {}
+	};
+
+	  // same as DataStore's, channels included. Record::time is wall
+	  // clock milliseconds since the epoch, since that's what survives
+	  // a restart.
+	unsigned long long write(string data) { return write(Channel(0), data); }
+	unsigned long long write(Channel ch, string data);
+	unsigned long long write(Channel ch, const vector<string>& data);
+	void read(string& data);
+	DataView view(unsigned channels = ALL_CHANNELS);
+	DataView readSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+	RecordView records(unsigned channels = ALL_CHANNELS);
+	RecordView recordsSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+
+	void setExpireOnRead(bool on) { m_expireOnRead = on; }
+	void expire() { cleanData(); }
+
+	  // block until everything written so far is on disk, not just in
+	  // the page cache
+	void sync();
+
+	unsigned long long nextSequence() const { return m_firstSeq + m_entries.size(); }
+	int persistence() const { return m_persistence; }
+
+private:
+	struct Segment {
+		string path;
+		int fd;
+		char* map;
+		size_t capacity;
+		size_t used;
+		Segment(string p, int f, char* m, size_t c)
+		 : path(p), fd(f), map(m), capacity(c), used(0) {}
+	};
+
+	  // written in front of every entry in a segment file
+	struct Header {
+		atomic<uint32_t> state;
+		uint32_t size;
+		double time;
+		uint32_t channel;
+		uint32_t unused;
+	};
+	enum { EMPTY = 0, WRITTEN = 1 };
+	static constexpr size_t HEADER_SIZE = sizeof(Header);
+	static size_t entrySize(size_t n) { return HEADER_SIZE + ((n + 7) & ~size_t(7)); }
+
+	struct entry {
+		unsigned long long segment;
+		size_t offset;
+		uint32_t size;
+		double time;
+		unsigned channel;
+		entry(unsigned long long s, size_t o, uint32_t n, double t, unsigned ch)
+		 : segment(s), offset(o), size(n), time(t), channel(ch) {}
+	};
+
+	string m_dir;
+	int m_persistence;
+	size_t m_segmentSize;
+	bool m_expireOnRead;
+
+	  // m_segments[0] has id m_firstSegment, the last one is the one
+	  // being written to
+	deque<Segment> m_segments;
+	unsigned long long m_firstSegment;
+
+	  // m_entries[0] has sequence number m_firstSeq
+	deque<entry> m_entries;
+	unsigned long long m_firstSeq;
+
+	  // milliseconds since the epoch - it has to mean the same thing
+	  // to whoever opens the files next
+	static double now() {
+		return chrono::duration<double,milli>(
+				chrono::system_clock::now().time_since_epoch()).count();
+	}
+	bool expired(const entry& e, double t) const { return e.time + m_persistence * 1000 <= t; }
+
+	const char* dataOf(const entry& e) const {
+		return m_segments[e.segment - m_firstSegment].map + e.offset + HEADER_SIZE;
+	}
+
+	  // map a segment file, creating and preallocating it if need be
+	Segment openSegment(string path, size_t capacity, bool create);
+	void closeSegment(Segment& s, bool remove);
+
+	  // walk an existing segment file, adding its entries to m_entries
+	void recover(unsigned long long id);
+
+	void cleanData();
+
+	  // get ready to read from where the cursor is up to, catching it
+	  // up past anything that's gone, and return the index of the
+	  // first entry it hasn't seen
+	size_t startFrom(Cursor& c);
+
+	  // call f(entry) for each live entry from i on that's on one of the
+	  // channels in the mask, returning how many of those had expired
+	template<class Func>
+	size_t forEachEntry(size_t i, unsigned channels, Func f) const;
+};
+
+MappedDataStore::MappedDataStore(string dir, int p, size_t segmentSize)
+ : m_dir(dir), m_persistence(p), m_segmentSize(segmentSize), m_expireOnRead(true),
+   m_firstSegment(0), m_firstSeq(0)
+{
+	filesystem::create_directories(m_dir);
+
+	  // segment files are named after their first sequence number,
+	  // zero padded, so sorting the names puts them in order
+	vector<string> names;
+	for (const auto& f : filesystem::directory_iterator(m_dir)) {
+		string name = f.path().filename().string();
+		if (name.size() > 8 && name.compare(0, 4, "seg-") == 0
+			&& name.compare(name.size() - 4, 4, ".log") == 0) {
+			names.push_back(name);
+		}
+	}
+	sort(names.begin(), names.end());
+
+	for (size_t i = 0; i < names.size(); i++) {
+		unsigned long long first = stoull(names[i].substr(4, names[i].size() - 8));
+		string path = m_dir + "/" + names[i];
+		size_t size = filesystem::file_size(path);
+		if (size < HEADER_SIZE) {
+			  // never got as far as being sized, there's nothing in it
+			unlink(path.c_str());
+			continue;
+		}
+
+		  // a segment that starts past where we're up to means whatever
+		  // was in between is gone, so count it as expired
+		if (m_segments.empty() || first > nextSequence()) {
+			m_entries.clear();
+			m_firstSeq = first;
+		}
+		m_segments.push_back(openSegment(path, size, false));
+		recover(m_firstSegment + m_segments.size() - 1);
+	}
+
+	if (m_segments.empty()) {
+		char name[32];
+		snprintf(name, sizeof(name), "seg-%020llu.log", nextSequence());
+		m_segments.push_back(openSegment(m_dir + "/" + name, m_segmentSize, true));
+	}
+
+	  // drop anything that expired while nobody had the store open
+	cleanData();
+}
+
+MappedDataStore::~MappedDataStore()
+{
+	for (size_t i = 0; i < m_segments.size(); i++) {
+		closeSegment(m_segments[i], false);
+	}
+}
+
+MappedDataStore::Segment MappedDataStore::openSegment(string path, size_t capacity, bool create)
+{
+	int fd = open(path.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+	if (fd < 0) {
+		throw runtime_error("MappedDataStore: can't open " + path + ": " + strerror(errno));
+	}
+
+	  // actually reserve the blocks so running out of disk shows up
+	  // here and not as a SIGBUS halfway through a write
+	if (create && posix_fallocate(fd, 0, capacity) != 0 && ftruncate(fd, capacity) != 0) {
+		close(fd);
+		throw runtime_error("MappedDataStore: can't size " + path + ": " + strerror(errno));
+	}
+
+	void* map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		throw runtime_error("MappedDataStore: can't map " + path + ": " + strerror(errno));
+	}
+	return Segment(path, fd, static_cast<char*>(map), capacity);
+}
+
+void MappedDataStore::closeSegment(Segment& s, bool remove)
+{
+	munmap(s.map, s.capacity);
+	close(s.fd);
+	if (remove) {
+		unlink(s.path.c_str());
+	}
+}
+
+void MappedDataStore::recover(unsigned long long id)
+{
+	Segment& s = m_segments[id - m_firstSegment];
+
+	  // entries are only marked written once their data is in, so the
+	  // first one that isn't is where the last run stopped. A channel
+	  // that can't be right means the same thing.
+	size_t off = 0;
+	while (off + HEADER_SIZE <= s.capacity) {
+		Header* h = reinterpret_cast<Header*>(s.map + off);
+		if (h->state.load(memory_order_acquire) != WRITTEN
+			|| off + entrySize(h->size) > s.capacity || h->channel >= Channel::MAX) {
+			break;
+		}
+		m_entries.push_back(entry(id, off, h->size, h->time, h->channel));
+		off += entrySize(h->size);
+	}
+	s.used = off;
+}
+
+unsigned long long MappedDataStore::write(Channel ch, string data)
+{
+	size_t need = entrySize(data.size());
+
+	  // start a new segment if this doesn't fit in the current one
+	Segment* s = &m_segments.back();
+	if (s->used + need > s->capacity) {
+		char name[32];
+		snprintf(name, sizeof(name), "seg-%020llu.log", nextSequence());
+		m_segments.push_back(openSegment(m_dir + "/" + name, max(m_segmentSize, need), true));
+		s = &m_segments.back();
+	}
+
+	  // data first, then the header that says it's there
+	Header* h = reinterpret_cast<Header*>(s->map + s->used);
+	memcpy(s->map + s->used + HEADER_SIZE, data.data(), data.size());
+	h->size = data.size();
+	h->time = now();
+	h->channel = ch.id;
+	h->state.store(WRITTEN, memory_order_release);
+
+	m_entries.push_back(entry(m_firstSegment + m_segments.size() - 1, s->used, h->size,
+							  h->time, ch.id));
+	s->used += need;
+	return nextSequence() - 1;
+}
+
+  // one after the other - they still get consecutive sequence numbers,
+  // and the first one is returned
+unsigned long long MappedDataStore::write(Channel ch, const vector<string>& data)
+{
+	unsigned long long first = nextSequence();
+	for (const string& d : data) {
+		write(ch, d);
+	}
+	return first;
+}
+
+void MappedDataStore::sync()
+{
+	for (size_t i = 0; i < m_segments.size(); i++) {
+		msync(m_segments[i].map, m_segments[i].used, MS_SYNC);
+	}
+}
+
+void MappedDataStore::cleanData()
+{
+	double t = now();
+	while (!m_entries.empty() && expired(m_entries.front(), t)) {
+		m_entries.pop_front();
+		m_firstSeq++;
+	}
+
+	  // a segment with nothing live left in it is done with, unless
+	  // it's the one we're still writing to
+	while (m_segments.size() > 1
+		   && (m_entries.empty() || m_entries.front().segment > m_firstSegment)) {
+		closeSegment(m_segments.front(), true);
+		m_segments.pop_front();
+		m_firstSegment++;
+	}
+}
+
+template<class Func>
+size_t MappedDataStore::forEachEntry(size_t i, unsigned channels, Func f) const
+{
+	double t = now();
+	size_t skipped = 0;
+	for (; i < m_entries.size(); i++) {
+		const entry& e = m_entries[i];
+		if (!(channels & (1u << e.channel))) {
+			continue;
+		}
+		if (expired(e, t)) {
+			skipped++;
+		}
+		else {
+			f(e);
+		}
+	}
+	return skipped;
+}
+
+void MappedDataStore::read(string& data)
+{
+	if (m_expireOnRead) {
+		cleanData();
+	}
+	data.clear();
+	forEachEntry(0, ALL_CHANNELS, [this, &data](const entry& e) {
+		data.append(dataOf(e), e.size);
+	});
+}
+
+DataView MappedDataStore::view(unsigned channels)
+{
+	if (m_expireOnRead) {
+		cleanData();
+	}
+	DataView v;
+	forEachEntry(0, channels, [this, &v](const entry& e) { v.append(dataOf(e), e.size); });
+	return v;
+}
+
+RecordView MappedDataStore::records(unsigned channels)
+{
+	if (m_expireOnRead) {
+		cleanData();
+	}
+	RecordView r;
+	forEachEntry(0, channels, [this, &r](const entry& e) {
+		r.append(dataOf(e), e.size, e.time);
+	});
+	return r;
+}
+
+size_t MappedDataStore::startFrom(Cursor& c)
+{
+	if (m_expireOnRead) {
+		cleanData();
+	}
+	if (c.next < m_firstSeq) {
+		c.missed += m_firstSeq - c.next;
+		c.next = m_firstSeq;
+	}
+	return min<unsigned long long>(c.next - m_firstSeq, m_entries.size());
+}
+
+DataView MappedDataStore::readSince(Cursor& c, unsigned channels)
+{
+	size_t from = startFrom(c);
+	DataView v;
+	c.missed += forEachEntry(from, channels, [this, &v](const entry& e) {
+		v.append(dataOf(e), e.size);
+	});
+	c.next = nextSequence();
+	return v;
+}
+
+RecordView MappedDataStore::recordsSince(Cursor& c, unsigned channels)
+{
+	size_t from = startFrom(c);
+	RecordView r;
+	c.missed += forEachEntry(from, channels, [this, &r](const entry& e) {
+		r.append(dataOf(e), e.size, e.time);
+	});
+	c.next = nextSequence();
+	return r;
+}
+
+#endif
@@ -2,7 +2,9 @@
 #define PROTOCOL_H
 
 #include "Encode.h"
+#include "Channel.h"
 #include <map>
+#include <string_view>
 
 /*
 	SimpleProtocol is just that, simple.
@@ -18,9 +20,23 @@ public:
 	  // write
 	string prepareHeartbeat(string addr) const;
 	string prepareData(string data, string addr) const;
-	  // read
-	bool getNextConnection(int& startIdx, const string& rawData, string& addr) const;
-	bool getNextData(int& startIdx, const string& rawData, string& data, string& addr) const;
+	  // read - RawData is anything that looks like a const string:
+	  // the string filled in by DataStore::read or a DataView
+	template<class RawData>
+	bool getNextConnection(int& startIdx, const RawData& rawData, string& addr) const;
+	template<class RawData>
+	bool getNextData(int& startIdx, const RawData& rawData, string& data, string& addr) const;
+
+	  // read - when the DataStore hands back one record per write there's
+	  // nothing to search for, the record is the whole message. These
+	  // return false if it isn't that kind of message at all.
+	bool readConnection(string_view record, string& addr) const;
+	bool readData(string_view record, string& data, string& addr) const;
+
+	  // which DataStore channel each kind of message goes on, so
+	  // looking for heartbeats doesn't mean wading through data
+	Channel heartbeatChannel() const { return Channel(1 + HEARTBEAT); }
+	Channel dataChannel() const      { return Channel(1 + DATA); }
 
 private:
 	// we need a series of types of headers that the Application can
@@ -34,8 +50,10 @@ private:
 	  // searches the rawdata for a header matching that msgtype
 	  // returns true if it finds it, setting idx to the first character
 	  // of that header, else false
-	bool getNextHeaderIdx(int& idx, const string& rawData, MsgType msgtype) const;
-	int getDataSize(int& start, const string& rawdata) const;
+	template<class RawData>
+	bool getNextHeaderIdx(int& idx, const RawData& rawData, MsgType msgtype) const;
+	template<class RawData>
+	int getDataSize(int& start, const RawData& rawdata) const;
 };
 
 #endif
@@ -64,21 +82,21 @@ prepareHeartbeat(string addr) const
 }
 
 template<class EncodingPolicy>
+template<class RawData>
 bool SimpleProtocol<EncodingPolicy>::
 
-getNextHeaderIdx(int& idx, const string& rawData, MsgType msgtype) const
+getNextHeaderIdx(int& idx, const RawData& rawData, MsgType msgtype) const
 {
 	  // if we're looking out of bounds, return false
 	if (idx >= rawData.size()) {
 		return false;
 	}
 
-	  // get the potential header starting at each char, see if it's
+	  // compare the potential header starting at each char, see if it's
 	  // a match and if you find one, return true
+	const string& header = m_headers.at(msgtype);
 	for (; idx != rawData.size(); idx++) {
-		string nextFour = rawData.substr(idx, 4);
-
-		if (nextFour == m_headers.at(msgtype)) {
+		if (rawData.compare(idx, header.size(), header) == 0) {
 			return true;
 		}
 	}
@@ -103,9 +121,10 @@ getNextHeaderIdx(int& idx, const string& rawData, MsgType msgtype) const
   // getNextConnection(0, "DATAcvgaopmsn", data)
   //    returns false
 template<class EncodingPolicy>
+template<class RawData>
 bool SimpleProtocol<EncodingPolicy>::
 
-getNextConnection(int& startIdx, const string& rawData, string& addr) const
+getNextConnection(int& startIdx, const RawData& rawData, string& addr) const
 {
 	  // if there's another hearbeat message to get, get it
 	  // and return true
@@ -122,9 +141,10 @@ getNextConnection(int& startIdx, const string& rawData, string& addr) const
 }
 
 template<class EncodingPolicy>
+template<class RawData>
 bool SimpleProtocol<EncodingPolicy>::
 
-getNextData(int& startIdx, const string& rawData, string& data, string& addr) const
+getNextData(int& startIdx, const RawData& rawData, string& data, string& addr) const
 {
 	  // check if the data header is in there anywhere
 	if (getNextHeaderIdx(startIdx, rawData, DATA)) {
@@ -143,6 +163,42 @@ getNextData(int& startIdx, const string& rawData, string& data, string& addr) co
 }
 
 
+  // a record is exactly one message, so it either starts with the
+  // header or it isn't one - a DATA payload that happens to have HTBT
+  // in it is still just data
+template<class EncodingPolicy>
+bool SimpleProtocol<EncodingPolicy>::
+
+readConnection(string_view record, string& addr) const
+{
+	const string& header = m_headers.at(HEARTBEAT);
+	if (record.size() < header.size() + 3 || record.compare(0, header.size(), header) != 0) {
+		return false;
+	}
+	addr = this->decode(string(record.substr(header.size(), 3)), nullptr);
+	return true;
+}
+
+  // DATA, the address, the size and a comma, then the payload runs
+  // to the end of the record
+template<class EncodingPolicy>
+bool SimpleProtocol<EncodingPolicy>::
+
+readData(string_view record, string& data, string& addr) const
+{
+	const string& header = m_headers.at(DATA);
+	if (record.size() < header.size() + 3 || record.compare(0, header.size(), header) != 0) {
+		return false;
+	}
+	size_t comma = record.find(',', header.size() + 3);
+	if (comma == string_view::npos) {
+		return false;
+	}
+	addr = string(record.substr(header.size(), 3));
+	data = this->decode(string(record.substr(comma + 1)), nullptr);
+	return true;
+}
+
 template<class EncodingPolicy>
 string SimpleProtocol<EncodingPolicy>::prepareData(string data, string addr) const
 {
@@ -155,9 +211,10 @@ string SimpleProtocol<EncodingPolicy>::prepareData(string data, string addr) con
 
 
 template<class EncodingPolicy>
+template<class RawData>
 int SimpleProtocol<EncodingPolicy>::
 
-getDataSize(int& start, const string& rawdata) const {
+getDataSize(int& start, const RawData& rawdata) const {
 	string ssize;
 	  // comma delimited, make sure it's always a digit
 	for (; rawdata[start] != ',' && rawdata[start] >= '0' && rawdata[start] <= '9'; start++) {
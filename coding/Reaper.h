@@ -0,0 +1,77 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+using namespace std;
+
+/*
+	A Reaper takes expiry off the read path. It owns a thread that calls
+	expire() on the store every interval, and while it's running the
+	store's reads only skip over expired data instead of cleaning it up,
+	so how long a read takes doesn't depend on how much expired since
+	the last one.
+
+	The store gets expire() called from the Reaper's thread, so it has to
+	be one that's safe to share between threads - ConcurrentDataStore,
+	not DataStore. A single threaded DataStore can get the same effect by
+	turning off setExpireOnRead and calling expire() from its own loop.
+*/
+template<class Store>
+class Reaper {
+public:
+	Reaper(Store& store, chrono::milliseconds interval = chrono::milliseconds(100));
+	~Reaper();
+
+	Reaper(const Reaper&) = delete;
+	Reaper& operator=(const Reaper&) = delete;
+
+private:
+	Store& m_store;
+	chrono::milliseconds m_interval;
+
+	mutex m_lock;
+	condition_variable m_wake;
+	bool m_stop;
+	thread m_thread;
+
+	void run();
+};
+
+template<class Store>
+Reaper<Store>::Reaper(Store& store, chrono::milliseconds interval)
+ : m_store(store), m_interval(interval), m_stop(false)
+{
+	m_store.setExpireOnRead(false);
+	m_thread = thread(&Reaper::run, this);
+}
+
+template<class Store>
+Reaper<Store>::~Reaper()
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+
+	  // nobody else is cleaning up after the store anymore
+	m_store.setExpireOnRead(true);
+}
+
+template<class Store>
+void Reaper<Store>::run()
+{
+	unique_lock<mutex> lock(m_lock);
+	while (!m_stop) {
+		lock.unlock();
+		m_store.expire();
+		lock.lock();
+		m_wake.wait_for(lock, m_interval, [this]() { return m_stop; });
+	}
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef RECORDVIEW_H
+#define RECORDVIEW_H
+
+#include <string_view>
+#include <vector>
+#include <memory>
+using namespace std;
+
+/*
+	A RecordView is what a DataStore's records() hands back: the writes
+	themselves, one Record per write, instead of all of them run together
+	the way view() gives them. Each one knows how long it is and when it
+	was written, so nobody has to go looking for where a message starts.
+
+	Same rules as a DataView for how long it's good for - the data is
+	still sitting in the store, not copied.
+*/
+struct Record {
+	string_view data;
+	  // when it was written, in milliseconds on the store's clock
+	double time;
+};
+
+class RecordView {
+public:
+	void append(const char* p, size_t n, double time) {
+		m_records.push_back(Record{string_view(p, n), time});
+	}
+
+	  // keep whatever p points to alive for as long as this view is
+	void pin(shared_ptr<const void> p) { m_pins.push_back(move(p)); }
+
+	size_t size() const  { return m_records.size(); }
+	bool   empty() const { return m_records.empty(); }
+	const Record& operator[](size_t i) const { return m_records[i]; }
+
+	vector<Record>::const_iterator begin() const { return m_records.begin(); }
+	vector<Record>::const_iterator end() const   { return m_records.end(); }
+
+private:
+	vector<Record> m_records;
+	vector<shared_ptr<const void>> m_pins;
+};
+
+#endif
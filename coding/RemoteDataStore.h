@@ -0,0 +1,436 @@
+#ifndef REMOTEDATASTORE_H
+#define REMOTEDATASTORE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "DataView.h"
+#include "RecordView.h"
+#include "Channel.h"
+#include "Wire.h"
+using namespace std;
+
+/*
+	RemoteDataStore is the client end of a DataStoreServer: the same
+	write/read/records API as the other stores, carried out by the server
+	over its socket, so an Application can use one without knowing the
+	store is in another process.
+
+	Writes are pipelined - each one goes straight out, but nothing waits
+	for the server to acknowledge it until something has to wait for the
+	server anyway (a read, or flush()). Since the server answers
+	everything in order a read always sees this client's own writes;
+	flush() before telling anyone else to look for them.
+	Errors from the server come back as runtime_error, from whichever
+	call was waiting on the reply.
+
+	The server only sends back so many records at once, so reading a lot
+	of them takes a few round trips, and whatever is written meanwhile
+	can end up in the same read.
+
+	One RemoteDataStore is one connection, so it's for one thread.
+*/
+class RemoteDataStore {
+public:
+	  // connect to the server listening at path. Throws runtime_error if
+	  // nobody is.
+	RemoteDataStore(string path);
+	~RemoteDataStore();
+
+	RemoteDataStore(const RemoteDataStore&) = delete;
+	RemoteDataStore& operator=(const RemoteDataStore&) = delete;
+
+	  // the server's ConcurrentDataStore::Cursor, carried back and forth
+	struct Cursor {
+		unsigned long long next;
+		unsigned long long missed;
+		unsigned long long pos;
+		Cursor() : next(0), missed(0), pos(0) {}
+	};
+
+	void write(string data)             { write(Channel(0), &data, 1); }
+	void write(Channel ch, string data) { write(ch, &data, 1); }
+	void write(const vector<string>& data) { write(Channel(0), data.data(), data.size()); }
+	void write(Channel ch, const vector<string>& data) { write(ch, data.data(), data.size()); }
+	void write(Channel ch, const string* data, size_t n);
+
+	  // wait until the server has everything written so far
+	void flush();
+
+	void read(string& data);
+	DataView view(unsigned channels = ALL_CHANNELS);
+	DataView readSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+	RecordView records(unsigned channels = ALL_CHANNELS);
+	RecordView recordsSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+
+	  // a connection of its own that the server pushes new records down
+	  // as they're written
+	class Subscription {
+	public:
+		~Subscription();
+		Subscription(Subscription&& other);
+		Subscription(const Subscription&) = delete;
+		Subscription& operator=(const Subscription&) = delete;
+
+		  // the next push, waiting up to maxWait for one if nothing has
+		  // come yet. Empty if nothing came.
+		RecordView next(chrono::microseconds maxWait);
+
+		  // how far the pushes have gotten, same as a cursor from
+		  // recordsSince
+		const Cursor& cursor() const { return m_cursor; }
+
+	private:
+		friend class RemoteDataStore;
+		Subscription(int fd) : m_fd(fd), m_used(0) {}
+		int m_fd;
+		string m_in;
+		size_t m_used;
+		Cursor m_cursor;
+	};
+	Subscription subscribe(unsigned channels = ALL_CHANNELS, Cursor from = Cursor());
+
+private:
+	  // don't let more than this many writes go unacknowledged, so
+	  // the server's replies don't pile up on us
+	static constexpr size_t MAX_UNACKED = 4096;
+
+	int m_fd;
+	string m_out;
+	string m_in;
+	size_t m_used;
+	size_t m_unacked;
+
+	static int connectTo(const string& path);
+
+	  // push everything queued to the server
+	void send();
+
+	  // the next frame off the socket. in holds what's been read and
+	  // used is how much of it has been taken apart already.
+	static bool readFrame(int fd, string& in, size_t& used, uint32_t& op, shared_ptr<string>& body);
+	  // the next frame if it's all been read already
+	static bool takeFrame(string& in, size_t& used, uint32_t& op, shared_ptr<string>& body);
+	  // one read's worth more onto in. False if the server hung up.
+	static bool readMore(int fd, string& in, size_t& used);
+
+	  // the body of the next reply that isn't a write's OK, or if expect
+	  // is OK, wait until every write has been acknowledged
+	shared_ptr<string> reply(uint32_t expect);
+
+	  // add a RECORDS_REPLY's records onto v, moving the cursor along.
+	  // True if the server had more than it sent.
+	static bool unpack(const shared_ptr<string>& body, Cursor& c, RecordView& v);
+
+	RecordView fetch(uint32_t op, unsigned channels, Cursor& c);
+};
+
+int RemoteDataStore::connectTo(const string& path)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw runtime_error("RemoteDataStore: socket path too long: " + path);
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+		string why = strerror(errno);
+		if (fd >= 0) {
+			close(fd);
+		}
+		throw runtime_error("RemoteDataStore: can't connect to " + path + ": " + why);
+	}
+	return fd;
+}
+
+RemoteDataStore::RemoteDataStore(string path)
+ : m_fd(connectTo(path)), m_used(0), m_unacked(0)
+{ }
+
+RemoteDataStore::~RemoteDataStore()
+{
+	  // anything still queued should still get there
+	try {
+		send();
+	}
+	catch (const runtime_error&) { }
+	close(m_fd);
+}
+
+void RemoteDataStore::write(Channel ch, const string* data, size_t n)
+{
+	Wire::Writer w(m_out, Wire::WRITE);
+	w.put32(ch.id);
+	w.put32(n);
+	for (size_t i = 0; i < n; i++) {
+		w.putBytes(data[i].data(), data[i].size());
+	}
+	w.end();
+	m_unacked++;
+
+	if (m_unacked >= MAX_UNACKED) {
+		flush();
+	}
+	else {
+		send();
+	}
+}
+
+void RemoteDataStore::send()
+{
+	size_t off = 0;
+	while (off < m_out.size()) {
+		ssize_t sent = ::send(m_fd, m_out.data() + off, m_out.size() - off, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			m_out.clear();
+			throw runtime_error(string("RemoteDataStore: lost the server: ") + strerror(errno));
+		}
+		off += sent;
+	}
+	m_out.clear();
+}
+
+bool RemoteDataStore::readFrame(int fd, string& in, size_t& used, uint32_t& op, shared_ptr<string>& body)
+{
+	while (!takeFrame(in, used, op, body)) {
+		if (!readMore(fd, in, used)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool RemoteDataStore::takeFrame(string& in, size_t& used, uint32_t& op, shared_ptr<string>& body)
+{
+	size_t size;
+	bool bad;
+	if (Wire::frameAt(in.data() + used, in.size() - used, op, size, bad)) {
+		body = make_shared<string>(in, used + Wire::HEADER_SIZE, size);
+		used += Wire::HEADER_SIZE + size;
+		return true;
+	}
+	if (bad) {
+		throw runtime_error("RemoteDataStore: garbage from the server");
+	}
+	return false;
+}
+
+bool RemoteDataStore::readMore(int fd, string& in, size_t& used)
+{
+	  // only move what's left of a partial frame down when we have to
+	  // read more anyway
+	in.erase(0, used);
+	used = 0;
+
+	char buf[64 * 1024];
+	for (;;) {
+		ssize_t got = ::read(fd, buf, sizeof(buf));
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+		in.append(buf, got);
+		return true;
+	}
+}
+
+shared_ptr<string> RemoteDataStore::reply(uint32_t expect)
+{
+	send();
+	for (;;) {
+		if (expect == Wire::OK && m_unacked == 0) {
+			return nullptr;
+		}
+
+		uint32_t op;
+		shared_ptr<string> body;
+		if (!readFrame(m_fd, m_in, m_used, op, body)) {
+			throw runtime_error("RemoteDataStore: the server hung up");
+		}
+		if (op == Wire::ERROR) {
+			Wire::Reader r(body->data(), body->size());
+			throw runtime_error("RemoteDataStore: " + string(r.getBytes()));
+		}
+		if (op == Wire::OK && m_unacked > 0) {
+			m_unacked--;
+			continue;
+		}
+		if (op != expect) {
+			throw runtime_error("RemoteDataStore: unexpected reply from the server");
+		}
+		return body;
+	}
+}
+
+void RemoteDataStore::flush()
+{
+	reply(Wire::OK);
+}
+
+bool RemoteDataStore::unpack(const shared_ptr<string>& body, Cursor& c, RecordView& v)
+{
+	Wire::Reader r(body->data(), body->size());
+	c.next = r.get64();
+	c.missed = r.get64();
+	c.pos = r.get64();
+	bool more = r.get32() != 0;
+	uint32_t count = r.get32();
+
+	  // the records point straight into the reply
+	for (uint32_t i = 0; r.ok() && i < count; i++) {
+		double time = r.getDouble();
+		string_view data = r.getBytes();
+		v.append(data.data(), data.size(), time);
+	}
+	if (!r.ok()) {
+		throw runtime_error("RemoteDataStore: garbled records from the server");
+	}
+	v.pin(body);
+	return more;
+}
+
+RecordView RemoteDataStore::fetch(uint32_t op, unsigned channels, Cursor& c)
+{
+	  // keep asking from where the last reply left off until we've
+	  // got it all
+	RecordView v;
+	bool more;
+	do {
+		Wire::Writer w(m_out, op);
+		w.put32(channels);
+		if (op != Wire::RECORDS) {
+			w.put64(c.next);
+			w.put64(c.missed);
+			w.put64(c.pos);
+		}
+		w.end();
+		more = unpack(reply(Wire::RECORDS_REPLY), c, v);
+		op = Wire::RECORDS_SINCE;
+	} while (more);
+	return v;
+}
+
+RecordView RemoteDataStore::records(unsigned channels)
+{
+	Cursor c;
+	return fetch(Wire::RECORDS, channels, c);
+}
+
+RecordView RemoteDataStore::recordsSince(Cursor& c, unsigned channels)
+{
+	return fetch(Wire::RECORDS_SINCE, channels, c);
+}
+
+  // the data views are the records run together, same as every other
+  // store's
+DataView RemoteDataStore::view(unsigned channels)
+{
+	shared_ptr<RecordView> r = make_shared<RecordView>(records(channels));
+	DataView v;
+	for (const Record& rec : *r) {
+		v.append(rec.data.data(), rec.data.size());
+	}
+	v.pin(r);
+	return v;
+}
+
+DataView RemoteDataStore::readSince(Cursor& c, unsigned channels)
+{
+	shared_ptr<RecordView> r = make_shared<RecordView>(recordsSince(c, channels));
+	DataView v;
+	for (const Record& rec : *r) {
+		v.append(rec.data.data(), rec.data.size());
+	}
+	v.pin(r);
+	return v;
+}
+
+void RemoteDataStore::read(string& data)
+{
+	data = view().str();
+}
+
+RemoteDataStore::Subscription RemoteDataStore::subscribe(unsigned channels, Cursor from)
+{
+	  // the path isn't kept around, ask the socket where it's connected
+	sockaddr_un addr;
+	socklen_t len = sizeof(addr);
+	getpeername(m_fd, (sockaddr*)&addr, &len);
+
+	Subscription sub(connectTo(addr.sun_path));
+	string req;
+	Wire::Writer w(req, Wire::SUBSCRIBE);
+	w.put32(channels);
+	w.put64(from.next);
+	w.put64(from.missed);
+	w.put64(from.pos);
+	w.end();
+	if (::send(sub.m_fd, req.data(), req.size(), MSG_NOSIGNAL) != (ssize_t)req.size()) {
+		throw runtime_error("RemoteDataStore: can't subscribe");
+	}
+	sub.m_cursor = from;
+	return sub;
+}
+
+RemoteDataStore::Subscription::Subscription(Subscription&& other)
+ : m_fd(other.m_fd), m_in(move(other.m_in)), m_used(other.m_used), m_cursor(other.m_cursor)
+{
+	other.m_fd = -1;
+}
+
+RemoteDataStore::Subscription::~Subscription()
+{
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+RecordView RemoteDataStore::Subscription::next(chrono::microseconds maxWait)
+{
+	auto deadline = chrono::steady_clock::now() + maxWait;
+	uint32_t op;
+	shared_ptr<string> body;
+
+	  // a push can come in pieces, give up on it if the rest doesn't show
+	  // in time and pick up where we left off next call
+	while (!takeFrame(m_in, m_used, op, body)) {
+		auto left = chrono::duration_cast<chrono::microseconds>(deadline - chrono::steady_clock::now());
+		pollfd p;
+		p.fd = m_fd;
+		p.events = POLLIN;
+		int ready = left.count() > 0 ? poll(&p, 1, (left.count() + 999) / 1000) : 0;
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ready <= 0) {
+			return RecordView();
+		}
+		if (!readMore(m_fd, m_in, m_used)) {
+			throw runtime_error("RemoteDataStore: the server hung up");
+		}
+	}
+	if (op != Wire::RECORDS_REPLY) {
+		throw runtime_error("RemoteDataStore: unexpected push from the server");
+	}
+	RecordView v;
+	unpack(body, m_cursor, v);
+	return v;
+}
+
+#endif
@@ -0,0 +1,631 @@
+#ifndef REPLICATEDDATASTORE_H
+#define REPLICATEDDATASTORE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdexcept>
+#include "ConcurrentDataStore.h"
+#include "Stats.h"
+#include "Wire.h"
+using namespace std;
+
+/*
+	ReplicatedDataStore is one node of a store spread over several
+	nodes. Each node keeps a full copy in a ConcurrentDataStore of its
+	own, so reads never leave the node, and an Application attached to
+	any node sees what was written on all of them - a little later.
+
+	A write goes into the local copy straight away and onto a queue. A
+	thread per node takes whatever has queued up since it last looked
+	and ships it to every peer in one REPLICATE frame (see Wire.h), so
+	the busier a node is the bigger its batches get. Replicas put what
+	they're sent into their copy with the same channel, under the time
+	it arrived.
+
+	Every write is tagged with the node it was written on and where it
+	came in that node's writes. A replica remembers which of those it has
+	applied and drops anything it has already seen, so the same write can
+	arrive more than once - resent, or relayed along more than one path -
+	and still only be stored once. A write that still hasn't turned up
+	once MAX_AHEAD later ones from the same node have is taken to be
+	lost, and dropped like a duplicate if it ever does. Frames that don't
+	make sense are counted and dropped whole. With setRelay(true) a node
+	passes on what it gets from one peer to its others, so nodes don't
+	all have to be connected to each other.
+
+	A node that restarts with the same id numbers its writes from 0
+	again, so writes are tagged with which run of the node they're from
+	too (its incarnation, from when it started). Replicas start over on
+	a node's writes when a newer run of it shows up, and drop anything
+	still around from an older one.
+
+	How frames get between nodes is up to the Transport. SimulatedNetwork
+	is one that runs in process, with a latency and bandwidth for each
+	link, to try things out with.
+*/
+
+  // carries frames between nodes. Frames sent from one node to another
+  // should arrive in the order they were sent, or not at all.
+class Transport {
+public:
+	using Receiver = function<void(int from, const string& frame)>;
+
+	virtual ~Transport() {}
+
+	  // frames sent to node get handed to r, until detach(node) returns
+	virtual void attach(int node, Receiver r) = 0;
+	virtual void detach(int node) = 0;
+
+	virtual void send(int from, int to, string frame) = 0;
+};
+
+  // a Transport where every node is in this process. Each link takes
+  // latency to cross and can only carry bytesPerSec, so a big frame
+  // holds up the ones behind it. A thread hands frames over when
+  // they're due.
+class SimulatedNetwork : public Transport {
+public:
+	  // bytesPerSec of 0 is as fast as the machine goes
+	SimulatedNetwork(chrono::microseconds latency, double bytesPerSec = 0);
+	~SimulatedNetwork();
+
+	SimulatedNetwork(const SimulatedNetwork&) = delete;
+	SimulatedNetwork& operator=(const SimulatedNetwork&) = delete;
+
+	  // change the one link from from to to
+	void setLink(int from, int to, chrono::microseconds latency, double bytesPerSec = 0);
+
+	void attach(int node, Receiver r);
+	void detach(int node);
+	void send(int from, int to, string frame);
+
+	unsigned long long framesSent() const;
+	unsigned long long bytesSent() const;
+
+private:
+	using Time = chrono::steady_clock::time_point;
+
+	struct Link {
+		chrono::microseconds latency;
+		double bytesPerSec;
+		  // when the link's done sending what it's already got, and when
+		  // the last frame on it arrives
+		Time busyUntil;
+		Time lastArrival;
+	};
+
+	struct InFlight {
+		Time due;
+		unsigned long long order;
+		int from;
+		int to;
+		string frame;
+		bool operator>(const InFlight& other) const {
+			return due != other.due ? due > other.due : order > other.order;
+		}
+	};
+
+	chrono::microseconds m_latency;
+	double m_bytesPerSec;
+
+	mutable mutex m_lock;
+	condition_variable m_wake;
+	map<pair<int,int>, Link> m_links;
+	map<int, Receiver> m_nodes;
+	priority_queue<InFlight, vector<InFlight>, greater<InFlight>> m_inFlight;
+	unsigned long long m_order;
+	unsigned long long m_bytes;
+	bool m_stop;
+
+	  // held while a frame's being handed over, so detach can wait
+	  // for one that's in the middle of it
+	mutex m_delivering;
+	thread m_thread;
+
+	void run();
+};
+
+  // what a node has sent and been sent. lag is from a write on one node
+  // to it going into this one's copy - the nodes are in the same process
+  // so they have the same clock to measure it with.
+struct ReplicationStats {
+	unsigned long long written;
+	unsigned long long framesShipped;
+	unsigned long long recordsShipped;
+	unsigned long long bytesShipped;
+	unsigned long long recordsReceived;
+	unsigned long long applied;
+	unsigned long long duplicates;
+	unsigned long long badFrames;
+	LatencyHistogram lag;
+
+	ReplicationStats()
+	 : written(0), framesShipped(0), recordsShipped(0), bytesShipped(0),
+	   recordsReceived(0), applied(0), duplicates(0), badFrames(0)
+	{ }
+};
+
+class ReplicatedDataStore {
+public:
+	using Cursor = ConcurrentDataStore::Cursor;
+
+	  // id has to be different for every node on the transport. p is the
+	  // persistence, same as DataStore, and should be the same everywhere.
+	ReplicatedDataStore(int id, Transport& transport, int p);
+	~ReplicatedDataStore();
+
+	ReplicatedDataStore(const ReplicatedDataStore&) = delete;
+	ReplicatedDataStore& operator=(const ReplicatedDataStore&) = delete;
+
+	int id() const { return m_id; }
+
+	  // ship writes to peer from now on. Connections go one way, a
+	  // pair of nodes that should both see each other connect both ways.
+	void connect(int peer);
+
+	  // pass on writes from other nodes too, not just this one's own
+	void setRelay(bool on);
+
+	  // same as ConcurrentDataStore's, and shipped to the peers
+	void write(string data) { write(Channel(0), &data, 1); }
+	void write(Channel ch, string data) { write(ch, &data, 1); }
+	void write(const vector<string>& data) { write(Channel(0), data.data(), data.size()); }
+	void write(Channel ch, const vector<string>& data) { write(ch, data.data(), data.size()); }
+	void write(Channel ch, const string* data, size_t n);
+
+	  // wait until everything written so far has been handed to the
+	  // transport. It still has to get across.
+	void flush();
+
+	  // reads only ever look at this node's copy
+	void read(string& data) { m_store.read(data); }
+	DataView view(unsigned channels = ALL_CHANNELS) { return m_store.view(channels); }
+	DataView readSince(Cursor& c, unsigned channels = ALL_CHANNELS) { return m_store.readSince(c, channels); }
+	RecordView records(unsigned channels = ALL_CHANNELS) { return m_store.records(channels); }
+	RecordView recordsSince(Cursor& c, unsigned channels = ALL_CHANNELS) {
+		return m_store.recordsSince(c, channels);
+	}
+	bool waitFor(const Cursor& c, size_t minBytes, chrono::microseconds maxWait) {
+		return m_store.waitFor(c, minBytes, maxWait);
+	}
+	void setExpireOnRead(bool on) { m_store.setExpireOnRead(on); }
+	void expire() { m_store.expire(); }
+
+	ReplicationStats stats() const;
+
+	  // how far past a missing write from another node we'll wait for it
+	static constexpr size_t MAX_AHEAD = 1 << 16;
+
+	  // take in a frame from another node. The transport calls it, so
+	  // it doesn't throw over a bad frame, just counts it.
+	void receive(int from, const string& frame);
+
+private:
+	  // a write on its way to the peers. from is the peer it came from,
+	  // so it isn't sent straight back, or -1 if it was written here.
+	struct Pending {
+		uint32_t origin;
+		uint64_t incarnation;
+		uint64_t seq;
+		uint32_t channel;
+		uint64_t writtenNs;
+		string data;
+		int from;
+	};
+
+	  // which of one origin's writes have been applied, in its latest
+	  // incarnation: everything below below, and whatever's in above
+	struct Seen {
+		uint64_t incarnation = 0;
+		uint64_t below = 0;
+		set<uint64_t> above;
+
+		bool has(uint64_t seq) const { return seq < below || above.count(seq) != 0; }
+		void add(uint64_t seq) {
+			above.insert(seq);
+			if (above.size() > MAX_AHEAD) {
+				below = *above.begin();
+			}
+			while (!above.empty() && *above.begin() == below) {
+				above.erase(above.begin());
+				below++;
+			}
+		}
+	};
+
+	  // keep frames to about this size, a big backlog goes out in several
+	static constexpr size_t MAX_BATCH_BYTES = 1 << 20;
+
+	int m_id;
+	Transport& m_transport;
+	ConcurrentDataStore m_store;
+
+	mutable mutex m_lock;
+	condition_variable m_wake;
+	condition_variable m_shipped;
+	vector<int> m_peers;
+	vector<Pending> m_pending;
+	  // this run of the node, bigger than any run before it
+	uint64_t m_incarnation;
+	uint64_t m_nextSeq;
+	bool m_relay;
+	bool m_shipping;
+	bool m_stop;
+
+	  // frames are taken in one at a time, in the order they come
+	mutex m_receiving;
+	map<uint32_t, Seen> m_seen;
+	mutable mutex m_statsLock;
+	ReplicationStats m_stats;
+
+	thread m_thread;
+
+	static uint64_t nowNs() {
+		return chrono::duration_cast<chrono::nanoseconds>(
+				chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	static uint64_t newIncarnation();
+
+	void run();
+	void ship(const vector<Pending>& batch, const vector<int>& peers);
+};
+
+/*
+	SimulatedNetwork
+*/
+
+SimulatedNetwork::SimulatedNetwork(chrono::microseconds latency, double bytesPerSec)
+ : m_latency(latency), m_bytesPerSec(bytesPerSec), m_order(0), m_bytes(0), m_stop(false)
+{
+	m_thread = thread(&SimulatedNetwork::run, this);
+}
+
+SimulatedNetwork::~SimulatedNetwork()
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+}
+
+void SimulatedNetwork::setLink(int from, int to, chrono::microseconds latency, double bytesPerSec)
+{
+	lock_guard<mutex> lock(m_lock);
+	Link& l = m_links.emplace(make_pair(from, to), Link{m_latency, m_bytesPerSec, Time(), Time()}).first->second;
+	l.latency = latency;
+	l.bytesPerSec = bytesPerSec;
+}
+
+void SimulatedNetwork::attach(int node, Receiver r)
+{
+	lock_guard<mutex> lock(m_lock);
+	if (!m_nodes.emplace(node, r).second) {
+		throw runtime_error("SimulatedNetwork: node " + to_string(node) + " is already attached");
+	}
+}
+
+void SimulatedNetwork::detach(int node)
+{
+	lock_guard<mutex> delivering(m_delivering);
+	lock_guard<mutex> lock(m_lock);
+	m_nodes.erase(node);
+}
+
+void SimulatedNetwork::send(int from, int to, string frame)
+{
+	Time now = chrono::steady_clock::now();
+	{
+		lock_guard<mutex> lock(m_lock);
+		Link& l = m_links.emplace(make_pair(from, to), Link{m_latency, m_bytesPerSec, Time(), Time()}).first->second;
+
+		  // it can't start going until what's ahead of it has gone
+		Time start = max(now, l.busyUntil);
+		l.busyUntil = start;
+		if (l.bytesPerSec > 0) {
+			l.busyUntil += chrono::duration_cast<Time::duration>(
+					chrono::duration<double>(frame.size() / l.bytesPerSec));
+		}
+		  // and changing the latency doesn't let it overtake them
+		Time due = max(l.busyUntil + l.latency, l.lastArrival);
+		l.lastArrival = due;
+
+		m_bytes += frame.size();
+		m_inFlight.push(InFlight{due, m_order++, from, to, move(frame)});
+	}
+	m_wake.notify_one();
+}
+
+unsigned long long SimulatedNetwork::framesSent() const
+{
+	lock_guard<mutex> lock(m_lock);
+	return m_order;
+}
+
+unsigned long long SimulatedNetwork::bytesSent() const
+{
+	lock_guard<mutex> lock(m_lock);
+	return m_bytes;
+}
+
+void SimulatedNetwork::run()
+{
+	unique_lock<mutex> lock(m_lock);
+	while (!m_stop) {
+		if (m_inFlight.empty()) {
+			m_wake.wait(lock);
+			continue;
+		}
+		Time due = m_inFlight.top().due;
+		if (chrono::steady_clock::now() < due) {
+			m_wake.wait_until(lock, due);
+			continue;
+		}
+
+		InFlight f = move(const_cast<InFlight&>(m_inFlight.top()));
+		m_inFlight.pop();
+		auto it = m_nodes.find(f.to);
+		if (it == m_nodes.end()) {
+			continue;
+		}
+		Receiver r = it->second;
+
+		  // don't hold up senders while it's handed over, but don't let
+		  // the node go away in the middle of it either
+		lock.unlock();
+		{
+			lock_guard<mutex> delivering(m_delivering);
+			lock.lock();
+			bool still = m_nodes.count(f.to) != 0;
+			lock.unlock();
+			if (still) {
+				r(f.from, f.frame);
+			}
+		}
+		lock.lock();
+	}
+}
+
+/*
+	ReplicatedDataStore
+*/
+
+  // the wall clock when it started, but never the same twice in one
+  // process even if two start in the same tick
+uint64_t ReplicatedDataStore::newIncarnation()
+{
+	static atomic<uint64_t> latest(0);
+	uint64_t now = chrono::duration_cast<chrono::nanoseconds>(
+			chrono::system_clock::now().time_since_epoch()).count();
+	uint64_t prev = latest.load();
+	while (!latest.compare_exchange_weak(prev, max(now, prev + 1))) { }
+	return max(now, prev + 1);
+}
+
+ReplicatedDataStore::ReplicatedDataStore(int id, Transport& transport, int p)
+ : m_id(id), m_transport(transport), m_store(p), m_incarnation(newIncarnation()), m_nextSeq(0),
+   m_relay(false),
+   m_shipping(false), m_stop(false)
+{
+	m_transport.attach(m_id, [this](int from, const string& frame) { receive(from, frame); });
+	m_thread = thread(&ReplicatedDataStore::run, this);
+}
+
+ReplicatedDataStore::~ReplicatedDataStore()
+{
+	  // what's already been written still goes out
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+	m_transport.detach(m_id);
+}
+
+void ReplicatedDataStore::connect(int peer)
+{
+	lock_guard<mutex> lock(m_lock);
+	if (peer != m_id && find(m_peers.begin(), m_peers.end(), peer) == m_peers.end()) {
+		m_peers.push_back(peer);
+	}
+}
+
+void ReplicatedDataStore::setRelay(bool on)
+{
+	lock_guard<mutex> lock(m_lock);
+	m_relay = on;
+}
+
+void ReplicatedDataStore::write(Channel ch, const string* data, size_t n)
+{
+	m_store.write(ch, data, n);
+
+	uint64_t now = nowNs();
+	{
+		lock_guard<mutex> lock(m_lock);
+		for (size_t i = 0; i < n; i++) {
+			m_pending.push_back(Pending{(uint32_t)m_id, m_incarnation, m_nextSeq++, ch.id, now, data[i], -1});
+		}
+	}
+	m_wake.notify_one();
+
+	lock_guard<mutex> lock(m_statsLock);
+	m_stats.written += n;
+}
+
+void ReplicatedDataStore::flush()
+{
+	unique_lock<mutex> lock(m_lock);
+	m_shipped.wait(lock, [this]() { return m_pending.empty() && !m_shipping; });
+}
+
+ReplicationStats ReplicatedDataStore::stats() const
+{
+	lock_guard<mutex> lock(m_statsLock);
+	return m_stats;
+}
+
+void ReplicatedDataStore::run()
+{
+	unique_lock<mutex> lock(m_lock);
+	for (;;) {
+		m_wake.wait(lock, [this]() { return m_stop || !m_pending.empty(); });
+		if (m_pending.empty()) {
+			break;
+		}
+
+		  // take everything that's queued up and ship it as one batch
+		vector<Pending> batch;
+		batch.swap(m_pending);
+		vector<int> peers = m_peers;
+		m_shipping = true;
+		lock.unlock();
+
+		ship(batch, peers);
+
+		lock.lock();
+		m_shipping = false;
+		m_shipped.notify_all();
+	}
+}
+
+void ReplicatedDataStore::ship(const vector<Pending>& batch, const vector<int>& peers)
+{
+	for (int peer : peers) {
+		size_t i = 0;
+		while (i < batch.size()) {
+			string frame;
+			Wire::Writer w(frame, Wire::REPLICATE);
+			size_t countAt = frame.size();
+			w.put32(0);
+			uint32_t count = 0;
+			for (; i < batch.size() && frame.size() < MAX_BATCH_BYTES; i++) {
+				const Pending& p = batch[i];
+				if (p.from == peer) {
+					continue;
+				}
+				w.put32(p.origin);
+				w.put64(p.incarnation);
+				w.put64(p.seq);
+				w.put32(p.channel);
+				w.put64(p.writtenNs);
+				w.putBytes(p.data.data(), p.data.size());
+				count++;
+			}
+			if (count == 0) {
+				continue;
+			}
+			memcpy(&frame[countAt], &count, 4);
+			w.end();
+
+			size_t bytes = frame.size();
+			m_transport.send(m_id, peer, move(frame));
+
+			lock_guard<mutex> lock(m_statsLock);
+			m_stats.framesShipped++;
+			m_stats.recordsShipped += count;
+			m_stats.bytesShipped += bytes;
+		}
+	}
+}
+
+void ReplicatedDataStore::receive(int from, const string& frame)
+{
+	  // take the whole frame apart before any of it counts as seen
+	uint32_t op;
+	size_t size;
+	bool bad;
+	vector<Pending> got;
+	bool garbled = !Wire::frameAt(frame.data(), frame.size(), op, size, bad) || op != Wire::REPLICATE;
+	if (!garbled) {
+		Wire::Reader r(frame.data() + Wire::HEADER_SIZE, size);
+		uint32_t count = r.get32();
+		for (uint32_t i = 0; r.ok() && i < count; i++) {
+			Pending p;
+			p.origin = r.get32();
+			p.incarnation = r.get64();
+			p.seq = r.get64();
+			p.channel = r.get32();
+			p.writtenNs = r.get64();
+			string_view data = r.getBytes();
+			if (!r.ok() || p.channel >= Channel::MAX) {
+				garbled = true;
+				break;
+			}
+			p.data = string(data);
+			p.from = from;
+			got.push_back(move(p));
+		}
+		garbled = garbled || !r.ok();
+	}
+	if (garbled) {
+		lock_guard<mutex> lock(m_statsLock);
+		m_stats.badFrames++;
+		return;
+	}
+
+	lock_guard<mutex> receiving(m_receiving);
+	size_t count = got.size();
+	vector<Pending> fresh;
+	unsigned long long duplicates = 0;
+	for (Pending& p : got) {
+		  // our own writes coming back around count as seen too
+		  // and a newer run of a node starts its numbers over
+		Seen& seen = m_seen[p.origin];
+		if (p.incarnation > seen.incarnation) {
+			seen = Seen();
+			seen.incarnation = p.incarnation;
+		}
+		if (p.origin == (uint32_t)m_id || p.incarnation < seen.incarnation || seen.has(p.seq)) {
+			duplicates++;
+			continue;
+		}
+		seen.add(p.seq);
+		fresh.push_back(move(p));
+	}
+
+	  // runs on the same channel go in as one write
+	for (size_t i = 0; i < fresh.size(); ) {
+		size_t j = i;
+		vector<string> run;
+		while (j < fresh.size() && fresh[j].channel == fresh[i].channel) {
+			run.push_back(fresh[j].data);
+			j++;
+		}
+		m_store.write(Channel(fresh[i].channel), run);
+		i = j;
+	}
+
+	uint64_t now = nowNs();
+	{
+		lock_guard<mutex> lock(m_statsLock);
+		m_stats.recordsReceived += count;
+		m_stats.applied += fresh.size();
+		m_stats.duplicates += duplicates;
+		for (const Pending& p : fresh) {
+			m_stats.lag.record(now > p.writtenNs ? now - p.writtenNs : 0);
+		}
+	}
+
+	if (!fresh.empty()) {
+		lock_guard<mutex> lock(m_lock);
+		if (m_relay && !m_stop) {
+			for (Pending& p : fresh) {
+				m_pending.push_back(move(p));
+			}
+			m_wake.notify_one();
+		}
+	}
+}
+
+#endif
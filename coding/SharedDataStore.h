@@ -0,0 +1,551 @@
+#ifndef SHAREDDATASTORE_H
+#define SHAREDDATASTORE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "DataView.h"
+#include "RecordView.h"
+#include "Channel.h"
+using namespace std;
+
+/*
+	SharedDataStore lives in a POSIX shared memory object, so Applications
+	in different processes on the same host can share one store. Every
+	process opens it by name and gets the same write/read API as the
+	other stores - writing and reading are just copies in and out of
+	memory everyone has mapped, no sockets or system calls per message.
+
+	The data is a ring buffer of entries, each with a header holding its
+	size, channel, sequence number and the time it was written. Positions
+	in the ring only ever go up (a position's offset in memory is it mod
+	the capacity), head is the oldest entry still in there and tail is
+	where the next one goes.
+
+	Writers take a process-shared mutex, copy their entries in and then
+	move tail past them. It's a robust mutex, so a writer that dies
+	holding it doesn't wedge everyone else - tail only moves once the
+	entries are finished, so nothing half-written is ever visible. The
+	one thing it can leave wrong is head, which has to move before the
+	entries it passes get written over: making room for something big
+	can take it past the tail, so whoever gets the lock next puts it
+	back (see recover). When the ring is full the oldest entries
+	get written over, expired or not (overwritten() counts the ones that
+	hadn't).
+
+	Readers don't lock at all. They copy out everything between head and
+	tail and then check whether head moved past where they started while
+	they were copying, the same way a seqlock works; if it did a writer
+	may have written over what they copied, so they go again from the new
+	head. Since the ring gets reused, reads hand back copies instead of
+	pointers into the store.
+
+	Expired entries come off the head when somebody writes, since the
+	writer has the lock anyway, so readers never have to take it. Until
+	then readers just skip over them.
+
+	Times are CLOCK_MONOTONIC, which is the same clock in every process.
+*/
+class SharedDataStore {
+public:
+	static constexpr size_t CAPACITY = 4 << 20;
+
+	  // how long to wait for whoever is creating a store to finish
+	  // setting it up before deciding they died partway through
+	static constexpr chrono::milliseconds OPEN_WAIT = chrono::seconds(2);
+
+	  // open the store called name, creating it with persistence p
+	  // (seconds) and room for capacity bytes of entries if it doesn't
+	  // exist yet. If it does, p and capacity are whatever its creator
+	  // used. Throws runtime_error if it can't be created or mapped, or
+	  // if its creator never finished setting it up (remove it and try
+	  // again).
+	SharedDataStore(string name, int p, size_t capacity = CAPACITY);
+	~SharedDataStore();
+
+	SharedDataStore(const SharedDataStore&) = delete;
+	SharedDataStore& operator=(const SharedDataStore&) = delete;
+
+	  // get rid of the store called name. Processes that already have it
+	  // open keep using it, the next one to open it gets a new one.
+	static void remove(string name);
+
+	  // same as ConcurrentDataStore::Cursor
+	struct Cursor {
+		unsigned long long next;
+		unsigned long long missed;
+		unsigned long long pos;
+		Cursor() : next(0), missed(0), pos(0) {}
+	};
+
+	  // same as the other stores'. A batch goes in under one lock and
+	  // becomes visible all at once. Throws length_error if an entry
+	  // can't fit in the ring at all.
+	unsigned long long write(string data)             { return write(Channel(0), &data, 1); }
+	unsigned long long write(Channel ch, string data) { return write(ch, &data, 1); }
+	unsigned long long write(const vector<string>& data) {
+		return write(Channel(0), data.data(), data.size());
+	}
+	unsigned long long write(Channel ch, const vector<string>& data) {
+		return write(ch, data.data(), data.size());
+	}
+	unsigned long long write(Channel ch, const string* data, size_t n);
+
+	void read(string& data);
+	DataView view(unsigned channels = ALL_CHANNELS);
+	DataView readSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+	RecordView records(unsigned channels = ALL_CHANNELS);
+	RecordView recordsSince(Cursor& c, unsigned channels = ALL_CHANNELS);
+
+	  // here it's writes that drop whatever has expired, so reads never
+	  // touch the writers' lock. Turn it off to only drop them when
+	  // expire() is called, which does take the lock.
+	void setExpireOnRead(bool on) { m_expireOnRead = on; }
+	void expire() { cleanData(); }
+
+	int persistence() const { return m_ctl->persistence; }
+	size_t capacity() const { return m_ctl->capacity; }
+
+	  // live entries that got written over because the ring was full
+	unsigned long long overwritten() const { return m_ctl->overwritten.load(); }
+	  // times a process died holding the writers' lock
+	unsigned long long recoveries() const { return m_ctl->recoveries.load(); }
+
+private:
+	  // sits at the start of the shared memory, the ring follows it
+	struct Control {
+		atomic<uint32_t> ready;
+		int persistence;
+		size_t capacity;
+		pthread_mutex_t lock;
+		  // only touched with the lock held
+		unsigned long long nextSeq;
+		atomic<unsigned long long> head;
+		atomic<unsigned long long> tail;
+		atomic<unsigned long long> overwritten;
+		atomic<unsigned long long> recoveries;
+	};
+	static constexpr size_t RING_OFFSET = (sizeof(Control) + 63) & ~size_t(63);
+
+	  // written in front of every entry. An entry never wraps around the
+	  // end of the ring - if it won't fit a PADDING header fills out the
+	  // rest, or if there isn't even room for that it's just skipped.
+	struct Header {
+		double time;
+		unsigned long long seq;
+		uint32_t size;
+		uint32_t state;
+	};
+	enum { ENTRY = 1, PADDING = 2 };
+	static constexpr size_t HEADER_SIZE = sizeof(Header);
+	static size_t entrySize(size_t n) { return HEADER_SIZE + ((n + 7) & ~size_t(7)); }
+
+	  // where one entry a reader copied out ended up in its buffer
+	struct Piece {
+		size_t off;
+		size_t size;
+		double time;
+	};
+
+	string m_name;
+	bool m_expireOnRead;
+	char* m_map;
+	size_t m_mapSize;
+	Control* m_ctl;
+	char* m_ring;
+
+	static string shmName(string name) { return name[0] == '/' ? name : "/" + name; }
+
+	static double now() {
+		return chrono::duration<double,milli>(
+				chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	bool expired(double t, double now) const { return t + m_ctl->persistence * 1000 <= now; }
+
+	void init(int p, size_t capacity);
+
+	  // take the writers' lock, or try to. Either way a lock whose
+	  // owner died is made usable again.
+	void lock();
+	bool tryLock();
+	bool recover(int rc);
+	void unlock() { pthread_mutex_unlock(&m_ctl->lock); }
+
+	  // with the lock held: where the entry at pos really starts, and the
+	  // header there if there is one
+	size_t offsetOf(unsigned long long pos) const { return pos % m_ctl->capacity; }
+	bool skipsToNextLap(unsigned long long pos) const {
+		return offsetOf(pos) + HEADER_SIZE > m_ctl->capacity;
+	}
+	Header* headerAt(unsigned long long pos) const {
+		return reinterpret_cast<Header*>(m_ring + offsetOf(pos));
+	}
+
+	  // with the lock held: move head up until the ring has room for
+	  // everything before end. Entries are written up to written, and
+	  // nothing is between there and pos.
+	void makeRoom(unsigned long long written, unsigned long long pos, unsigned long long end, double now);
+
+	  // with the lock held: move head past whatever has expired
+	void dropExpired(double now);
+
+	  // drop expired entries off the head, if nobody is writing
+	void cleanData();
+
+	  // copy everything live on the channels from the cursor up to the
+	  // tail into buf, moving the cursor along
+	void scan(Cursor& c, unsigned channels, string& buf, vector<Piece>& pieces);
+
+	template<class View>
+	View collect(Cursor& c, unsigned channels);
+};
+
+SharedDataStore::SharedDataStore(string name, int p, size_t capacity)
+ : m_name(shmName(name)), m_expireOnRead(true), m_map(nullptr), m_mapSize(0),
+   m_ctl(nullptr), m_ring(nullptr)
+{
+	capacity = max((capacity + 7) & ~size_t(7), 2 * HEADER_SIZE);
+
+	int fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	bool created = fd >= 0;
+	if (created) {
+		m_mapSize = RING_OFFSET + capacity;
+		if (ftruncate(fd, m_mapSize) != 0) {
+			close(fd);
+			shm_unlink(m_name.c_str());
+			throw runtime_error("SharedDataStore: can't size " + m_name + ": " + strerror(errno));
+		}
+	}
+	else {
+		if (errno != EEXIST || (fd = shm_open(m_name.c_str(), O_RDWR, 0)) < 0) {
+			throw runtime_error("SharedDataStore: can't open " + m_name + ": " + strerror(errno));
+		}
+
+		  // whoever is creating it may not have sized it yet
+		auto giveUp = chrono::steady_clock::now() + OPEN_WAIT;
+		struct stat st;
+		for (;;) {
+			if (fstat(fd, &st) != 0) {
+				string why = strerror(errno);
+				close(fd);
+				throw runtime_error("SharedDataStore: can't open " + m_name + ": " + why);
+			}
+			if (st.st_size != 0) {
+				break;
+			}
+			if (chrono::steady_clock::now() > giveUp) {
+				close(fd);
+				throw runtime_error("SharedDataStore: " + m_name + " was never set up");
+			}
+			usleep(1000);
+		}
+		if (st.st_size < (off_t)RING_OFFSET) {
+			close(fd);
+			throw runtime_error("SharedDataStore: " + m_name + " isn't a store");
+		}
+		m_mapSize = st.st_size;
+	}
+
+	void* map = mmap(nullptr, m_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		throw runtime_error("SharedDataStore: can't map " + m_name + ": " + strerror(errno));
+	}
+	m_map = static_cast<char*>(map);
+	m_ctl = reinterpret_cast<Control*>(m_map);
+	m_ring = m_map + RING_OFFSET;
+
+	if (created) {
+		init(p, capacity);
+	}
+	else {
+		auto giveUp = chrono::steady_clock::now() + OPEN_WAIT;
+		while (m_ctl->ready.load(memory_order_acquire) == 0) {
+			if (chrono::steady_clock::now() > giveUp) {
+				munmap(m_map, m_mapSize);
+				throw runtime_error("SharedDataStore: " + m_name + " was never set up");
+			}
+			usleep(1000);
+		}
+	}
+}
+
+SharedDataStore::~SharedDataStore()
+{
+	munmap(m_map, m_mapSize);
+}
+
+void SharedDataStore::remove(string name)
+{
+	shm_unlink(shmName(name).c_str());
+}
+
+void SharedDataStore::init(int p, size_t capacity)
+{
+	new (m_ctl) Control();
+	m_ctl->persistence = p;
+	m_ctl->capacity = capacity;
+	m_ctl->nextSeq = 0;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&m_ctl->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	  // anyone else opening it waits for this
+	m_ctl->ready.store(1, memory_order_release);
+}
+
+  // tail and nextSeq only move once a writer's entries are all in, so if
+  // it died holding the lock whatever it left behind is past the tail and
+  // the next writer just writes over it. makeRoom never lets head get so
+  // far behind what's being written that the entries from head to tail
+  // get touched, but when it drops everything head goes past the tail,
+  // and then there's nothing left, so head comes back to the tail.
+bool SharedDataStore::recover(int rc)
+{
+	if (rc == EOWNERDEAD) {
+		unsigned long long tail = m_ctl->tail.load(memory_order_relaxed);
+		if (m_ctl->head.load(memory_order_relaxed) > tail) {
+			m_ctl->head.store(tail);
+		}
+		pthread_mutex_consistent(&m_ctl->lock);
+		m_ctl->recoveries.fetch_add(1);
+		return true;
+	}
+	return rc == 0;
+}
+
+void SharedDataStore::lock()
+{
+	if (!recover(pthread_mutex_lock(&m_ctl->lock))) {
+		throw runtime_error("SharedDataStore: can't lock " + m_name);
+	}
+}
+
+bool SharedDataStore::tryLock()
+{
+	return recover(pthread_mutex_trylock(&m_ctl->lock));
+}
+
+void SharedDataStore::makeRoom(unsigned long long written, unsigned long long pos,
+							   unsigned long long end, double now)
+{
+	const size_t cap = m_ctl->capacity;
+	unsigned long long head = m_ctl->head.load(memory_order_relaxed);
+	while (end - head > cap) {
+		if (head >= written) {
+			head = pos;
+			break;
+		}
+		if (skipsToNextLap(head) || headerAt(head)->state == PADDING) {
+			head += cap - offsetOf(head);
+			continue;
+		}
+		Header* h = headerAt(head);
+		if (!expired(h->time, now)) {
+			m_ctl->overwritten.fetch_add(1);
+		}
+		head += entrySize(h->size);
+	}
+
+	  // readers have to be able to see head has moved before any of what
+	  // it covered gets written over
+	m_ctl->head.store(head);
+	atomic_thread_fence(memory_order_release);
+}
+
+unsigned long long SharedDataStore::write(Channel ch, const string* data, size_t n)
+{
+	const size_t cap = m_ctl->capacity;
+	for (size_t i = 0; i < n; i++) {
+		if (entrySize(data[i].size()) > cap) {
+			throw length_error("SharedDataStore: entry bigger than the ring");
+		}
+	}
+
+	double t = now();
+	lock();
+	if (m_expireOnRead) {
+		dropExpired(t);
+	}
+	unsigned long long first = m_ctl->nextSeq, seq = first;
+	unsigned long long written = m_ctl->tail.load(memory_order_relaxed);
+	for (size_t i = 0; i < n; i++) {
+		size_t need = entrySize(data[i].size());
+		unsigned long long pos = written;
+		size_t off = offsetOf(pos);
+		if (off + need > cap) {
+			pos += cap - off;
+		}
+		makeRoom(written, pos, pos + need, t);
+
+		if (pos != written && !skipsToNextLap(written)) {
+			headerAt(written)->state = PADDING;
+		}
+		Header* h = headerAt(pos);
+		h->time = t;
+		h->seq = seq++;
+		h->size = data[i].size();
+		h->state = ENTRY | ch.id << 8;
+		memcpy(m_ring + offsetOf(pos) + HEADER_SIZE, data[i].data(), data[i].size());
+		written = pos + need;
+	}
+	m_ctl->nextSeq = seq;
+	m_ctl->tail.store(written, memory_order_release);
+	unlock();
+	return first;
+}
+
+void SharedDataStore::cleanData()
+{
+	  // whoever has the lock is writing and will make their own room
+	if (!tryLock()) {
+		return;
+	}
+	dropExpired(now());
+	unlock();
+}
+
+void SharedDataStore::dropExpired(double t)
+{
+	const size_t cap = m_ctl->capacity;
+	unsigned long long head = m_ctl->head.load(memory_order_relaxed);
+	unsigned long long tail = m_ctl->tail.load(memory_order_relaxed);
+	while (head < tail) {
+		if (skipsToNextLap(head) || headerAt(head)->state == PADDING) {
+			head += cap - offsetOf(head);
+		}
+		else if (expired(headerAt(head)->time, t)) {
+			head += entrySize(headerAt(head)->size);
+		}
+		else {
+			break;
+		}
+	}
+	m_ctl->head.store(head);
+}
+
+void SharedDataStore::scan(Cursor& c, unsigned channels, string& buf, vector<Piece>& pieces)
+{
+	const size_t cap = m_ctl->capacity;
+	for (;;) {
+		buf.clear();
+		pieces.clear();
+		unsigned long long tail = m_ctl->tail.load(memory_order_acquire);
+		unsigned long long start = max(c.pos, m_ctl->head.load(memory_order_acquire));
+		unsigned long long pos = start, next = c.next, missed = 0;
+		double t = now();
+
+		while (pos < tail) {
+			size_t off = offsetOf(pos);
+			if (off + HEADER_SIZE > cap) {
+				pos += cap - off;
+				continue;
+			}
+			Header h;
+			memcpy(&h, m_ring + off, HEADER_SIZE);
+			if (h.state == PADDING) {
+				pos += cap - off;
+				continue;
+			}
+			size_t need = entrySize(h.size);
+			if (h.size > cap || off + need > cap || pos + need > tail) {
+				  // a writer got here first - checking head will say so
+				break;
+			}
+
+			  // anything between the last one we saw and this one was
+			  // written over before we got to it, whatever channel it was on
+			if (h.seq > next) {
+				missed += h.seq - next;
+			}
+			next = h.seq + 1;
+			if (channels >> (h.state >> 8) & 1) {
+				if (expired(h.time, t)) {
+					missed++;
+				}
+				else {
+					pieces.push_back(Piece{buf.size(), h.size, h.time});
+					buf.append(m_ring + off + HEADER_SIZE, h.size);
+				}
+			}
+			pos += need;
+		}
+
+		  // if head didn't move past where we started, nothing we copied
+		  // was written over while we were copying it
+		atomic_thread_fence(memory_order_acquire);
+		if (m_ctl->head.load(memory_order_relaxed) <= start) {
+			  // head can only be past the tail after a writer died, and
+			  // then the cursor mustn't stay out there once it's put back
+			c.pos = min(pos, tail);
+			c.next = next;
+			c.missed += missed;
+			return;
+		}
+	}
+}
+
+template<class View>
+View SharedDataStore::collect(Cursor& c, unsigned channels)
+{
+	shared_ptr<string> buf = make_shared<string>();
+	vector<Piece> pieces;
+	scan(c, channels, *buf, pieces);
+
+	View v;
+	for (size_t i = 0; i < pieces.size(); i++) {
+		if constexpr (is_same<View, RecordView>::value) {
+			v.append(buf->data() + pieces[i].off, pieces[i].size, pieces[i].time);
+		}
+		else {
+			v.append(buf->data() + pieces[i].off, pieces[i].size);
+		}
+	}
+	v.pin(buf);
+	return v;
+}
+
+void SharedDataStore::read(string& data)
+{
+	data = view().str();
+}
+
+DataView SharedDataStore::view(unsigned channels)
+{
+	Cursor c;
+	return collect<DataView>(c, channels);
+}
+
+DataView SharedDataStore::readSince(Cursor& c, unsigned channels)
+{
+	return collect<DataView>(c, channels);
+}
+
+RecordView SharedDataStore::records(unsigned channels)
+{
+	Cursor c;
+	return collect<RecordView>(c, channels);
+}
+
+RecordView SharedDataStore::recordsSince(Cursor& c, unsigned channels)
+{
+	return collect<RecordView>(c, channels);
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <ostream>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+using namespace std;
+
+/*
+	What a DataStore has been up to: how much went in, how much came back
+	out and how much expired, plus histograms of how long writes, reads
+	and clean ups took. Get them with stats() and print them with dump()
+	or dumpJson().
+
+	Keeping them costs a couple of adds per call and two reads of the
+	steady clock per timed call. Build with -DDATASTORE_NO_STATS to get
+	rid of even that - the counting and timing compile away to nothing
+	and the stats all stay zero.
+*/
+
+#ifndef DATASTORE_NO_STATS
+#define DATASTORE_STAT(x) do { x; } while (0)
+#else
+#define DATASTORE_STAT(x) do { } while (0)
+#endif
+
+  // counts of how long something took, in power of two buckets of
+  // nanoseconds - bucket b is everything from 2^(b-1) up to 2^b, and
+  // bucket 0 is zero. Coarse, but recording is a few instructions and
+  // it covers nanoseconds to minutes.
+class LatencyHistogram {
+public:
+	static constexpr int BUCKETS = 48;
+
+	LatencyHistogram() : m_count(0), m_totalNs(0), m_maxNs(0) {
+		fill(m_buckets, m_buckets + BUCKETS, 0);
+	}
+
+	void record(uint64_t ns) {
+		int b = ns == 0 ? 0 : min(64 - __builtin_clzll(ns), BUCKETS - 1);
+		m_buckets[b]++;
+		m_count++;
+		m_totalNs += ns;
+		m_maxNs = max(m_maxNs, ns);
+	}
+
+	  // fold another one's times into this one
+	void add(const LatencyHistogram& other) {
+		for (int b = 0; b < BUCKETS; b++) {
+			m_buckets[b] += other.m_buckets[b];
+		}
+		m_count += other.m_count;
+		m_totalNs += other.m_totalNs;
+		m_maxNs = max(m_maxNs, other.m_maxNs);
+	}
+
+	unsigned long long count() const { return m_count; }
+	double meanNs() const { return m_count ? double(m_totalNs) / m_count : 0; }
+	uint64_t maxNs() const { return m_maxNs; }
+	unsigned long long bucket(int b) const { return m_buckets[b]; }
+
+	  // an upper bound on the p'th fraction of times (p in [0,1]), the
+	  // top of the bucket it falls in
+	uint64_t percentileNs(double p) const;
+
+private:
+	unsigned long long m_buckets[BUCKETS];
+	unsigned long long m_count;
+	uint64_t m_totalNs;
+	uint64_t m_maxNs;
+};
+
+  // times the scope it's in into a histogram
+class StatTimer {
+public:
+#ifndef DATASTORE_NO_STATS
+	StatTimer(LatencyHistogram& h) : m_h(h), m_start(chrono::steady_clock::now()) {}
+	~StatTimer() {
+		m_h.record(chrono::duration_cast<chrono::nanoseconds>(
+					chrono::steady_clock::now() - m_start).count());
+	}
+
+private:
+	LatencyHistogram& m_h;
+	chrono::steady_clock::time_point m_start;
+#else
+	StatTimer(LatencyHistogram&) {}
+#endif
+};
+
+struct StoreStats {
+#ifndef DATASTORE_NO_STATS
+	static constexpr bool enabled = true;
+#else
+	static constexpr bool enabled = false;
+#endif
+
+	StoreStats()
+	 : writes(0), bytesWritten(0), reads(0), bytesRead(0), newBytesRead(0),
+	   entriesExpired(0), bytesExpired(0), cleanups(0), deduplicated(0),
+	   liveEntries(0), liveBytes(0), memoryUsed(0), m_writtenAtLastRead(0)
+	{ }
+
+	unsigned long long writes;
+	unsigned long long bytesWritten;
+	  // bytesRead is everything handed back by reads, views and records.
+	  // newBytesRead is how much of that had been written since the read
+	  // before it - the rest is the same data being handed out again.
+	unsigned long long reads;
+	unsigned long long bytesRead;
+	unsigned long long newBytesRead;
+	unsigned long long entriesExpired;
+	unsigned long long bytesExpired;
+	unsigned long long cleanups;
+	  // writes that only refreshed an identical live entry (setDedup)
+	unsigned long long deduplicated;
+
+	  // how the store looked when stats() was called
+	size_t liveEntries;
+	size_t liveBytes;
+	size_t memoryUsed;
+
+	LatencyHistogram writeLatency;
+	LatencyHistogram readLatency;
+	LatencyHistogram cleanLatency;
+
+	  // bytes handed back per byte that was actually new to the reader,
+	  // 1 is a reader that only ever asks for what's new
+	double readAmplification() const {
+		return newBytesRead ? double(bytesRead) / newBytesRead : 0;
+	}
+
+	void wrote(size_t n, size_t bytes) {
+		writes += n;
+		bytesWritten += bytes;
+	}
+	void read(size_t bytes) {
+		reads++;
+		bytesRead += bytes;
+		newBytesRead += min<unsigned long long>(bytes, bytesWritten - m_writtenAtLastRead);
+		m_writtenAtLastRead = bytesWritten;
+	}
+	void expired(size_t bytes) {
+		entriesExpired++;
+		bytesExpired += bytes;
+	}
+
+	void dump(ostream& out) const;
+	void dumpJson(ostream& out) const;
+
+private:
+	unsigned long long m_writtenAtLastRead;
+};
+
+uint64_t LatencyHistogram::percentileNs(double p) const
+{
+	if (m_count == 0) {
+		return 0;
+	}
+	unsigned long long want = max<unsigned long long>(1, (unsigned long long)(p * m_count + 0.5));
+	unsigned long long seen = 0;
+	for (int b = 0; b < BUCKETS; b++) {
+		seen += m_buckets[b];
+		if (seen >= want) {
+			return min(b == 0 ? 0 : uint64_t(1) << b, m_maxNs);
+		}
+	}
+	return m_maxNs;
+}
+
+void StoreStats::dump(ostream& out) const
+{
+	if (!enabled) {
+		out << "stats compiled out (DATASTORE_NO_STATS)" << endl;
+		return;
+	}
+
+	auto latency = [&out](const char* name, const LatencyHistogram& h) {
+		out << name << " latency: " << h.count() << " timed, mean " << (uint64_t)h.meanNs()
+			<< "ns, p50 <" << h.percentileNs(0.5) << "ns, p99 <" << h.percentileNs(0.99)
+			<< "ns, max " << h.maxNs() << "ns" << endl;
+	};
+
+	out << "writes: " << writes << " (" << bytesWritten << " bytes, " << deduplicated
+		<< " deduplicated)" << endl;
+	out << "reads: " << reads << " (" << bytesRead << " bytes, " << newBytesRead
+		<< " new, amplification " << readAmplification() << ")" << endl;
+	out << "expired: " << entriesExpired << " (" << bytesExpired << " bytes) over "
+		<< cleanups << " clean ups" << endl;
+	out << "live: " << liveEntries << " entries, " << liveBytes << " bytes, "
+		<< memoryUsed << " bytes of memory" << endl;
+	latency("write", writeLatency);
+	latency("read", readLatency);
+	latency("clean", cleanLatency);
+}
+
+void StoreStats::dumpJson(ostream& out) const
+{
+	auto latency = [&out](const char* name, const LatencyHistogram& h) {
+		out << "\"" << name << "\":{\"count\":" << h.count() << ",\"mean_ns\":" << h.meanNs()
+			<< ",\"p50_ns\":" << h.percentileNs(0.5) << ",\"p99_ns\":" << h.percentileNs(0.99)
+			<< ",\"p999_ns\":" << h.percentileNs(0.999) << ",\"max_ns\":" << h.maxNs()
+			<< ",\"buckets\":[";
+		  // trailing empty buckets aren't worth printing
+		int last = LatencyHistogram::BUCKETS - 1;
+		while (last > 0 && h.bucket(last) == 0) {
+			last--;
+		}
+		for (int b = 0; b <= last; b++) {
+			out << (b ? "," : "") << h.bucket(b);
+		}
+		out << "]}";
+	};
+
+	out << "{\"enabled\":" << (enabled ? "true" : "false")
+		<< ",\"writes\":" << writes << ",\"bytes_written\":" << bytesWritten
+		<< ",\"reads\":" << reads << ",\"bytes_read\":" << bytesRead
+		<< ",\"new_bytes_read\":" << newBytesRead
+		<< ",\"read_amplification\":" << readAmplification()
+		<< ",\"entries_expired\":" << entriesExpired << ",\"bytes_expired\":" << bytesExpired
+		<< ",\"cleanups\":" << cleanups << ",\"deduplicated\":" << deduplicated
+		<< ",\"live_entries\":" << liveEntries << ",\"live_bytes\":" << liveBytes
+		<< ",\"memory_used\":" << memoryUsed << ",";
+	latency("write_latency", writeLatency);
+	out << ",";
+	latency("read_latency", readLatency);
+	out << ",";
+	latency("clean_latency", cleanLatency);
+	out << "}";
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+using namespace std;
+
+/*
+	A hierarchical timing wheel, the way kernels keep track of huge
+	numbers of timers. Time is measured in ticks. The bottom level has one
+	slot per tick for the next 256 ticks, the level above has one slot per
+	256 ticks for the next 256*256, and so on. Scheduling something drops
+	it into the slot for its level, and as time moves forward the slots of
+	the upper levels get poured down into the lower ones until things land
+	in a bottom slot and fire.
+
+	Scheduling is O(1), and each item gets moved down at most once per
+	level before it fires, so expiry stays O(1) amortized however mixed
+	the timeouts are.
+*/
+template<class T>
+class TimingWheel {
+public:
+	  // start counting at tick now
+	TimingWheel(unsigned long long now = 0);
+
+	  // fire item once tick when has passed
+	void schedule(T item, unsigned long long when);
+
+	  // move the clock up through tick now, calling f(item) for
+	  // everything that was due by then
+	template<class Func>
+	void advance(unsigned long long now, Func f);
+
+	  // number of items waiting to fire
+	size_t size() const { return m_count; }
+
+private:
+	static constexpr int LEVELS = 4;
+	static constexpr int SLOT_BITS = 8;
+	static constexpr unsigned long long SLOTS = 1ULL << SLOT_BITS;
+	static constexpr unsigned long long MASK = SLOTS - 1;
+
+	  // the next tick we haven't processed yet
+	unsigned long long m_now;
+	size_t m_count;
+
+	vector<pair<T,unsigned long long>> m_slots[LEVELS][SLOTS];
+	size_t m_levelCount[LEVELS];
+
+	  // things scheduled for a tick we've already been through, they
+	  // go off the next time we advance at all
+	vector<pair<T,unsigned long long>> m_due;
+
+	static int shift(int level) { return level * SLOT_BITS; }
+
+	  // put something in the right slot relative to m_now
+	void place(T item, unsigned long long when);
+
+	  // pour level's slot for the current time down a level
+	void cascade(int level);
+};
+
+template<class T>
+TimingWheel<T>::TimingWheel(unsigned long long now)
+ : m_now(now), m_count(0)
+{
+	for (int l = 0; l < LEVELS; l++) {
+		m_levelCount[l] = 0;
+	}
+}
+
+template<class T>
+void TimingWheel<T>::schedule(T item, unsigned long long when)
+{
+	m_count++;
+	place(item, when);
+}
+
+template<class T>
+void TimingWheel<T>::place(T item, unsigned long long when)
+{
+	if (when < m_now) {
+		m_due.push_back(make_pair(item, when));
+		return;
+	}
+
+	unsigned long long delta = when - m_now;
+	int level = 0;
+	while (level < LEVELS - 1 && delta >= (SLOTS << shift(level))) {
+		level++;
+	}
+
+	unsigned long long slot;
+	if (delta >= (SLOTS << shift(level))) {
+		  // further out than the whole wheel covers - park it in the top
+		  // level's last slot, it gets placed again when that's poured down
+		slot = ((m_now >> shift(level)) + MASK) & MASK;
+	}
+	else {
+		slot = (when >> shift(level)) & MASK;
+	}
+
+	m_slots[level][slot].push_back(make_pair(item, when));
+	m_levelCount[level]++;
+}
+
+template<class T>
+void TimingWheel<T>::cascade(int level)
+{
+	vector<pair<T,unsigned long long>>& slot = m_slots[level][(m_now >> shift(level)) & MASK];
+	if (slot.empty()) {
+		return;
+	}
+
+	  // swap it out first, placing things can land them right back in
+	  // this same slot when they're far enough out
+	vector<pair<T,unsigned long long>> items;
+	items.swap(slot);
+	m_levelCount[level] -= items.size();
+	for (size_t i = 0; i < items.size(); i++) {
+		place(items[i].first, items[i].second);
+	}
+
+	  // hand the memory back so the slot doesn't have to grow again
+	items.clear();
+	if (slot.empty()) {
+		slot.swap(items);
+	}
+}
+
+template<class T>
+template<class Func>
+void TimingWheel<T>::advance(unsigned long long now, Func f)
+{
+	m_count -= m_due.size();
+	for (size_t i = 0; i < m_due.size(); i++) {
+		f(m_due[i].first);
+	}
+	m_due.clear();
+
+	while (m_now <= now) {
+		if (m_count == 0) {
+			m_now = now + 1;
+			return;
+		}
+
+		  // on a boundary the upper levels get poured down, the
+		  // highest first
+		for (int l = LEVELS - 1; l > 0; l--) {
+			if ((m_now & ((1ULL << shift(l)) - 1)) == 0) {
+				cascade(l);
+			}
+		}
+
+		vector<pair<T,unsigned long long>>& slot = m_slots[0][m_now & MASK];
+		m_levelCount[0] -= slot.size();
+		m_count -= slot.size();
+		for (size_t i = 0; i < slot.size(); i++) {
+			f(slot[i].first);
+		}
+		slot.clear();
+		m_now++;
+
+		  // nothing below level l means nothing can happen until the next
+		  // level l boundary, so skip straight there
+		int empty = 0;
+		while (empty < LEVELS - 1 && m_levelCount[empty] == 0) {
+			empty++;
+		}
+		if (empty > 0) {
+			unsigned long long span = 1ULL << shift(empty);
+			unsigned long long boundary = (m_now + span - 1) & ~(span - 1);
+			m_now = min(boundary, now + 1);
+		}
+	}
+}
+
+#endif
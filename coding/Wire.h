@@ -0,0 +1,141 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+using namespace std;
+
+/*
+	The binary protocol DataStoreServer and RemoteDataStore speak over a
+	Unix domain socket. Everything goes in frames:
+
+		size:u32  op:u32  body (size bytes)
+
+	Numbers are in host byte order - both ends are on the same machine.
+	Every request gets exactly one reply, in the order the requests were
+	sent, so a client can send as many as it likes before reading any
+	replies back (pipelining).
+
+	Requests:
+		WRITE          channel:u32 count:u32 then count times (len:u32 data)
+		               -> OK
+		RECORDS        channels:u32
+		               -> RECORDS_REPLY with everything live
+		RECORDS_SINCE  channels:u32 next:u64 missed:u64 pos:u64
+		               -> RECORDS_REPLY with what's new since that cursor
+		               Either reply only carries so much. If there was
+		               more, more is 1, and RECORDS_SINCE from the cursor
+		               it came back with gets the rest.
+		SUBSCRIBE      channels:u32 next:u64 missed:u64 pos:u64
+		               -> a RECORDS_REPLY every time there's something new,
+		                  for as long as the connection stays open. A
+		                  connection that subscribes can't do anything else.
+
+	Replies:
+		OK             (empty)
+		RECORDS_REPLY  next:u64 missed:u64 pos:u64 more:u32 count:u32 then
+		               count times (time:f64 len:u32 data)
+		ERROR          message, then the server hangs up
+
+	Between ReplicatedDataStore nodes, which don't reply:
+		REPLICATE      count:u32 then count times (origin:u32
+		               incarnation:u64 seq:u64 channel:u32 written:u64
+		               len:u32 data)
+*/
+struct Wire {
+	enum Op : uint32_t {
+		WRITE = 1, RECORDS, RECORDS_SINCE, SUBSCRIBE,
+		OK = 100, RECORDS_REPLY, ERROR,
+		REPLICATE = 200
+	};
+
+	static constexpr size_t HEADER_SIZE = 8;
+	  // anything claiming to be bigger than this is garbage
+	static constexpr size_t MAX_FRAME = 64 << 20;
+
+	  // builds one frame on the end of out
+	class Writer {
+	public:
+		Writer(string& out, uint32_t op) : m_out(out), m_start(out.size()) {
+			put32(0);
+			put32(op);
+		}
+
+		void put32(uint32_t v)  { m_out.append(reinterpret_cast<const char*>(&v), 4); }
+		void put64(uint64_t v)  { m_out.append(reinterpret_cast<const char*>(&v), 8); }
+		void putDouble(double v) { m_out.append(reinterpret_cast<const char*>(&v), 8); }
+		void putBytes(const char* p, size_t n) {
+			put32(n);
+			m_out.append(p, n);
+		}
+
+		  // fill in the size now the body is all there
+		void end() {
+			uint32_t size = m_out.size() - m_start - HEADER_SIZE;
+			memcpy(&m_out[m_start], &size, 4);
+		}
+
+	private:
+		string& m_out;
+		size_t m_start;
+	};
+
+	  // takes a frame's body apart. Reading past the end doesn't crash,
+	  // it just makes ok() false.
+	class Reader {
+	public:
+		Reader(const char* p, size_t n) : m_p(p), m_end(p + n), m_ok(true) {}
+
+		uint32_t get32()    { uint32_t v = 0; take(&v, 4); return v; }
+		uint64_t get64()    { uint64_t v = 0; take(&v, 8); return v; }
+		double getDouble()  { double v = 0; take(&v, 8); return v; }
+		string_view getBytes() {
+			size_t n = get32();
+			if (!m_ok || n > size_t(m_end - m_p)) {
+				m_ok = false;
+				return string_view();
+			}
+			string_view s(m_p, n);
+			m_p += n;
+			return s;
+		}
+
+		bool ok() const { return m_ok; }
+
+	private:
+		const char* m_p;
+		const char* m_end;
+		bool m_ok;
+
+		void take(void* v, size_t n) {
+			if (!m_ok || n > size_t(m_end - m_p)) {
+				m_ok = false;
+				return;
+			}
+			memcpy(v, m_p, n);
+			m_p += n;
+		}
+	};
+
+	  // is there a whole frame at the start of p[0..n)? If so, what it is
+	  // and how long its body is. A size past MAX_FRAME sets bad.
+	static bool frameAt(const char* p, size_t n, uint32_t& op, size_t& size, bool& bad) {
+		bad = false;
+		if (n < HEADER_SIZE) {
+			return false;
+		}
+		uint32_t s;
+		memcpy(&s, p, 4);
+		memcpy(&op, p + 4, 4);
+		size = s;
+		if (size > MAX_FRAME) {
+			bad = true;
+			return false;
+		}
+		return n >= HEADER_SIZE + size;
+	}
+};
+
+#endif
@@ -0,0 +1,450 @@
+#ifndef WRITEAHEADLOG_H
+#define WRITEAHEADLOG_H
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <stdexcept>
+#include <filesystem>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Stats.h"
+using namespace std;
+
+/*
+	A WriteAheadLog is what makes a DataStore durable (see setDurable).
+	Every write is appended to it, and once it's on disk it survives the
+	process dying; opening the log again hands back everything that
+	hasn't expired yet so the store can be filled back up.
+
+	Appending only copies the records into a buffer. A committer thread
+	writes the buffer out and fdatasyncs it, so whatever piles up while
+	one sync is going on goes out with the next - one sync for a whole
+	batch of writes (group commit). The committer waits up to maxDelay
+	after the first write of a batch for more to come along, so a write
+	is on disk within that plus two syncs (the one already going when it
+	came in, and its own). Anyone waiting on a write gets it committed
+	without the wait.
+
+	The log is a directory of files, wal-<n>.log, each one a run of
+	records:
+
+		size:u32  check:u32  channel:u32  0:u32  written:f64  ttl:f64  data
+
+	written is the wall clock in milliseconds and ttl is in milliseconds
+	too, so it still means something to whoever opens the log next.
+	check is a hash of everything after it, so a record that was only
+	half written when the process died is where that file stops. When a
+	file gets past segmentSize the next batch starts a new one, and a
+	file is deleted once everything in it has expired.
+*/
+
+  // what the log has been up to. commitLatency is how long the first
+  // write of each batch took to be on disk, the longest any write in
+  // the batch waited.
+struct WalStats {
+	unsigned long long appended;
+	unsigned long long bytesAppended;
+	unsigned long long commits;
+	unsigned long long recovered;
+	unsigned long long discarded;
+	size_t segments;
+	LatencyHistogram commitLatency;
+	LatencyHistogram syncLatency;
+
+	WalStats()
+	 : appended(0), bytesAppended(0), commits(0), recovered(0), discarded(0), segments(0)
+	{ }
+
+	double writesPerCommit() const { return commits ? double(appended) / commits : 0; }
+};
+
+class WriteAheadLog {
+public:
+	static constexpr size_t SEGMENT_SIZE = 4 << 20;
+
+	  // one record read back out of the log
+	struct Record {
+		unsigned channel;
+		double written;
+		double ttl;
+		string_view data;
+	};
+
+	  // open the log in dir, creating it if need be. Nothing already in
+	  // it is touched until replay. Throws runtime_error if the
+	  // directory or a file in it can't be opened.
+	WriteAheadLog(string dir, chrono::microseconds maxDelay = chrono::milliseconds(2),
+				  size_t segmentSize = SEGMENT_SIZE);
+	  // commits whatever is still waiting first
+	~WriteAheadLog();
+
+	WriteAheadLog(const WriteAheadLog&) = delete;
+	WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+	  // hand f every record from before this log was opened, oldest
+	  // first, that is still live at wall clock time now (ms). The ones
+	  // that aren't are counted as discarded.
+	template<class Func>
+	void replay(double now, Func f);
+
+	  // add n records, all written at wall clock time written with the
+	  // same ttl (both ms). Returns the log sequence number after the
+	  // last of them, which is what to waitFor. Throws runtime_error if
+	  // the committer couldn't write to the disk.
+	unsigned long long append(unsigned channel, const string* data, size_t n,
+							  double written, double ttl);
+
+	  // block until everything up to lsn is on disk
+	void waitFor(unsigned long long lsn);
+	void sync();
+
+	  // delete files where everything has expired by wall clock time now
+	void expire(double now);
+
+	WalStats stats() const;
+
+private:
+	using Clock = chrono::steady_clock;
+
+	struct Header {
+		uint32_t size;
+		uint32_t check;
+		uint32_t channel;
+		uint32_t unused;
+		double written;
+		double ttl;
+	};
+	static constexpr size_t HEADER_SIZE = sizeof(Header);
+	  // don't let one batch get bigger than this before it goes out
+	static constexpr size_t MAX_BATCH = 4 << 20;
+
+	  // a file of the log, and when the last thing in it expires
+	struct Segment {
+		unsigned long long id;
+		string path;
+		double lastExpiry;
+	};
+
+	string m_dir;
+	chrono::microseconds m_maxDelay;
+	size_t m_segmentSize;
+
+	mutable mutex m_lock;
+	condition_variable m_wake;
+	condition_variable m_committed;
+
+	  // files from before we opened, and the ones we've written since.
+	  // The last one is being written to.
+	deque<Segment> m_old;
+	deque<Segment> m_segments;
+	int m_fd;
+	size_t m_fileSize;
+
+	  // what's been appended but not written out yet
+	string m_buffer;
+	double m_bufferExpiry;
+	Clock::time_point m_oldest;
+
+	unsigned long long m_appended;
+	unsigned long long m_durable;
+	int m_waiting;
+	bool m_stop;
+	string m_error;
+
+	WalStats m_stats;
+	thread m_thread;
+
+	static uint32_t checksum(const char* p, size_t n, uint32_t h = 2166136261u) {
+		for (size_t i = 0; i < n; i++) {
+			h = (h ^ (unsigned char)p[i]) * 16777619u;
+		}
+		return h;
+	}
+
+	string pathOf(unsigned long long id) const {
+		char name[32];
+		snprintf(name, sizeof(name), "wal-%020llu.log", id);
+		return m_dir + "/" + name;
+	}
+
+	void openSegment(unsigned long long id);
+	void run();
+};
+
+WriteAheadLog::WriteAheadLog(string dir, chrono::microseconds maxDelay, size_t segmentSize)
+ : m_dir(dir), m_maxDelay(maxDelay), m_segmentSize(segmentSize), m_fd(-1), m_fileSize(0),
+   m_bufferExpiry(0), m_appended(0), m_durable(0), m_waiting(0), m_stop(false)
+{
+	filesystem::create_directories(m_dir);
+
+	  // zero padded, so sorting the names puts them in order
+	vector<string> names;
+	for (const auto& f : filesystem::directory_iterator(m_dir)) {
+		string name = f.path().filename().string();
+		if (name.size() > 8 && name.compare(0, 4, "wal-") == 0
+			&& name.compare(name.size() - 4, 4, ".log") == 0) {
+			names.push_back(name);
+		}
+	}
+	sort(names.begin(), names.end());
+
+	unsigned long long next = 0;
+	for (size_t i = 0; i < names.size(); i++) {
+		unsigned long long id = stoull(names[i].substr(4, names[i].size() - 8));
+		m_old.push_back(Segment{id, m_dir + "/" + names[i], 0});
+		next = id + 1;
+	}
+
+	  // never append to an old file, its end might be half a record
+	openSegment(next);
+	m_thread = thread(&WriteAheadLog::run, this);
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+	close(m_fd);
+}
+
+void WriteAheadLog::openSegment(unsigned long long id)
+{
+	string path = pathOf(id);
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		throw runtime_error("WriteAheadLog: can't open " + path + ": " + strerror(errno));
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+	m_fd = fd;
+	m_fileSize = 0;
+	m_segments.push_back(Segment{id, path, 0});
+
+	  // the new file's name has to be on disk too, or it's lost
+	  // along with everything in it
+	int d = open(m_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (d >= 0) {
+		fsync(d);
+		close(d);
+	}
+}
+
+template<class Func>
+void WriteAheadLog::replay(double now, Func f)
+{
+	unsigned long long recovered = 0, discarded = 0;
+	for (Segment& s : m_old) {
+		string contents;
+		FILE* in = fopen(s.path.c_str(), "rb");
+		if (in == nullptr) {
+			throw runtime_error("WriteAheadLog: can't read " + s.path + ": " + strerror(errno));
+		}
+		char buf[64 * 1024];
+		size_t got;
+		while ((got = fread(buf, 1, sizeof(buf), in)) > 0) {
+			contents.append(buf, got);
+		}
+		fclose(in);
+
+		  // stop at the first record that isn't all there
+		size_t off = 0;
+		while (off + HEADER_SIZE <= contents.size()) {
+			Header h;
+			memcpy(&h, contents.data() + off, HEADER_SIZE);
+			if (h.size > contents.size() - off - HEADER_SIZE
+				|| h.check != checksum(contents.data() + off + 8, HEADER_SIZE - 8 + h.size)) {
+				break;
+			}
+			off += HEADER_SIZE + h.size;
+
+			s.lastExpiry = max(s.lastExpiry, h.written + h.ttl);
+			if (h.written + h.ttl <= now) {
+				discarded++;
+				continue;
+			}
+			recovered++;
+			f(Record{h.channel, h.written, h.ttl,
+					 string_view(contents.data() + off - h.size, h.size)});
+		}
+	}
+
+	  // they stay until what's in them expires, same as the new ones
+	lock_guard<mutex> lock(m_lock);
+	m_segments.insert(m_segments.begin(), m_old.begin(), m_old.end());
+	m_old.clear();
+	m_stats.recovered += recovered;
+	m_stats.discarded += discarded;
+}
+
+unsigned long long WriteAheadLog::append(unsigned channel, const string* data, size_t n,
+										 double written, double ttl)
+{
+	bool wake;
+	unsigned long long lsn;
+	{
+		lock_guard<mutex> lock(m_lock);
+		if (!m_error.empty()) {
+			throw runtime_error(m_error);
+		}
+		bool first = m_buffer.empty();
+		if (first) {
+			m_oldest = Clock::now();
+		}
+
+		size_t bytes = 0;
+		for (size_t i = 0; i < n; i++) {
+			Header h;
+			h.size = data[i].size();
+			h.channel = channel;
+			h.unused = 0;
+			h.written = written;
+			h.ttl = ttl;
+			h.check = checksum(reinterpret_cast<const char*>(&h) + 8, HEADER_SIZE - 8);
+			h.check = checksum(data[i].data(), data[i].size(), h.check);
+			m_buffer.append(reinterpret_cast<const char*>(&h), HEADER_SIZE);
+			m_buffer.append(data[i]);
+			bytes += data[i].size();
+		}
+		m_bufferExpiry = max(m_bufferExpiry, written + ttl);
+		m_appended += n;
+		lsn = m_appended;
+		m_stats.appended += n;
+		m_stats.bytesAppended += bytes;
+
+		  // the committer only needs waking to start timing a batch, or
+		  // to stop waiting for one that's already big enough
+		wake = first || m_buffer.size() >= MAX_BATCH;
+	}
+	if (wake) {
+		m_wake.notify_one();
+	}
+	return lsn;
+}
+
+void WriteAheadLog::waitFor(unsigned long long lsn)
+{
+	unique_lock<mutex> lock(m_lock);
+	m_waiting++;
+	m_wake.notify_one();
+	m_committed.wait(lock, [this, lsn]() { return m_durable >= lsn || !m_error.empty(); });
+	m_waiting--;
+	if (m_durable < lsn) {
+		throw runtime_error(m_error);
+	}
+}
+
+void WriteAheadLog::sync()
+{
+	unsigned long long lsn;
+	{
+		lock_guard<mutex> lock(m_lock);
+		lsn = m_appended;
+	}
+	waitFor(lsn);
+}
+
+void WriteAheadLog::expire(double now)
+{
+	lock_guard<mutex> lock(m_lock);
+	while (m_segments.size() > 1 && m_segments.front().lastExpiry <= now) {
+		unlink(m_segments.front().path.c_str());
+		m_segments.pop_front();
+	}
+}
+
+WalStats WriteAheadLog::stats() const
+{
+	lock_guard<mutex> lock(m_lock);
+	WalStats s = m_stats;
+	s.segments = m_segments.size() + m_old.size();
+	return s;
+}
+
+void WriteAheadLog::run()
+{
+	unique_lock<mutex> lock(m_lock);
+	for (;;) {
+		m_wake.wait(lock, [this]() { return m_stop || !m_buffer.empty(); });
+		if (m_buffer.empty()) {
+			break;
+		}
+
+		  // give the batch until maxDelay after its first write to fill
+		  // up, unless somebody's waiting on it
+		m_wake.wait_until(lock, m_oldest + m_maxDelay, [this]() {
+			return m_stop || m_waiting > 0 || m_buffer.size() >= MAX_BATCH;
+		});
+
+		string batch;
+		batch.swap(m_buffer);
+		unsigned long long lsn = m_appended;
+		double expiry = m_bufferExpiry;
+		m_bufferExpiry = 0;
+		Clock::time_point oldest = m_oldest;
+		int fd = m_fd;
+		lock.unlock();
+
+		  // everything but this is done under the lock, so appends only
+		  // ever wait for the committer to swap buffers
+		string error;
+		size_t off = 0;
+		while (off < batch.size()) {
+			ssize_t wrote = ::write(fd, batch.data() + off, batch.size() - off);
+			if (wrote < 0 && errno == EINTR) {
+				continue;
+			}
+			if (wrote < 0) {
+				error = string("WriteAheadLog: can't write: ") + strerror(errno);
+				break;
+			}
+			off += wrote;
+		}
+		Clock::time_point syncStart = Clock::now();
+		if (error.empty() && fdatasync(fd) != 0) {
+			error = string("WriteAheadLog: can't sync: ") + strerror(errno);
+		}
+		Clock::time_point done = Clock::now();
+
+		lock.lock();
+		if (!error.empty()) {
+			m_error = error;
+			m_committed.notify_all();
+			break;
+		}
+		m_segments.back().lastExpiry = max(m_segments.back().lastExpiry, expiry);
+		m_fileSize += batch.size();
+		m_durable = lsn;
+		m_stats.commits++;
+		m_stats.commitLatency.record(chrono::duration_cast<chrono::nanoseconds>(done - oldest).count());
+		m_stats.syncLatency.record(chrono::duration_cast<chrono::nanoseconds>(done - syncStart).count());
+		m_committed.notify_all();
+
+		if (m_fileSize >= m_segmentSize) {
+			try {
+				openSegment(m_segments.back().id + 1);
+			}
+			catch (const runtime_error& e) {
+				m_error = e.what();
+				m_committed.notify_all();
+				break;
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,556 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <filesystem>
+#include <unistd.h>
+#include "DataStore.h"
+#include "ConcurrentDataStore.h"
+#include "ReplicatedDataStore.h"
+#include "BufferedDataStore.h"
+#include "Application.h"
+using namespace std;
+
+/*
+	Benchmarks for the storage layer:
+
+		write    write throughput for a range of message sizes
+		read     how long reads take as the amount of live data grows,
+		         whole or just the newest 1% by time
+		expiry   what expiring costs at different ttls and write rates
+		replay   N Applications heartbeating, broadcasting and reading,
+		         the traffic the store is actually for
+		durable  write throughput and commit latency with a write-ahead log
+		replicate  ReplicatedDataStore nodes all writing at once over a
+		         SimulatedNetwork, for lag and throughput as nodes are added
+		buffered  threads writing through a BufferedDataStore at a few
+		         merge delays, against writing to the store directly
+
+		./bench [--quick] [which ...]
+
+	Every result is one line of JSON on stdout, so runs can be saved and
+	compared to catch regressions; progress goes to stderr. --quick does
+	less of everything, for a smoke test.
+*/
+
+using Clock = chrono::steady_clock;
+
+static bool quick = false;
+
+static double secondsSince(Clock::time_point start)
+{
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+  // one result, printed as a line of JSON when it goes out of scope
+class Row {
+public:
+	Row(string bench) { m_out << "{\"bench\":\"" << bench << "\""; }
+	~Row() { cout << m_out.str() << "}" << endl; }
+
+	Row& add(const char* key, const string& v) {
+		m_out << ",\"" << key << "\":\"" << v << "\"";
+		return *this;
+	}
+	Row& add(const char* key, double v) {
+		m_out << ",\"" << key << "\":" << v;
+		return *this;
+	}
+
+private:
+	ostringstream m_out;
+};
+
+  // the middle of a handful of runs, to keep one slow one from
+  // throwing things off
+template<class Func>
+static double medianNs(int runs, Func f)
+{
+	vector<double> ns;
+	for (int i = 0; i < runs; i++) {
+		Clock::time_point start = Clock::now();
+		f();
+		ns.push_back(chrono::duration<double,nano>(Clock::now() - start).count());
+	}
+	sort(ns.begin(), ns.end());
+	return ns[ns.size() / 2];
+}
+
+/*
+	write
+*/
+
+template<class Store>
+static void writeThroughput(string name, size_t payload)
+{
+	size_t n = (quick ? 8 : 64) * (1 << 20) / max<size_t>(payload, 64);
+	string msg(payload, 'x');
+	Store store(60);
+
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < n; i++) {
+		store.write(msg);
+	}
+	double secs = secondsSince(start);
+
+	Row("write").add("store", name).add("threads", 1).add("payload", payload)
+		.add("ops_per_sec", n / secs).add("mb_per_sec", n * payload / secs / 1e6)
+		.add("ns_per_op", secs * 1e9 / n);
+}
+
+static void concurrentWriteThroughput(int threads, size_t payload)
+{
+	size_t n = (quick ? 8 : 64) * (1 << 20) / max<size_t>(payload, 64) / threads;
+	string msg(payload, 'x');
+	ConcurrentDataStore store(60);
+
+	Clock::time_point start = Clock::now();
+	vector<thread> writers;
+	for (int t = 0; t < threads; t++) {
+		writers.push_back(thread([&store, &msg, n]() {
+			for (size_t i = 0; i < n; i++) {
+				store.write(msg);
+			}
+		}));
+	}
+	for (thread& t : writers) {
+		t.join();
+	}
+	double secs = secondsSince(start);
+
+	Row("write").add("store", "ConcurrentDataStore").add("threads", threads).add("payload", payload)
+		.add("ops_per_sec", n * threads / secs).add("mb_per_sec", n * threads * payload / secs / 1e6)
+		.add("ns_per_op", secs * 1e9 / (n * threads));
+}
+
+static void benchWrite()
+{
+	for (size_t payload : {16, 64, 256, 1024, 4096}) {
+		cerr << "write " << payload << endl;
+		writeThroughput<DataStore>("DataStore", payload);
+		writeThroughput<ConcurrentDataStore>("ConcurrentDataStore", payload);
+		concurrentWriteThroughput(4, payload);
+	}
+
+	  // the same bytes in batches, for comparison
+	for (size_t batch : {8, 64}) {
+		size_t n = (quick ? 1 : 8) * (1 << 20) / 64;
+		vector<string> msgs(batch, string(64, 'x'));
+		DataStore store(60);
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < n; i += batch) {
+			store.write(msgs);
+		}
+		double secs = secondsSince(start);
+		Row("write").add("store", "DataStore").add("threads", 1).add("payload", 64)
+			.add("batch", batch).add("ops_per_sec", n / secs).add("ns_per_op", secs * 1e9 / n);
+	}
+}
+
+/*
+	read
+*/
+
+static void benchRead()
+{
+	vector<size_t> sizes = {1000, 10000, 100000};
+	if (!quick) {
+		sizes.push_back(1000000);
+	}
+	int runs = quick ? 5 : 21;
+
+	for (size_t live : sizes) {
+		cerr << "read " << live << endl;
+		DataStore store(600);
+		string msg(64, 'x');
+		double recent = 0;
+		for (size_t i = 0; i < live; i++) {
+			if (i == live - live / 100) {
+				recent = store.elapsed();
+			}
+			store.write(msg);
+		}
+
+		string s;
+		double viewNs = medianNs(runs, [&store]() { store.view(); });
+		double readNs = medianNs(runs, [&store, &s]() { store.read(s); });
+		double recordsNs = medianNs(runs, [&store]() { store.records(); });
+		double rangeNs = medianNs(runs, [&store, recent]() {
+			store.recordsRange(recent, store.elapsed());
+		});
+
+		  // a reader keeping up only ever looks at what's new
+		DataStore::Cursor cursor;
+		store.readSince(cursor);
+		double sinceNs = medianNs(runs, [&store, &cursor, &msg]() {
+			for (int i = 0; i < 100; i++) {
+				store.write(msg);
+			}
+			store.readSince(cursor);
+		});
+
+		Row("read").add("store", "DataStore").add("live_entries", live)
+			.add("live_bytes", live * msg.size()).add("view_ns", viewNs).add("read_ns", readNs)
+			.add("records_ns", recordsNs).add("range_recent_1pct_ns", rangeNs)
+			.add("since_100_new_ns", sinceNs);
+	}
+}
+
+/*
+	expiry - on a virtual clock, so the simulated write rate and ttl
+	don't depend on how fast the machine is and only the time spent in
+	expire() is real
+*/
+
+static void benchExpiry()
+{
+	for (double ttl : {1.0, 10.0, 60.0}) {
+		for (int perMs : {1, 10, 100}) {
+			if (quick && ttl * perMs > 100) {
+				continue;
+			}
+			cerr << "expiry ttl " << ttl << "s, " << perMs << " writes/ms" << endl;
+			BasicDataStore<VirtualClock> store(ttl);
+			store.setExpireOnRead(false);
+			string msg(64, 'x');
+
+			  // fill up to a steady state first, then time a few seconds
+			  // of virtual writing and expiring every 10ms
+			long warm = ttl * 1000;
+			long measure = quick ? 1000 : 5000;
+			double expireNs = 0;
+			unsigned long long expiredBefore = 0;
+			for (long ms = 0; ms < warm + measure; ms++) {
+				for (int i = 0; i < perMs; i++) {
+					store.write(msg);
+				}
+				store.advance(1);
+				if (ms % 10 == 9) {
+					if (ms < warm) {
+						store.expire();
+						continue;
+					}
+					Clock::time_point start = Clock::now();
+					store.expire();
+					expireNs += chrono::duration<double,nano>(Clock::now() - start).count();
+				}
+				if (ms == warm - 1) {
+					expiredBefore = store.nextSequence() - store.stats().liveEntries;
+				}
+			}
+			unsigned long long expired = store.nextSequence() - store.stats().liveEntries - expiredBefore;
+
+			Row("expiry").add("store", "DataStore").add("ttl_s", ttl).add("writes_per_ms", perMs)
+				.add("live_entries", store.stats().liveEntries).add("expired", expired)
+				.add("expire_calls", measure / 10).add("ns_per_expire_call", expireNs / (measure / 10))
+				.add("ns_per_expired_entry", expired ? expireNs / expired : 0);
+		}
+	}
+}
+
+/*
+	replay - N Applications on one store, each round every one of them
+	heartbeats, takes a new reading, broadcasts what it has and reads
+	what the others said. Every few rounds they all connect again.
+
+	SimpleStorage keeps everything, and since broadcast sends everything
+	stored (including what came from everyone else) the traffic would
+	grow geometrically round after round. The apps here only hold on to
+	their last few readings instead, so every round looks about the same.
+*/
+
+struct Reading {
+	string value;
+	Reading(string s) : value(s) {}
+	string to_writeable() { return value; }
+};
+
+template<class DataType>
+class RecentStorage {
+public:
+	static constexpr int KEEP = 8;
+
+	int store(DataType data) {
+		int idx = m_next++ % KEEP;
+		if ((int)m_vec.size() < KEEP) {
+			m_vec.push_back(data);
+		}
+		else {
+			m_vec[idx] = data;
+		}
+		return idx;
+	}
+	int      size() const       { return m_vec.size(); }
+	DataType get(int idx) const { return m_vec[idx]; }
+
+private:
+	vector<DataType> m_vec;
+	int m_next = 0;
+};
+
+using ReplayApp = Application<SimpleProtocol,SimpleEncoding,Reading,RecentStorage,
+							  BasicDataStore<VirtualClock>>;
+
+static void benchReplay()
+{
+	for (int apps : {4, 16, 64}) {
+		cerr << "replay " << apps << " apps" << endl;
+		int rounds = quick ? 10 : 200;
+		BasicDataStore<VirtualClock> store(1);
+
+		vector<unique_ptr<ReplayApp>> all;
+		for (int a = 0; a < apps; a++) {
+			char addr[12];
+			snprintf(addr, sizeof(addr), "%03d", a);
+			all.push_back(unique_ptr<ReplayApp>(new ReplayApp(addr, store)));
+		}
+
+		Clock::time_point start = Clock::now();
+		unsigned long long stored = 0;
+		for (int r = 0; r < rounds; r++) {
+			for (auto& app : all) {
+				app->heartbeat();
+				app->record(Reading(string(32, 'a' + r % 26)));
+				app->broadcast();
+			}
+			for (auto& app : all) {
+				if (r % 5 == 0) {
+					app->connect();
+				}
+				stored += app->readMessages();
+			}
+			store.advance(100);
+		}
+		double secs = secondsSince(start);
+
+		StoreStats stats = store.stats();
+		Row("replay").add("store", "DataStore").add("apps", apps).add("rounds", rounds)
+			.add("seconds", secs).add("rounds_per_sec", rounds / secs)
+			.add("writes", stats.writes).add("bytes_written", stats.bytesWritten)
+			.add("writes_per_sec", stats.writes / secs).add("messages_stored", stored)
+			.add("read_amplification", stats.readAmplification())
+			.add("p99_write_ns", stats.writeLatency.percentileNs(0.99))
+			.add("p99_read_ns", stats.readLatency.percentileNs(0.99));
+	}
+}
+
+/*
+	durable - a DataStore with setDurable, written to as fast as it'll
+	go for a few commit delays, then once more waiting for every write
+	to be on disk, which is one sync per write. The log goes in /tmp, so
+	what it measures is whatever disk that is.
+*/
+
+static void durable(chrono::microseconds delay, bool waitEach)
+{
+	string dir = "/tmp/bench-wal-" + to_string(getpid());
+	filesystem::remove_all(dir);
+	size_t n = waitEach ? (quick ? 200 : 2000) : (quick ? 20000 : 500000);
+	string msg(64, 'x');
+	{
+		DataStore store(60);
+		store.setDurable(dir, delay);
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < n; i++) {
+			store.write(msg);
+			if (waitEach) {
+				store.sync();
+			}
+		}
+		store.sync();
+		double secs = secondsSince(start);
+
+		WalStats stats = store.durabilityStats();
+		Row("durable").add("store", "DataStore").add("payload", msg.size())
+			.add("max_commit_delay_us", delay.count()).add("wait_each", waitEach ? 1 : 0)
+			.add("writes", n).add("writes_per_sec", n / secs)
+			.add("mb_per_sec", n * msg.size() / secs / 1e6)
+			.add("commits", stats.commits).add("writes_per_commit", stats.writesPerCommit())
+			.add("commit_p50_ns", stats.commitLatency.percentileNs(0.5))
+			.add("commit_p99_ns", stats.commitLatency.percentileNs(0.99))
+			.add("commit_max_ns", stats.commitLatency.maxNs())
+			.add("sync_p50_ns", stats.syncLatency.percentileNs(0.5));
+	}
+	filesystem::remove_all(dir);
+}
+
+static void benchDurable()
+{
+	for (long us : {500, 2000, 10000}) {
+		cerr << "durable " << us << "us" << endl;
+		durable(chrono::microseconds(us), false);
+	}
+	cerr << "durable waiting on each" << endl;
+	durable(chrono::microseconds(2000), true);
+}
+
+/*
+	replicate - every node connected to every other, each with a thread
+	writing. Timed until every node has every write; the lag is from a
+	write on one node to it going in on another, over links with 200us
+	of latency and 1GB/s each. Once with the writers going as fast as
+	they can, which is mostly backlog, and once at a steady rate.
+*/
+
+static void replicate(int nodes, size_t perNode, double perSec)
+{
+	string msg(64, 'x');
+	SimulatedNetwork net(chrono::microseconds(200), 1e9);
+	vector<unique_ptr<ReplicatedDataStore>> all;
+	for (int n = 0; n < nodes; n++) {
+		all.push_back(unique_ptr<ReplicatedDataStore>(new ReplicatedDataStore(n, net, 600)));
+		for (int peer = 0; peer < nodes; peer++) {
+			all.back()->connect(peer);
+		}
+	}
+
+	Clock::time_point start = Clock::now();
+	vector<thread> writers;
+	for (auto& node : all) {
+		writers.push_back(thread([&node, &msg, perNode, perSec, start]() {
+			for (size_t i = 0; i < perNode; i++) {
+				if (perSec > 0) {
+					this_thread::sleep_until(start + chrono::duration_cast<Clock::duration>(
+							chrono::duration<double>(i / perSec)));
+				}
+				node->write(msg);
+			}
+		}));
+	}
+	for (thread& t : writers) {
+		t.join();
+	}
+	double writeSecs = secondsSince(start);
+
+	unsigned long long want = perNode * (nodes - 1);
+	for (auto& node : all) {
+		while (node->stats().applied < want) {
+			this_thread::sleep_for(chrono::microseconds(100));
+		}
+	}
+	double secs = secondsSince(start);
+
+	LatencyHistogram lag;
+	unsigned long long frames = 0;
+	for (auto& node : all) {
+		ReplicationStats stats = node->stats();
+		lag.add(stats.lag);
+		frames += stats.framesShipped;
+	}
+
+	Row("replicate").add("store", "ReplicatedDataStore").add("nodes", nodes)
+		.add("writes", perNode * nodes).add("payload", msg.size())
+		.add("target_per_node_per_sec", perSec)
+		.add("writes_per_sec", perNode * nodes / writeSecs)
+		.add("applied_per_sec", want * nodes / secs)
+		.add("records_per_frame", double(want * nodes) / frames)
+		.add("lag_p50_ns", lag.percentileNs(0.5)).add("lag_p99_ns", lag.percentileNs(0.99))
+		.add("lag_max_ns", lag.maxNs());
+}
+
+static void benchReplicate()
+{
+	vector<int> counts = {2, 4, 8};
+	if (!quick) {
+		counts.push_back(16);
+	}
+	for (int nodes : counts) {
+		cerr << "replicate " << nodes << " nodes" << endl;
+		replicate(nodes, (quick ? 20000 : 200000) / nodes, 0);
+		replicate(nodes, quick ? 1000 : 10000, 10000);
+	}
+}
+
+/*
+	buffered - the same as the concurrent write benchmark, through a
+	BufferedDataStore at a few merge delays. Latency is from a write to
+	it being in the store; writing straight to the store it's zero.
+*/
+
+static void buffered(int threads, chrono::microseconds delay)
+{
+	size_t n = (quick ? 100000 : 1000000) / threads;
+	string msg(64, 'x');
+	ConcurrentDataStore store(60);
+	BufferedDataStore bds(store, delay);
+
+	Clock::time_point start = Clock::now();
+	vector<thread> writers;
+	for (int t = 0; t < threads; t++) {
+		writers.push_back(thread([&bds, &msg, n]() {
+			for (size_t i = 0; i < n; i++) {
+				bds.write(msg);
+			}
+		}));
+	}
+	for (thread& t : writers) {
+		t.join();
+	}
+	double writeSecs = secondsSince(start);
+	bds.flush();
+	double secs = secondsSince(start);
+
+	BufferedDataStore::Stats stats = bds.stats();
+	Row("buffered").add("store", "BufferedDataStore").add("threads", threads)
+		.add("payload", msg.size()).add("max_delay_us", delay.count())
+		.add("writes_per_sec", n * threads / writeSecs)
+		.add("published_per_sec", n * threads / secs)
+		.add("rounds", stats.rounds).add("batch", stats.batchSize())
+		.add("publish_p50_ns", stats.publishLatency.percentileNs(0.5))
+		.add("publish_p99_ns", stats.publishLatency.percentileNs(0.99))
+		.add("publish_max_ns", stats.publishLatency.maxNs());
+}
+
+static void benchBuffered()
+{
+	for (int threads : {1, 4, 8}) {
+		cerr << "buffered " << threads << " threads" << endl;
+		concurrentWriteThroughput(threads, 64);
+		for (long us : {50, 500, 5000}) {
+			buffered(threads, chrono::microseconds(us));
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	vector<string> which;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--quick") == 0) {
+			quick = true;
+		}
+		else {
+			which.push_back(argv[i]);
+		}
+	}
+	auto wanted = [&which](const string& name) {
+		return which.empty() || find(which.begin(), which.end(), name) != which.end();
+	};
+
+	if (wanted("write")) {
+		benchWrite();
+	}
+	if (wanted("read")) {
+		benchRead();
+	}
+	if (wanted("expiry")) {
+		benchExpiry();
+	}
+	if (wanted("replay")) {
+		benchReplay();
+	}
+	if (wanted("durable")) {
+		benchDurable();
+	}
+	if (wanted("replicate")) {
+		benchReplicate();
+	}
+	if (wanted("buffered")) {
+		benchBuffered();
+	}
+}
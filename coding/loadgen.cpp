@@ -0,0 +1,207 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include "DataStoreServer.h"
+#include "RemoteDataStore.h"
+#include "Reaper.h"
+using namespace std;
+
+/*
+	Load generator for DataStoreServer. Some number of connections each
+	keep a fixed number of requests in flight for a while - mostly
+	writes, with some reads mixed in - and it reports how many requests
+	a second got answered and how long they took.
+
+		./loadgen [-s socket] [-c connections] [-d depth] [-t seconds]
+		          [-b message bytes] [-r percent reads]
+
+	Without -s it starts a server of its own on a thread, so it's
+	measuring the server and the clients on the same machine either way.
+
+	It speaks the protocol with Wire directly rather than through
+	RemoteDataStore, so it knows exactly when each reply came back.
+*/
+
+struct Options {
+	string socket;
+	int connections = 4;
+	int depth = 16;
+	double seconds = 2;
+	size_t bytes = 64;
+	int readPercent = 10;
+};
+
+  // what one connection saw: how long each request took, in microseconds
+struct Result {
+	vector<float> latencies;
+};
+
+static void request(string& out, const Options& o, unsigned long long n, const RemoteDataStore::Cursor& c,
+					const string& payload)
+{
+	if ((int)(n % 100) < o.readPercent) {
+		Wire::Writer w(out, Wire::RECORDS_SINCE);
+		w.put32(ALL_CHANNELS);
+		w.put64(c.next);
+		w.put64(c.missed);
+		w.put64(c.pos);
+		w.end();
+	}
+	else {
+		Wire::Writer w(out, Wire::WRITE);
+		w.put32(2);
+		w.put32(1);
+		w.putBytes(payload.data(), payload.size());
+		w.end();
+	}
+}
+
+static void client(const Options& o, int id, Result& result)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, o.socket.c_str(), sizeof(addr.sun_path) - 1);
+	if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+		cerr << "can't connect to " << o.socket << endl;
+		exit(1);
+	}
+
+	string payload(o.bytes, 'a' + id % 26);
+	RemoteDataStore::Cursor cursor;
+	deque<chrono::steady_clock::time_point> sent;
+	unsigned long long n = id * 37;
+	string out, in;
+	size_t used = 0;
+
+	auto start = chrono::steady_clock::now();
+	auto stop = start + chrono::duration<double>(o.seconds);
+	bool sending = true;
+
+	for (int i = 0; i < o.depth; i++) {
+		request(out, o, n++, cursor, payload);
+		sent.push_back(start);
+	}
+
+	char buf[64 * 1024];
+	while (!sent.empty()) {
+		if (!out.empty()) {
+			if (::send(fd, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size()) {
+				cerr << "lost the server" << endl;
+				exit(1);
+			}
+			out.clear();
+		}
+
+		ssize_t got = ::read(fd, buf, sizeof(buf));
+		if (got <= 0) {
+			cerr << "lost the server" << endl;
+			exit(1);
+		}
+		in.erase(0, used);
+		used = 0;
+		in.append(buf, got);
+
+		auto now = chrono::steady_clock::now();
+		sending = sending && now < stop;
+
+		uint32_t op;
+		size_t size;
+		bool bad;
+		while (Wire::frameAt(in.data() + used, in.size() - used, op, size, bad)) {
+			if (op == Wire::RECORDS_REPLY) {
+				Wire::Reader r(in.data() + used + Wire::HEADER_SIZE, size);
+				cursor.next = r.get64();
+				cursor.missed = r.get64();
+				cursor.pos = r.get64();
+			}
+			used += Wire::HEADER_SIZE + size;
+
+			result.latencies.push_back(
+				chrono::duration<float,micro>(now - sent.front()).count());
+			sent.pop_front();
+
+			  // keep the pipe full until time's up
+			if (sending) {
+				request(out, o, n++, cursor, payload);
+				sent.push_back(now);
+			}
+		}
+	}
+	close(fd);
+}
+
+int main(int argc, char** argv)
+{
+	Options o;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:c:d:t:b:r:")) != -1) {
+		switch (opt) {
+			case 's': o.socket = optarg; break;
+			case 'c': o.connections = atoi(optarg); break;
+			case 'd': o.depth = atoi(optarg); break;
+			case 't': o.seconds = atof(optarg); break;
+			case 'b': o.bytes = atoi(optarg); break;
+			case 'r': o.readPercent = atoi(optarg); break;
+			default:
+				cerr << "usage: " << argv[0]
+					 << " [-s socket] [-c connections] [-d depth] [-t seconds]"
+					 << " [-b bytes] [-r percent reads]" << endl;
+				return 1;
+		}
+	}
+
+	  // no server given, run one here. Short persistence so reads don't
+	  // drag the whole run's worth of writes back every time.
+	ConcurrentDataStore ds(1);
+	Reaper<ConcurrentDataStore> reaper(ds, chrono::milliseconds(50));
+	unique_ptr<DataStoreServer> server;
+	thread serving;
+	if (o.socket.empty()) {
+		o.socket = "/tmp/loadgen-" + to_string(getpid()) + ".sock";
+		server.reset(new DataStoreServer(ds, o.socket));
+		serving = thread([&server]() { server->run(); });
+	}
+
+	vector<Result> results(o.connections);
+	vector<thread> clients;
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < o.connections; i++) {
+		clients.push_back(thread(client, cref(o), i, ref(results[i])));
+	}
+	for (thread& t : clients) {
+		t.join();
+	}
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	if (server) {
+		server->stop();
+		serving.join();
+	}
+
+	vector<float> all;
+	for (const Result& r : results) {
+		all.insert(all.end(), r.latencies.begin(), r.latencies.end());
+	}
+	if (all.empty()) {
+		cerr << "nothing got answered" << endl;
+		return 1;
+	}
+	sort(all.begin(), all.end());
+	auto pct = [&all](double p) { return all[min(all.size() - 1, size_t(p * all.size()))]; };
+
+	cout << fixed << setprecision(1);
+	cout << o.connections << " connections x " << o.depth << " deep, " << o.bytes
+		 << " byte messages, " << o.readPercent << "% reads" << endl;
+	cout << "ops/sec: " << all.size() / secs << endl;
+	cout << "latency (us): p50 " << pct(0.50) << "  p99 " << pct(0.99)
+		 << "  p99.9 " << pct(0.999) << "  max " << all.back() << endl;
+}
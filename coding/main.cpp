@@ -3,12 +3,49 @@
 #include <cassert>     // assert()
 #include <type_traits> // is_trivially_destructible
 #include <fstream>     // ifstream
+#include <thread>      // thread
+#include <filesystem>  // remove_all
+#include <sstream>     // ostringstream
+#include <sys/wait.h>  // waitpid()
+#include <csignal>     // kill()
+#include <sys/resource.h> // setrlimit()
 
 #include "DataStore.h"
+#include "ConcurrentDataStore.h"
+#include "Reaper.h"
+#include "MappedDataStore.h"
+#include "BoundedDataStore.h"
+#include "SharedDataStore.h"
+#include "DataStoreServer.h"
+#include "RemoteDataStore.h"
+#include "ReplicatedDataStore.h"
+#include "BufferedDataStore.h"
 #include "Airport.h"
 
 void testSimpleApplication();
 void testDataStore();
+void testConcurrentDataStore();
+void testBackgroundExpiry();
+void testPerWriteTtl();
+void testMappedDataStore();
+void testBoundedDataStore();
+void testChannels();
+void testBatchedWrite();
+void testWaitSince();
+void testRecords();
+void testCompression();
+void testSnapshot();
+void testSharedDataStore();
+void testRemoteDataStore();
+void testStats();
+void testDedup();
+void testReplication();
+void testDurable();
+void testBufferedDataStore();
+void testReadRange();
+#if __cplusplus >= 202002L
+void testAsync();
+#endif
 
 int main()
 {
@@ -23,6 +60,48 @@ int main()
 
 	testRealApplication();
 
+	testConcurrentDataStore();
+
+	testBackgroundExpiry();
+
+	testPerWriteTtl();
+
+	testMappedDataStore();
+
+	testBoundedDataStore();
+
+	testChannels();
+
+	testBatchedWrite();
+
+	testWaitSince();
+
+	testRecords();
+
+	testCompression();
+
+	testSnapshot();
+
+	testSharedDataStore();
+
+	testRemoteDataStore();
+
+	testStats();
+
+	testDedup();
+
+	testReplication();
+
+	testDurable();
+
+	testBufferedDataStore();
+
+	testReadRange();
+
+#if __cplusplus >= 202002L
+	testAsync();
+#endif
+
 	cout << "Passed all tests!" << endl;
 }
 
@@ -75,6 +154,8 @@ void testSimpleApplication()
 	string readData;
 	memory.read(readData);
 	assert(htbts == readData);
+	  // and the zero-copy view sees exactly the same thing
+	assert(memory.view().str() == readData);
 
 	  // when they check to see who else is connected,
 	  // they each discover the other two
@@ -107,6 +188,17 @@ void testSimpleApplication()
 	assert(app1.readMessages() == app2Data.size() + app3Data.size());
 	assert(app2.readMessages() == app1Data.size() + app3Data.size());
 	assert(app3.readMessages() == app1Data.size() + app2Data.size());
+
+	  // nothing new has been written, so there's nothing new to read
+	assert(app1.readMessages() == 0);
+	assert(app2.readMessages() == 0);
+
+	  // only app3's next broadcast (which now includes what it read
+	  // from the other two) is new to app1
+	int numBroadcast = app3.broadcast();
+	assert(numBroadcast == int(app1Data.size() + app2Data.size() + app3Data.size()));
+	assert(app1.readMessages() == numBroadcast);
+	assert(app1.readMessages() == 0);
 }
 
 
@@ -117,14 +209,18 @@ void testSimpleApplication()
 */
 void testDataStore()
 {
-	cout << "please hold for 15 seconds" << endl;
-
-	DataStore m(5); // writes last 5 seconds
+	  // on a virtual clock, so time only passes when we say so and
+	  // nobody has to sit through the 15 seconds
+	BasicDataStore<VirtualClock> m(5); // writes last 5 seconds
 
 	string s;
 	m.read(s);
 	assert(s.size() == 0 && s == "");
 
+	  // a reader that only checks in every now and then
+	BasicDataStore<VirtualClock>::Cursor cursor;
+	assert(m.readSince(cursor).empty() && cursor.next == 0);
+
 	// write a bunch of strings and make sure
 	// they're written
 	string entire {};
@@ -135,23 +231,27 @@ void testDataStore()
 		entire += s1;
 		m.read(s1);
 		assert(s1 == entire);
-		sleep(1);
+		m.advance(1000);
 	}
 	
 	// 5 seconds have passed, so iter0 is gone
 	m.read(s);
 	assert(s == entire.substr(5));
-	sleep(1);
+
+	// and the cursor never saw it
+	assert(m.readSince(cursor).str() == entire.substr(5));
+	assert(cursor.next == 5 && cursor.missed == 1);
+	m.advance(1000);
 
 	// 6 seconds, iter1
 	m.read(s);
 	assert(s == entire.substr(10));
-	sleep(1);
+	m.advance(1000);
 
 	// 7 seconds, iter2
 	m.read(s);
 	assert(s == entire.substr(15));
-	sleep(1);
+	m.advance(1000);
 
 	// write another
 	s = "final";
@@ -161,15 +261,1672 @@ void testDataStore()
 	// 8 seconds, iter3
 	m.read(s);
 	assert(s == entire.substr(20));
-	sleep(1);
+	assert(m.readSince(cursor).str() == "final");
+	assert(cursor.next == 6 && cursor.missed == 1);
+	m.advance(1000);
 
 	// 9 seconds, iter4
 	m.read(s);
 	assert(s == entire.substr(25));
-	sleep(1);
+	m.advance(1000);
 
 	// final thing lasts 3 more seconds
-	sleep(3);
+	m.advance(3000);
 	m.read(s);
 	assert(s == "");
-}
\ No newline at end of file
+
+	  // the real clocks keep time the same way, just not as exactly
+	BasicDataStore<CoarseClock> coarse(5);
+	coarse.write("iter0");
+	coarse.read(s);
+	assert(s == "iter0");
+	SteadyClock steady;
+	assert(coarse.elapsed() >= 0 && steady.elapsed() >= 0);
+}
+
+
+/*
+	This function hammers a ConcurrentDataStore from several threads at
+	once. Every writer's entries have to come out whole and in the order
+	that writer wrote them, however the reads and writes interleave, and
+	Applications on separate threads have to be able to share it.
+*/
+void testConcurrentDataStore()
+{
+	const int NUM_WRITERS = 4, NUM_WRITES = 20000;
+	ConcurrentDataStore cds(60);
+
+	  // entries look like "<writer>:<index>;" - the reader checks that
+	  // it gets each writer's indices in order, with none missing
+	vector<int> expected(NUM_WRITERS, 0);
+	auto check = [&expected](const DataView& v) {
+		string all = v.str();
+		size_t start = 0, end;
+		while ((end = all.find(';', start)) != string::npos) {
+			size_t colon = all.find(':', start);
+			int w = stoi(all.substr(start, colon - start));
+			int i = stoi(all.substr(colon + 1, end - colon - 1));
+			assert(i == expected[w]);
+			expected[w]++;
+			start = end + 1;
+		}
+		assert(start == all.size());
+	};
+
+	atomic<bool> writing(true);
+	thread reader([&]() {
+		ConcurrentDataStore::Cursor cursor;
+		while (writing.load()) {
+			check(cds.readSince(cursor));
+			  // views taken while writers are going are whole entries too
+			DataView v = cds.view();
+			assert(v.size() == 0 || v[v.size()-1] == ';');
+		}
+		check(cds.readSince(cursor));
+		assert(cursor.next == NUM_WRITERS * NUM_WRITES && cursor.missed == 0);
+	});
+
+	vector<thread> writers;
+	for (int w = 0; w < NUM_WRITERS; w++) {
+		writers.push_back(thread([&cds, w]() {
+			for (int i = 0; i < NUM_WRITES; i++) {
+				cds.write(to_string(w) + ":" + to_string(i) + ";");
+			}
+		}));
+	}
+	for (size_t w = 0; w < writers.size(); w++) {
+		writers[w].join();
+	}
+	writing.store(false);
+	reader.join();
+	for (int w = 0; w < NUM_WRITERS; w++) {
+		assert(expected[w] == NUM_WRITES);
+	}
+
+	  // expired segments get dropped and a cursor that slept through
+	  // them finds out how much it missed
+	ConcurrentDataStore shortLived(1);
+	string big(1000, 'x');
+	for (int i = 0; i < 200; i++) {
+		shortLived.write(big);
+	}
+	sleep(1);
+	shortLived.write("fresh");
+	string s;
+	shortLived.read(s);
+	assert(s == "fresh");
+	ConcurrentDataStore::Cursor late;
+	assert(shortLived.readSince(late).str() == "fresh");
+	assert(late.missed == 200 && late.next == 201);
+
+	  // Applications on their own threads sharing one store
+	struct Character {
+		char c;
+		Character(string s) : c(s[0]) {}
+		string to_writeable() { return string {c}; }
+	};
+	using ConcurrentApp = Application<SimpleProtocol,SimpleEncoding,Character,
+									  SimpleStorage,ConcurrentDataStore>;
+	ConcurrentApp app1("LAX", cds), app2("CVG", cds), app3("ABQ", cds);
+	thread t1([&]() { app1.heartbeat(); });
+	thread t2([&]() { app2.heartbeat(); });
+	thread t3([&]() { app3.heartbeat(); });
+	t1.join(); t2.join(); t3.join();
+	assert(app1.connect() == 2);
+	assert(app2.connect() == 2);
+	assert(app3.connect() == 2);
+}
+
+
+/*
+	With expiry taken off the read path, reads still never include
+	expired data - they skip over it - and it only gets cleaned up when
+	expire() is called, whether that's by us or by a Reaper thread.
+*/
+void testBackgroundExpiry()
+{
+	DataStore ds(1);
+	ds.setExpireOnRead(false);
+	DataStore::Cursor cursor;
+	ds.write("old");
+	sleep(1);
+	ds.write("new");
+
+	string s;
+	ds.read(s);
+	assert(s == "new");
+	assert(ds.view().str() == "new");
+	assert(ds.readSince(cursor).str() == "new");
+	assert(cursor.next == 2 && cursor.missed == 1);
+	ds.expire();
+	ds.read(s);
+	assert(s == "new");
+
+	ConcurrentDataStore cds(1);
+	Reaper<ConcurrentDataStore> reaper(cds, chrono::milliseconds(10));
+	for (int i = 0; i < 200; i++) {
+		cds.write(string(1000, 'x'));
+	}
+	sleep(1);
+	cds.write("new");
+	cds.read(s);
+	assert(s == "new");
+	ConcurrentDataStore::Cursor c;
+	assert(cds.readSince(c).str() == "new");
+	assert(c.next == 201 && c.missed == 200);
+}
+
+
+/*
+	Writes that give their own ttl expire on their own schedule, even
+	when they're stuck between writes that are going to be around a lot
+	longer, and the default persistence still applies to everything else.
+*/
+void testPerWriteTtl()
+{
+	BasicDataStore<VirtualClock> m(2);
+	BasicDataStore<VirtualClock>::Cursor cursor;
+
+	m.write("HTBTLAX", 1);
+	m.write("DATALAX");
+	m.write("HTBTCVG", 1);
+	m.write("long", 3);
+
+	string s;
+	m.read(s);
+	assert(s == "HTBTLAXDATALAXHTBTCVGlong");
+
+	  // the heartbeats are gone after a second, the rest hang around
+	m.advance(1000);
+	m.read(s);
+	assert(s == "DATALAXlong");
+	assert(m.readSince(cursor).str() == "DATALAXlong");
+	assert(cursor.next == 4 && cursor.missed == 2);
+
+	  // the default is two seconds, so only the long one is left
+	m.advance(1000);
+	m.write("HTBTABQ", 1);
+	m.read(s);
+	assert(s == "longHTBTABQ");
+
+	  // skipped over without cleaning up works the same way
+	m.setExpireOnRead(false);
+	m.advance(1000);
+	m.read(s);
+	assert(s == "");
+	assert(m.readSince(cursor).str() == "");
+	assert(cursor.next == 5 && cursor.missed == 3);
+}
+
+
+/*
+	A MappedDataStore has to give back everything that was written to it
+	after being closed and opened again, keep counting sequence numbers
+	from where it left off, and still expire data by when it was
+	originally written.
+*/
+void testMappedDataStore()
+{
+	const string dir = "mapped-test";
+	filesystem::remove_all(dir);
+
+	  // small segments, so the writes spill over into several files
+	string entire;
+	{
+		MappedDataStore m(dir, 60, 4096);
+		for (int i = 0; i < 300; i++) {
+			string s = "entry" + to_string(i) + ";";
+			assert(m.write(s) == (unsigned long long)i);
+			entire += s;
+		}
+		string s;
+		m.read(s);
+		assert(s == entire);
+		assert(m.view().str() == entire);
+	}
+
+	{
+		MappedDataStore m(dir, 60, 4096);
+		string s;
+		m.read(s);
+		assert(s == entire);
+		assert(m.nextSequence() == 300);
+
+		MappedDataStore::Cursor cursor;
+		cursor.next = 300;
+		m.write("HTBTLAX");
+		assert(m.readSince(cursor).str() == "HTBTLAX");
+		assert(cursor.next == 301 && cursor.missed == 0);
+	}
+
+	  // reopened with a one second persistence, everything expires and
+	  // only the file being written to is left
+	{
+		MappedDataStore m(dir, 1, 4096);
+		sleep(1);
+		string s;
+		m.read(s);
+		assert(s == "");
+		assert(distance(filesystem::directory_iterator(dir), filesystem::directory_iterator()) == 1);
+	}
+	filesystem::remove_all(dir);
+
+	  // channels are kept in the files too, so a reopened store can
+	  // still hand each reader only what it asked for
+	{
+		MappedDataStore m(dir, 60, 4096);
+		m.write(Channel(1), "HTBTLAX");
+		m.write(Channel(2), vector<string>{"DATA1", "DATA2"});
+	}
+	{
+		MappedDataStore m(dir, 60, 4096);
+		assert(m.view(Channel(1).mask()).str() == "HTBTLAX");
+		RecordView r = m.records(Channel(2).mask());
+		assert(r.size() == 2 && r[0].data == "DATA1" && r[1].data == "DATA2");
+
+		MappedDataStore::Cursor cursor;
+		m.write(Channel(1), "HTBTCVG");
+		r = m.recordsSince(cursor, Channel(1).mask());
+		assert(r.size() == 2 && r[1].data == "HTBTCVG");
+		assert(cursor.next == 4 && cursor.missed == 0);
+	}
+	filesystem::remove_all(dir);
+
+	  // and it can back Applications like any other store
+	{
+		MappedDataStore m(dir, 60, 4096);
+		struct Character {
+			char c;
+			Character(string s) : c(s[0]) {}
+			string to_writeable() { return string {c}; }
+		};
+		using MappedApp = Application<SimpleProtocol,SimpleEncoding,Character,
+									  SimpleStorage,MappedDataStore>;
+		MappedApp ord("ORD", m);
+		MappedApp msn("MSN", m);
+		ord.heartbeat();
+		msn.heartbeat();
+		assert(ord.connect() == 1 && msn.connect() == 1);
+		ord.record(Character("x"));
+		ord.record(Character("y"));
+		assert(ord.broadcast() == 2);
+		assert(msn.readMessages() == 2);
+	}
+
+	filesystem::remove_all(dir);
+}
+
+
+/*
+	A BoundedDataStore never holds more than its budget. Each eviction
+	policy gets the same writes so you can see what each one throws out,
+	and evicted writes show up in a reader's missed count.
+*/
+void testBoundedDataStore()
+{
+	  // 21 bytes, so the fourth write doesn't fit
+	BoundedDataStore<OldestFirst> oldest(60, 21);
+	BoundedDataStore<SizeAware> largest(60, 21);
+	BoundedDataStore<HeartbeatsFirst> beats(60, 21);
+	BoundedDataStore<OldestFirst>::Cursor cursor;
+
+	for (string s : {"DATALAX", "HTBTCVG", "DATAMSNORD", "HTBT"}) {
+		oldest.write(s);
+		largest.write(s);
+		beats.write(s);
+	}
+
+	string s;
+	oldest.read(s);
+	assert(s == "HTBTCVGDATAMSNORDHTBT");
+	assert(oldest.bytes() == 21 && oldest.evictedBytes() == 7);
+
+	largest.read(s);
+	assert(s == "DATALAXHTBTCVGHTBT");
+	assert(largest.evictedEntries() == 1 && largest.evictedBytes() == 10);
+
+	beats.read(s);
+	assert(s == "DATALAXDATAMSNORDHTBT");
+	assert(beats.evictedEntries() == 1 && beats.entries() == 3);
+
+	  // a reader that wasn't keeping up hears about what it lost
+	assert(oldest.readSince(cursor).str() == "HTBTCVGDATAMSNORDHTBT");
+	assert(cursor.next == 4 && cursor.missed == 1);
+
+	  // an entry budget works the same way, and memory stays flat
+	  // however much gets written
+	BoundedDataStore<OldestFirst> few(60, BoundedDataStore<OldestFirst>::UNLIMITED, 100);
+	for (int i = 0; i < 100000; i++) {
+		few.write("DATA" + to_string(i));
+	}
+	assert(few.entries() == 100 && few.evictedEntries() == 100000 - 100);
+	assert(few.footprint() <= 2 * ChunkLog::CHUNK_SIZE);
+	few.read(s);
+	assert(s.compare(0, 9, "DATA99900") == 0);
+
+	  // what comes back from the log after a restart is held to the
+	  // budget too, and the policy knows about it
+	string dir = "/tmp/masters-bounded-" + to_string(getpid());
+	filesystem::remove_all(dir);
+	{
+		BoundedDataStore<OldestFirst> durable(60, 100);
+		durable.setDurable(dir);
+		for (int i = 0; i < 50; i++) {
+			durable.write("DATA" + to_string(100000 + i));
+		}
+		assert(durable.bytes() == 100);
+		durable.sync();
+	}
+	{
+		BoundedDataStore<OldestFirst> durable(60, 100);
+		durable.setDurable(dir);
+		assert(durable.bytes() == 100 && durable.view().str().compare(0, 10, "DATA100040") == 0);
+		durable.write("DATA100050");
+		durable.read(s);
+		assert(durable.bytes() == 100 && s.compare(0, 10, "DATA100041") == 0);
+		assert(s.compare(90, 10, "DATA100050") == 0);
+	}
+	filesystem::remove_all(dir);
+}
+
+
+/*
+	Reading some channels gives back only what was written to them, still
+	in the order it was written, and cursors only count what they lost on
+	the channels they read.
+*/
+void testChannels()
+{
+	Channel beats(1), data(2), keys(3);
+	DataStore m(60);
+	DataStore::Cursor cursor;
+
+	m.write(beats, "HTBTLAX");
+	m.write(data, "DATALAXabc");
+	m.write("untagged");
+	m.write(beats, "HTBTCVG");
+	m.write(keys, "DKEY", 0);
+	m.write(data, "DATACVGxy");
+
+	assert(m.view(beats.mask()).str() == "HTBTLAXHTBTCVG");
+	assert(m.view(data.mask()).str() == "DATALAXabcDATACVGxy");
+	assert(m.view(beats.mask() | data.mask()).str() == "HTBTLAXDATALAXabcHTBTCVGDATACVGxy");
+	assert(m.view(Channel(0).mask()).str() == "untagged");
+	assert(m.view().size() == 7 + 10 + 8 + 7 + 9);
+
+	  // the key expired straight away, and only counts if we're
+	  // reading its channel
+	assert(m.readSince(cursor, data.mask()).str() == "DATALAXabcDATACVGxy");
+	assert(cursor.next == 6 && cursor.missed == 0);
+	cursor.next = 0;
+	assert(m.readSince(cursor, keys.mask()).str() == "");
+	assert(cursor.next == 6 && cursor.missed == 1);
+
+	m.write(data, "DATAABQ");
+	m.write(beats, "HTBTABQ");
+	assert(m.readSince(cursor, data.mask()).str() == "DATAABQ");
+	assert(cursor.next == 8);
+
+	  // same thing from the concurrent store
+	ConcurrentDataStore cds(60);
+	ConcurrentDataStore::Cursor ccursor;
+	cds.write(beats, "HTBTLAX");
+	cds.write(data, "DATALAXabc");
+	cds.write(beats, "HTBTCVG");
+	assert(cds.view(beats.mask()).str() == "HTBTLAXHTBTCVG");
+	assert(cds.readSince(ccursor, data.mask()).str() == "DATALAXabc");
+	assert(ccursor.next == 3 && ccursor.missed == 0);
+	assert(cds.view().str() == "HTBTLAXDATALAXabcHTBTCVG");
+
+	  // there's no channel past the last one
+	bool threw = false;
+	try {
+		cds.write(Channel(Channel::MAX), "nowhere");
+	}
+	catch (const out_of_range&) {
+		threw = true;
+	}
+	assert(threw && cds.view().str() == "HTBTLAXDATALAXabcHTBTCVG");
+}
+
+
+/*
+	A batch of writes reads back exactly the same as writing them one at
+	a time, and in the concurrent store nobody else's writes can land in
+	the middle of a batch.
+*/
+void testBatchedWrite()
+{
+	DataStore m(60);
+	DataStore::Cursor cursor;
+	vector<string> batch = {"DATALAXa", "DATALAXbc", "", "DATALAXd"};
+
+	m.write("HTBTLAX");
+	assert(m.write(Channel(2), batch) == 1);
+	assert(m.nextSequence() == 5);
+	assert(m.write(vector<string>()) == 5 && m.nextSequence() == 5);
+	assert(m.view().str() == "HTBTLAXDATALAXaDATALAXbcDATALAXd");
+	assert(m.view(Channel(2).mask()).str() == "DATALAXaDATALAXbcDATALAXd");
+	assert(m.readSince(cursor).size() == 32 && cursor.next == 5);
+
+	  // short lived batches expire together
+	m.write(Channel(0), batch.data(), 2, 0);
+	assert(m.readSince(cursor).str() == "" && cursor.missed == 2);
+
+	BoundedDataStore<OldestFirst> bounded(60, 20);
+	bounded.write(batch);
+	assert(bounded.view().str() == "DATALAXbcDATALAXd" && bounded.evictedEntries() == 1);
+
+	  // each thread's batches have to come back out in one piece
+	ConcurrentDataStore cds(60);
+	vector<thread> writers;
+	for (char t = 'a'; t < 'e'; t++) {
+		writers.push_back(thread([&cds, t]() {
+			vector<string> mine(3, string(1, t));
+			for (int i = 0; i < 2000; i++) {
+				cds.write(mine);
+			}
+		}));
+	}
+	for (size_t i = 0; i < writers.size(); i++) {
+		writers[i].join();
+	}
+
+	string s = cds.view().str();
+	assert(s.size() == 4 * 2000 * 3);
+	for (size_t i = 0; i < s.size(); i += 3) {
+		assert(s[i] == s[i+1] && s[i] == s[i+2]);
+	}
+}
+
+
+/*
+	waitSince blocks until writers have written enough or the wait runs
+	out, and Applications can use it to hear about new messages without
+	polling.
+*/
+void testWaitSince()
+{
+	using namespace chrono;
+	ConcurrentDataStore cds(60);
+	ConcurrentDataStore::Cursor cursor;
+
+	  // nothing gets written, so it gives up after the wait
+	auto start = steady_clock::now();
+	assert(cds.waitSince(cursor, 1, milliseconds(20)).empty());
+	assert(steady_clock::now() - start >= milliseconds(20));
+
+	  // any write wakes a reader waiting for one byte
+	thread reader([&cds, &cursor]() {
+		assert(cds.waitSince(cursor, 1, seconds(10)).str() == "DATALAXa");
+	});
+	this_thread::sleep_for(milliseconds(20));
+	start = steady_clock::now();
+	cds.write("DATALAXa");
+	reader.join();
+	assert(steady_clock::now() - start < seconds(5));
+
+	  // a reader waiting for ten 24 byte entries worth doesn't wake
+	  // until all ten are there
+	reader = thread([&cds, &cursor]() {
+		assert(cds.waitSince(cursor, 240, seconds(10)).size() == 80);
+	});
+	for (int i = 0; i < 10; i++) {
+		this_thread::sleep_for(milliseconds(2));
+		cds.write("DATACVG" + to_string(i));
+	}
+	reader.join();
+	assert(cursor.next == 11);
+
+	  // an Application waiting on another one's broadcast
+	struct Character {
+		char c;
+		Character(string s) : c(s[0]) {}
+		string to_writeable() { return string {c}; }
+	};
+	using ConcurrentApp = Application<SimpleProtocol,SimpleEncoding,Character,
+									  SimpleStorage,ConcurrentDataStore>;
+	ConcurrentApp app1("LAX", cds), app2("CVG", cds);
+	app1.readMessages();
+	thread listener([&app1]() {
+		assert(app1.waitForMessages(1, seconds(10)) == 2);
+	});
+	app2.record(Character("x"));
+	app2.record(Character("y"));
+	this_thread::sleep_for(milliseconds(20));
+	app2.broadcast();
+	listener.join();
+}
+
+
+/*
+	Records come back one per write, with when they were written, and
+	parsing a record can't be fooled by what's inside a payload the way
+	scanning the whole stream can.
+*/
+void testRecords()
+{
+	BasicDataStore<VirtualClock> m(5);
+	BasicDataStore<VirtualClock>::Cursor cursor;
+
+	m.write(Channel(1), "HTBTLAX");
+	m.advance(1000);
+	m.write(Channel(2), "DATALAX8,xxHTBTyy");
+	m.write(Channel(2), "");
+	m.advance(1000);
+	m.write(Channel(1), "HTBTCVG");
+
+	RecordView all = m.records();
+	assert(all.size() == 4);
+	assert(all[0].data == "HTBTLAX" && all[0].time == 0);
+	assert(all[1].data == "DATALAX8,xxHTBTyy" && all[1].time == 1000);
+	assert(all[2].data.empty() && all[3].time == 2000);
+	assert(m.records(Channel(1).mask()).size() == 2);
+
+	  // the first heartbeat expires, the cursor hears about it
+	m.advance(3000);
+	RecordView since = m.recordsSince(cursor);
+	assert(since.size() == 3 && since[0].data == "DATALAX8,xxHTBTyy");
+	assert(cursor.next == 4 && cursor.missed == 1);
+
+	  // the stream parser finds a heartbeat in the middle of the data,
+	  // the record parser knows better
+	SimpleProtocol<SimpleEncoding> protocol;
+	string addr, data;
+	int idx = 0;
+	assert(protocol.getNextConnection(idx, m.view(Channel(2).mask()), addr) && addr == "yy");
+	assert(!protocol.readConnection(since[0].data, addr));
+	assert(protocol.readData(since[0].data, data, addr) && data == "xxHTBTyy" && addr == "LAX");
+	assert(protocol.readConnection(since[2].data, addr) && addr == "CVG");
+	assert(!protocol.readData(since[2].data, data, addr));
+
+	ConcurrentDataStore cds(60);
+	ConcurrentDataStore::Cursor ccursor;
+	cds.write(Channel(1), "HTBTLAX");
+	cds.write(Channel(2), vector<string>{"DATALAX1,a", "DATALAX1,b"});
+	assert(cds.records().size() == 3);
+	RecordView crecords = cds.recordsSince(ccursor, Channel(2).mask());
+	assert(crecords.size() == 2 && crecords[1].data == "DATALAX1,b");
+	assert(crecords[0].time == crecords[1].time);
+	assert(ccursor.next == 3);
+}
+
+
+/*
+	Old chunks get compressed, reading them gives back exactly what was
+	written, and the copies made to read them go away on the next clean
+	up.
+*/
+void testCompression()
+{
+	BasicDataStore<VirtualClock> m(60);
+	m.setCompressAfter(10);
+
+	string entire;
+	for (int i = 0; i < 2000; i++) {
+		string msg = (i % 2) ? "HTBTLAX" : "DATALAX" + to_string(i % 10) + "," + to_string(i);
+		m.write(msg);
+		entire += msg;
+	}
+	size_t raw = m.memoryUsed();
+
+	  // nothing is old enough yet
+	m.expire();
+	assert(m.compressionStats().chunksPacked == 0);
+
+	m.advance(11000);
+	m.write("DATACVG1,x");
+	entire += "DATACVG1,x";
+	m.expire();
+	const ChunkLog::Stats& stats = m.compressionStats();
+	assert(stats.chunksPacked > 0 && stats.ratio() < 0.5);
+	assert(m.memoryUsed() < raw / 2);
+
+	  // reading unpacks, and the next clean up throws the copies away
+	string s;
+	m.read(s);
+	assert(s == entire);
+	assert(m.view().str() == entire);
+	assert(m.records().size() == 2001);
+	assert(stats.unpacks > 0 && m.memoryUsed() > raw);
+	m.expire();
+	assert(m.memoryUsed() < raw / 2);
+
+	  // packed chunks go away like any other when their data expires
+	m.advance(50000);
+	m.read(s);
+	assert(s == "DATACVG1,x");
+	assert(m.memoryUsed() <= ChunkLog::CHUNK_SIZE);
+}
+
+
+/*
+	A snapshot keeps reading back what was live when it was taken, after
+	everything in it has expired and been cleaned up and while other
+	threads read it too, and the segments it holds go once the last copy
+	does.
+*/
+void testSnapshot()
+{
+	ConcurrentDataStore cds(1);
+	for (int i = 0; i < 200; i++) {
+		cds.write(Channel(2), string(1000, 'a' + i % 26));
+	}
+	cds.write(Channel(1), "HTBTLAX");
+
+	ConcurrentDataStore::Snapshot snap = cds.snapshot();
+	assert(snap.size() == 201);
+	assert(cds.snapshot(Channel(1).mask()).records()[0].data == "HTBTLAX");
+	string before = snap.view().str();
+	assert(before.size() == 200 * 1000 + 7);
+
+	  // everything in it expires and gets cleaned up, but the segments it
+	  // points into stay put while other threads read it
+	sleep(1);
+	cds.write("new");
+	cds.expire();
+	string s;
+	cds.read(s);
+	assert(s == "new");
+	assert(cds.snapshotStats().segmentsHeld > 0);
+
+	vector<thread> readers;
+	for (int t = 0; t < 4; t++) {
+		readers.push_back(thread([snap, &before]() {
+			assert(snap.view().str() == before);
+			size_t n = 0;
+			for (const Record& r : snap.records()) {
+				n += r.data.size();
+			}
+			assert(n == before.size());
+		}));
+	}
+	for (thread& t : readers) {
+		t.join();
+	}
+
+	ConcurrentDataStore::SnapshotStats stats = cds.snapshotStats();
+	assert(stats.taken == 2 && stats.active == 1);
+
+	  // let go of the last copy and the segments can finally be freed
+	snap = ConcurrentDataStore::Snapshot();
+	cds.expire();
+	stats = cds.snapshotStats();
+	assert(stats.active == 0 && stats.segmentsHeld == 0);
+	assert(stats.maxPinnedMs >= 1000 && stats.totalPinnedMs >= stats.maxPinnedMs);
+}
+
+
+/*
+	A SharedDataStore is the same store to every process that opens it:
+	writes from one show up in the others, the ring overwrites its oldest
+	entries, a writer killed halfway through a write doesn't leave it
+	broken, and entries expire.
+*/
+void testSharedDataStore()
+{
+	SharedDataStore::remove("masters-test");
+	SharedDataStore a("masters-test", 60, 4096);
+	SharedDataStore b("masters-test", 0);
+	assert(b.persistence() == 60 && b.capacity() == 4096);
+
+	  // another process writes, both of us see it
+	pid_t pid = fork();
+	if (pid == 0) {
+		SharedDataStore c("masters-test", 0);
+		c.write(Channel(1), "HTBTLAX");
+		c.write(Channel(2), vector<string>{"DATALAX1,a", "DATALAX1,b"});
+		_exit(0);
+	}
+	waitpid(pid, nullptr, 0);
+	assert(a.view().str() == "HTBTLAXDATALAX1,aDATALAX1,b");
+	RecordView beats = b.records(Channel(1).mask());
+	assert(beats.size() == 1 && beats[0].data == "HTBTLAX");
+	SharedDataStore::Cursor cursor;
+	RecordView data = b.recordsSince(cursor, Channel(2).mask());
+	assert(data.size() == 2 && data[1].data == "DATALAX1,b" && data[0].time == data[1].time);
+	assert(cursor.next == 3 && cursor.missed == 0);
+
+	  // go around the ring a few times, the oldest get written over
+	for (int i = 0; i < 200; i++) {
+		a.write(string(100, 'a' + i % 26));
+	}
+	assert(a.overwritten() > 0);
+	DataView since = b.readSince(cursor);
+	assert(cursor.next == 203);
+	assert(since.size() == (203 - 3 - cursor.missed) * 100);
+	assert(since.str().substr(since.size() - 100) == string(100, 'a' + 199 % 26));
+
+	  // Applications in different processes find each other through it
+	struct Character {
+		char c;
+		Character(string s) : c(s[0]) {}
+		string to_writeable() { return string {c}; }
+	};
+	using SharedApp = Application<SimpleProtocol,SimpleEncoding,Character,
+								  SimpleStorage,SharedDataStore>;
+	pid = fork();
+	if (pid == 0) {
+		SharedDataStore c("masters-test", 0);
+		SharedApp cvg("CVG", c);
+		cvg.heartbeat();
+		_exit(0);
+	}
+	waitpid(pid, nullptr, 0);
+	SharedApp lax("LAX", a);
+	lax.heartbeat();
+	assert(lax.connect() == 1);
+
+	  // lots of writers in lots of processes while we read along
+	SharedDataStore::remove("masters-test");
+	SharedDataStore big("masters-test", 60, 16 * 1024);
+	vector<pid_t> writers;
+	for (int w = 0; w < 4; w++) {
+		pid = fork();
+		if (pid == 0) {
+			SharedDataStore c("masters-test", 0);
+			for (int i = 0; i < 2000; i++) {
+				c.write(Channel(w), string(1 + i % 50, 'a' + w));
+			}
+			_exit(0);
+		}
+		writers.push_back(pid);
+	}
+	SharedDataStore::Cursor c;
+	size_t seen = 0;
+	while (c.next < 8000) {
+		for (const Record& r : big.recordsSince(c)) {
+			assert(!r.data.empty() && r.data.find_first_not_of(r.data[0]) == string_view::npos);
+			seen++;
+		}
+	}
+	for (pid_t w : writers) {
+		waitpid(w, nullptr, 0);
+	}
+	assert(seen + c.missed == 8000);
+	SharedDataStore::remove("masters-test");
+
+	  // writers killed while they're writing, with writes so big that
+	  // each one pushes out everything else, half of them past the end
+	  // of what was written. Whatever they were part way through never
+	  // shows up, and the store carries on from where it was.
+	SharedDataStore::remove("masters-crash");
+	SharedDataStore crash("masters-crash", 60, 1 << 20);
+	SharedDataStore::Cursor follow;
+	for (int round = 0; round < 200 && crash.recoveries() < 20; round++) {
+		pid = fork();
+		if (pid == 0) {
+			SharedDataStore c("masters-crash", 0);
+			for (int i = 0; ; i++) {
+				c.write(string(i % 2 ? 600 * 1024 : 450 * 1024, 'a' + i % 26));
+			}
+		}
+		usleep(1000 + round % 5 * 1000);
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+
+		  // a reader getting in before anyone writes again
+		for (const Record& r : crash.recordsSince(follow)) {
+			assert(r.data.size() == 600 * 1024 || r.data.size() == 450 * 1024);
+		}
+		crash.write("after" + to_string(round));
+		RecordView all = crash.records();
+		assert(all.size() >= 1 && all[all.size()-1].data == "after" + to_string(round));
+		for (const Record& r : all) {
+			assert(r.data.substr(0, 5) == "after" || r.data.find_first_not_of(r.data[0]) == string_view::npos);
+		}
+		RecordView since = crash.recordsSince(follow);
+		assert(since.size() >= 1 && since[since.size()-1].data == "after" + to_string(round));
+	}
+	assert(crash.recoveries() > 0);
+	SharedDataStore::remove("masters-crash");
+
+	  // reads skip what's expired, and the next write clears it out
+	SharedDataStore::remove("masters-expiry");
+	SharedDataStore brief("masters-expiry", 1, 4096);
+	brief.write("old");
+	sleep(1);
+	assert(brief.view().empty());
+	brief.write("new");
+	SharedDataStore::Cursor fresh;
+	assert(brief.readSince(fresh).str() == "new" && fresh.next == 2 && fresh.missed == 1);
+	SharedDataStore::remove("masters-expiry");
+
+	  // a creator that died before sizing it, or before setting it up,
+	  // doesn't leave everyone after it waiting forever
+	for (bool sized : {false, true}) {
+		SharedDataStore::remove("masters-abandoned");
+		int fd = shm_open("/masters-abandoned", O_RDWR | O_CREAT | O_EXCL, 0600);
+		assert(fd >= 0 && (!sized || ftruncate(fd, 1 << 20) == 0));
+		close(fd);
+		bool threw = false;
+		try {
+			SharedDataStore never("masters-abandoned", 60);
+		}
+		catch (const runtime_error&) {
+			threw = true;
+		}
+		assert(threw);
+	}
+	SharedDataStore::remove("masters-abandoned");
+}
+
+
+/*
+	A RemoteDataStore reads and writes a DataStoreServer's store as if it
+	were local, subscribers get pushed what's new on their channels, and
+	the server doesn't let one connection's backlog hold up the rest.
+*/
+void testRemoteDataStore()
+{
+	string path = "/tmp/masters-test-" + to_string(getpid()) + ".sock";
+	ConcurrentDataStore cds(60);
+	DataStoreServer server(cds, path);
+	thread serving([&server]() { server.run(); });
+
+	{
+		RemoteDataStore remote(path);
+		RemoteDataStore::Subscription sub = remote.subscribe(Channel(2).mask());
+
+		  // writes are pipelined, the read after them still sees them
+		remote.write(Channel(1), "HTBTLAX");
+		remote.write(Channel(2), vector<string>{"DATALAX1,a", "DATALAX1,b"});
+		remote.write("untagged");
+		RecordView all = remote.records();
+		assert(all.size() == 4 && all[1].data == "DATALAX1,a" && all[1].time == all[2].time);
+		assert(remote.view(Channel(1).mask()).str() == "HTBTLAX");
+		RemoteDataStore::Cursor cursor;
+		assert(remote.readSince(cursor, Channel(2).mask()).str() == "DATALAX1,aDATALAX1,b");
+		assert(cursor.next == 4 && cursor.missed == 0);
+		remote.write(Channel(2), "DATALAX1,c");
+		assert(remote.recordsSince(cursor).size() == 1);
+		string s;
+		cds.read(s);
+		assert(s == "HTBTLAXDATALAX1,aDATALAX1,buntaggedDATALAX1,c");
+
+		  // the subscriber gets pushed just its channel
+		size_t pushed = 0;
+		while (pushed < 3) {
+			RecordView r = sub.next(chrono::seconds(5));
+			assert(!r.empty());
+			for (const Record& rec : r) {
+				assert(rec.data.compare(0, 4, "DATA") == 0);
+				pushed++;
+			}
+		}
+		assert(sub.cursor().next == 5);
+		assert(sub.next(chrono::milliseconds(10)).empty());
+
+		  // Applications on either end of their own connections
+		struct Character {
+			char c;
+			Character(string s) : c(s[0]) {}
+			string to_writeable() { return string {c}; }
+		};
+		using RemoteApp = Application<SimpleProtocol,SimpleEncoding,Character,
+									  SimpleStorage,RemoteDataStore>;
+		RemoteDataStore r1(path), r2(path);
+		RemoteApp cvg("CVG", r1), abq("ABQ", r2);
+		cvg.heartbeat();
+		abq.heartbeat();
+		r1.flush();
+		r2.flush();
+		assert(cvg.connect() == 2 && abq.connect() == 2);
+
+		  // lots of pipelined writes, then one wait for them all
+		for (int i = 0; i < 10000; i++) {
+			r1.write(Channel(3), string(1 + i % 20, 'x'));
+		}
+		r1.flush();
+		assert(cds.records(Channel(3).mask()).size() == 10000);
+
+		  // someone asking for all of it over and over and never reading
+		  // the answers doesn't hold anyone else up, and only gets as
+		  // many answered as fit in its queue
+		int flood = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un addr {};
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path.c_str());
+		assert(connect(flood, (sockaddr*)&addr, sizeof(addr)) == 0);
+		string asks;
+		for (int i = 0; i < 1000; i++) {
+			Wire::Writer w(asks, Wire::RECORDS);
+			w.put32(ALL_CHANNELS);
+			w.end();
+		}
+		unsigned long long before = server.requests();
+		assert(send(flood, asks.data(), asks.size(), MSG_NOSIGNAL) == (ssize_t)asks.size());
+		this_thread::sleep_for(chrono::milliseconds(100));
+		assert(r2.records(Channel(3).mask()).size() == 10000);
+		assert(server.requests() - before < 500);
+		close(flood);
+
+		  // more than fits in one reply comes back in a few
+		for (int i = 0; i < 100; i++) {
+			r1.write(Channel(4), string(100 * 1024, 'a' + i % 26));
+		}
+		RemoteDataStore::Cursor bigCursor;
+		RecordView big = r2.recordsSince(bigCursor, Channel(4).mask());
+		assert(big.size() == 100 && big[99].data == string(100 * 1024, 'a' + 99 % 26));
+		assert(r2.recordsSince(bigCursor, Channel(4).mask()).empty());
+		assert(r2.records(Channel(4).mask()).size() == 100);
+	}
+
+	  // a push that only partly arrives doesn't hold next() past its wait,
+	  // and the rest of it is still there for the next call
+	string fakePath = path + ".fake";
+	int listening = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr {};
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, fakePath.c_str());
+	assert(bind(listening, (sockaddr*)&addr, sizeof(addr)) == 0 && listen(listening, 4) == 0);
+	{
+		RemoteDataStore fake(fakePath);
+		int client = accept(listening, nullptr, nullptr);
+		RemoteDataStore::Subscription sub = fake.subscribe();
+		int subscriber = accept(listening, nullptr, nullptr);
+		string push;
+		Wire::Writer w(push, Wire::RECORDS_REPLY);
+		w.put64(1);
+		w.put64(0);
+		w.put64(32);
+		w.put32(0);
+		w.put32(1);
+		w.putDouble(0.5);
+		w.putBytes("late", 4);
+		w.end();
+		assert(send(subscriber, push.data(), 10, 0) == 10);
+		auto start = chrono::steady_clock::now();
+		assert(sub.next(chrono::milliseconds(50)).empty());
+		assert(chrono::steady_clock::now() - start < chrono::seconds(1));
+		assert(send(subscriber, push.data() + 10, push.size() - 10, 0) == (ssize_t)(push.size() - 10));
+		RecordView late = sub.next(chrono::seconds(5));
+		assert(late.size() == 1 && late[0].data == "late" && sub.cursor().next == 1);
+		close(client);
+		close(subscriber);
+	}
+	close(listening);
+	unlink(fakePath.c_str());
+
+	server.stop();
+	serving.join();
+	assert(server.requests() > 10000);
+
+	  // a server pointed at something that isn't a socket leaves it be
+	string notSocket = "/tmp/masters-test-" + to_string(getpid()) + ".txt";
+	ofstream(notSocket) << "keep me";
+	bool threw = false;
+	try {
+		DataStoreServer never(cds, notSocket);
+	}
+	catch (const runtime_error&) {
+		threw = true;
+	}
+	assert(threw && filesystem::file_size(notSocket) == 7);
+	unlink(notSocket.c_str());
+}
+
+
+/*
+	Stats count what went in, what was handed back to readers and what
+	expired, and time every write, read and clean up.
+*/
+void testStats()
+{
+	if (!StoreStats::enabled) {
+		return;
+	}
+
+	BasicDataStore<VirtualClock> m(5);
+	BasicDataStore<VirtualClock>::Cursor cursor;
+	m.write("abc");
+	m.write(vector<string>{"de", "fgh"});
+	m.advance(1000);
+	m.write("ij", 1);
+
+	  // reading it all twice hands the same 10 bytes back twice, reading
+	  // along with a cursor only ever hands back what's new
+	string s;
+	m.read(s);
+	assert(m.view().size() == 10);
+	assert(m.readSince(cursor).size() == 10);
+	m.write("kl");
+	assert(m.recordsSince(cursor).size() == 1);
+
+	StoreStats stats = m.stats();
+	assert(stats.writes == 5 && stats.bytesWritten == 12);
+	assert(stats.reads == 4 && stats.bytesRead == 32 && stats.newBytesRead == 12);
+	assert(stats.readAmplification() > 2.6 && stats.readAmplification() < 2.7);
+	assert(stats.writeLatency.count() == 4 && stats.readLatency.count() == 4);
+	assert(stats.liveEntries == 5 && stats.liveBytes == 12);
+
+	  // the short one goes first, then the rest
+	m.advance(1000);
+	m.expire();
+	m.advance(4000);
+	m.expire();
+	stats = m.stats();
+	assert(stats.entriesExpired == 5 && stats.bytesExpired == 12);
+	assert(stats.liveEntries == 0 && stats.liveBytes == 0);
+	assert(stats.cleanLatency.count() == stats.cleanups);
+	assert(stats.writeLatency.percentileNs(0.99) <= stats.writeLatency.maxNs());
+
+	ostringstream text, json;
+	stats.dump(text);
+	stats.dumpJson(json);
+	assert(text.str().find("writes: 5 (12 bytes, 0 deduplicated)") != string::npos);
+	assert(json.str().find("\"bytes_expired\":12") != string::npos);
+	assert(json.str().front() == '{' && json.str().back() == '}');
+}
+
+
+/*
+	With dedup on, writing the same thing to the same channel again makes
+	the entry already there last longer instead of adding another, and
+	readers following along don't see it twice.
+*/
+void testDedup()
+{
+	BasicDataStore<VirtualClock> m(10);
+	BasicDataStore<VirtualClock>::Cursor cursor;
+	m.setDedup(true);
+
+	  // the same thing on the same channel is only kept once, anything
+	  // else is a new entry
+	assert(m.write("HTBTLAX") == 0);
+	assert(m.write("HTBTLAX") == 0);
+	assert(m.write("HTBTLAY") == 1);
+	assert(m.write(Channel(1), "HTBTLAX") == 2);
+	assert(m.recordsSince(cursor).size() == 3);
+
+	  // a repeat early on just makes it last longer, and readers
+	  // following along don't see it again
+	m.advance(3000);
+	assert(m.write("HTBTLAX") == 0);
+	assert(m.recordsSince(cursor).size() == 0);
+	m.advance(7500);
+	m.expire();
+	RecordView r = m.records();
+	assert(r.size() == 1 && r[0].data == "HTBTLAX" && r[0].time == 0);
+
+	  // past half way it moves to the back instead, so it isn't holding
+	  // up the front of the log
+	assert(m.write("HTBTLAX") == 3);
+	r = m.records();
+	assert(r.size() == 1 && r[0].time == 10500);
+	assert(m.recordsSince(cursor).size() == 1);
+	m.advance(3000);
+	m.expire();
+	assert(m.records().size() == 1);
+	m.advance(7000);
+	m.expire();
+	assert(m.records().size() == 0);
+
+	if (StoreStats::enabled) {
+		assert(m.stats().deduplicated == 2 && m.stats().writes == 6);
+	}
+
+	  // in a batch the repeats keep their numbers, only the new ones
+	  // get the next ones
+	BasicDataStore<VirtualClock> batched(10);
+	batched.setDedup(true);
+	batched.write("x");
+	assert(batched.write(vector<string>{"y", "x", "z"}) == 1);
+	assert(batched.write(vector<string>{"x", "w"}) == 0 && batched.nextSequence() == 4);
+}
+
+  // keeps frames until the test hands them over itself
+class ManualTransport : public Transport {
+public:
+	void attach(int node, Receiver r) { nodes[node] = r; }
+	void detach(int node) { nodes.erase(node); }
+	void send(int from, int to, string frame) {
+		lock_guard<mutex> lock(m);
+		sent.push_back({from, to, frame});
+	}
+
+	struct Frame { int from; int to; string frame; };
+	map<int, Receiver> nodes;
+	mutex m;
+	vector<Frame> sent;
+};
+
+
+/*
+	Writes on any node reach every other node's copy, once each however
+	many paths they take, and a frame that doesn't make sense is dropped
+	instead of taking the node down.
+*/
+void testReplication()
+{
+	  // wait a while for a node to have n records
+	auto await = [](ReplicatedDataStore& node, size_t n, unsigned channels = ALL_CHANNELS) {
+		for (int i = 0; i < 2000 && node.records(channels).size() < n; i++) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		return node.records(channels).size() == n;
+	};
+
+	{
+		SimulatedNetwork net(chrono::milliseconds(20), 1e6);
+		ReplicatedDataStore a(1, net, 60), b(2, net, 60), c(3, net, 60);
+		for (ReplicatedDataStore* n : {&a, &b, &c}) {
+			for (int peer : {1, 2, 3}) {
+				n->connect(peer);
+			}
+		}
+
+		  // writes are there locally straight away and everywhere else
+		  // once they've crossed the link
+		a.write("abc");
+		b.write(Channel(5), vector<string>{"de", "fgh"});
+		assert(a.records().size() == 1 && c.records().empty());
+		assert(await(c, 3) && await(a, 3) && await(b, 3));
+		assert(c.view(Channel(5).mask()).str() == "defgh");
+		assert(c.stats().applied == 3 && c.stats().duplicates == 0);
+		assert(a.stats().written == 1 && a.stats().recordsShipped == 2);
+		assert(c.stats().lag.count() == 3 && c.stats().lag.percentileNs(0.5) >= 20000000);
+
+		  // Applications on different nodes find each other
+		struct Character {
+			char c;
+			Character(string s) : c(s[0]) {}
+			string to_writeable() { return string {c}; }
+		};
+		using ReplicatedApp = Application<SimpleProtocol,SimpleEncoding,Character,
+										  SimpleStorage,ReplicatedDataStore>;
+		ReplicatedApp lax("LAX", a), sfo("SFO", c);
+		lax.heartbeat();
+		sfo.heartbeat();
+		assert(await(a, 5) && await(c, 5));
+		assert(lax.connect() == 1 && sfo.connect() == 1);
+	}
+
+	{
+		  // nodes in a triangle, relaying: everything reaches everyone
+		  // along two paths and is still only stored once
+		SimulatedNetwork net(chrono::microseconds(500));
+		ReplicatedDataStore a(1, net, 60), b(2, net, 60), c(3, net, 60);
+		a.connect(2);
+		b.connect(3);
+		c.connect(1);
+		for (ReplicatedDataStore* n : {&a, &b, &c}) {
+			n->setRelay(true);
+		}
+		for (int i = 0; i < 100; i++) {
+			a.write(to_string(i));
+			b.write(Channel(2), to_string(i));
+		}
+		assert(await(c, 200) && await(a, 200) && await(b, 200));
+		a.connect(3);
+		c.connect(2);
+		a.write("more");
+		assert(await(b, 201) && await(c, 201));
+		this_thread::sleep_for(chrono::milliseconds(20));
+		assert(b.records().size() == 201 && c.records().size() == 201 && a.records().size() == 201);
+		assert(b.stats().duplicates + c.stats().duplicates > 0);
+	}
+
+	{
+		  // frames handed over twice only go in once
+		ManualTransport t;
+		ReplicatedDataStore a(1, t, 60), b(2, t, 60);
+		a.connect(2);
+		a.write(vector<string>{"x", "y"});
+		a.flush();
+		assert(t.sent.size() == 1 && t.sent[0].to == 2);
+		t.nodes[2](1, t.sent[0].frame);
+		t.nodes[2](1, t.sent[0].frame);
+		assert(b.records().size() == 2 && b.view().str() == "xy");
+		assert(b.stats().applied == 2 && b.stats().duplicates == 2);
+
+		  // frames that don't make sense are dropped whole, none of what's
+		  // in them counts as seen
+		auto frameOf = [](uint32_t origin, uint64_t first, uint64_t n, uint32_t channel) {
+			string frame;
+			Wire::Writer w(frame, Wire::REPLICATE);
+			w.put32(n);
+			for (uint64_t seq = first; seq < first + n; seq++) {
+				w.put32(origin);
+				w.put64(1);
+				w.put64(seq);
+				w.put32(seq == first + n - 1 ? channel : 0);
+				w.put64(0);
+				w.putBytes("z", 1);
+			}
+			w.end();
+			return frame;
+		};
+		t.nodes[2](1, "nonsense");
+		t.nodes[2](1, frameOf(7, 0, 2, Channel::MAX));
+		assert(b.stats().badFrames == 2 && b.records().size() == 2);
+		t.nodes[2](1, frameOf(7, 0, 2, 0));
+		assert(b.stats().applied == 4 && b.records().size() == 4);
+
+		  // a write that never turns up isn't waited for forever
+		t.nodes[2](1, frameOf(7, 3, ReplicatedDataStore::MAX_AHEAD + 1, 0));
+		t.nodes[2](1, frameOf(7, 2, 1, 0));
+		assert(b.stats().duplicates == 3);
+	}
+
+	{
+		  // a node that restarts numbers its writes from 0 again, which
+		  // its peers don't take for ones they've seen - but what's left
+		  // over from the old run still only goes in once
+		ManualTransport t;
+		ReplicatedDataStore b(2, t, 60);
+		{
+			ReplicatedDataStore a(1, t, 60);
+			a.connect(2);
+			a.write("before");
+			a.flush();
+		}
+		ReplicatedDataStore a(1, t, 60);
+		a.connect(2);
+		a.write("after");
+		a.flush();
+		assert(t.sent.size() == 2);
+		t.nodes[2](1, t.sent[0].frame);
+		t.nodes[2](1, t.sent[1].frame);
+		t.nodes[2](1, t.sent[0].frame);
+		assert(b.view().str() == "beforeafter" && b.stats().duplicates == 1);
+	}
+}
+
+
+/*
+	A durable store comes back after a restart with everything that
+	hadn't expired yet, and a half-written or corrupt record at the end
+	of the log is left off instead of coming back as garbage.
+*/
+void testDurable()
+{
+	string dir = "/tmp/masters-wal-" + to_string(getpid());
+	filesystem::remove_all(dir);
+
+	{
+		DataStore d(60);
+		d.setDurable(dir);
+		d.write("abc");
+		d.write(Channel(2), vector<string>{"de", "fgh"});
+		d.write("gone soon", 0.05);
+		d.sync();
+		WalStats stats = d.durabilityStats();
+		assert(stats.appended == 4 && stats.bytesAppended == 17);
+		assert(stats.commits >= 1 && stats.commitLatency.count() == stats.commits);
+	}
+
+	  // everything comes back but what expired while nobody had it open
+	this_thread::sleep_for(chrono::milliseconds(100));
+	{
+		DataStore d(60);
+		d.setDurable(dir);
+		assert(d.view().str() == "abcdefgh");
+		assert(d.view(Channel(2).mask()).str() == "defgh");
+		RecordView r = d.records();
+		assert(r.size() == 3 && r[0].time < 0 && r[1].time == r[2].time);
+		assert(d.durabilityStats().recovered == 3 && d.durabilityStats().discarded == 1);
+		d.write("ij");
+
+		bool threw = false;
+		try {
+			d.setDurable(dir);
+		}
+		catch (const runtime_error&) {
+			threw = true;
+		}
+		assert(threw);
+	}
+
+	  // what's written after a restart is kept too, and half a record
+	  // on the end of a file from a crash is left off - whether it's cut
+	  // off in the header or in the data - as is a whole record whose
+	  // checksum doesn't match
+	{
+		ofstream torn(dir + "/wal-00000000000000000001.log", ios::app | ios::binary);
+		torn.write("\x20\0\0\0garbage", 11);
+	}
+	auto record = [](uint32_t size, uint32_t check, string data) {
+		  // size, check, channel, unused, written, ttl - see WriteAheadLog.h
+		uint32_t words[4] = {size, check, 0, 0};
+		double times[2] = {
+			chrono::duration<double,milli>(chrono::system_clock::now().time_since_epoch()).count(),
+			60000
+		};
+		string r(reinterpret_cast<const char*>(words), sizeof(words));
+		r.append(reinterpret_cast<const char*>(times), sizeof(times));
+		return r + data;
+	};
+	{
+		ofstream cut(dir + "/wal-00000000000000000900.log", ios::binary);
+		string r = record(32, 0, "garbage");
+		cut.write(r.data(), r.size());
+		ofstream bad(dir + "/wal-00000000000000000901.log", ios::binary);
+		r = record(4, 0xdeadbeef, "evil");
+		bad.write(r.data(), r.size());
+	}
+	{
+		DataStore d(60);
+		d.setDurable(dir);
+		assert(d.view().str() == "abcdefghij");
+		assert(d.durabilityStats().recovered == 4);
+	}
+
+	  // the wall clock went backwards between two writes, they still
+	  // come back in order
+	{
+		filesystem::remove_all(dir);
+		double wall = chrono::duration<double,milli>(chrono::system_clock::now().time_since_epoch()).count();
+		WriteAheadLog wal(dir);
+		string first = "first", second = "second";
+		wal.append(0, &first, 1, wall - 1000, 60000);
+		wal.append(0, &second, 1, wall - 3000, 60000);
+		wal.sync();
+	}
+	{
+		DataStore d(60);
+		d.setDurable(dir);
+		RecordView r = d.records();
+		assert(r.size() == 2 && r[0].data == "first" && r[0].time <= r[1].time);
+		assert(d.readRange(r[0].time, r[1].time).str() == "firstsecond");
+	}
+
+	  // lots of writes share a sync
+	{
+		filesystem::remove_all(dir);
+		DataStore d(60);
+		d.setDurable(dir, chrono::milliseconds(5));
+		for (int i = 0; i < 1000; i++) {
+			d.write(to_string(i));
+		}
+		d.sync();
+		WalStats stats = d.durabilityStats();
+		assert(stats.appended == 1000 && stats.writesPerCommit() > 1);
+	}
+
+	  // once the log can't be written, a write throws before anyone can
+	  // read it. A file size limit of nothing is how the disk gets broken.
+	filesystem::remove_all(dir);
+	{
+		DataStore d(60);
+		d.setDurable(dir);
+		rlimit was;
+		getrlimit(RLIMIT_FSIZE, &was);
+		rlimit none = {0, was.rlim_max};
+		auto handler = signal(SIGXFSZ, SIG_IGN);
+		setrlimit(RLIMIT_FSIZE, &none);
+		d.write("lost");
+		bool threw = false;
+		try {
+			d.sync();
+		}
+		catch (const runtime_error&) {
+			threw = true;
+		}
+		setrlimit(RLIMIT_FSIZE, &was);
+		signal(SIGXFSZ, handler);
+		assert(threw);
+
+		threw = false;
+		try {
+			d.write("never seen");
+		}
+		catch (const runtime_error&) {
+			threw = true;
+		}
+		assert(threw && d.view().str() == "lost" && d.nextSequence() == 1);
+	}
+	filesystem::remove_all(dir);
+}
+
+
+/*
+	Writes go through a buffer per thread and get merged into the log
+	by when they were made, so the log says the same thing about the
+	order of things that the writers would.
+*/
+void testBufferedDataStore()
+{
+	const int NUM_WRITERS = 4, NUM_WRITES = 20000;
+	ConcurrentDataStore cds(60);
+	{
+		BufferedDataStore bds(cds, chrono::microseconds(100), 64);
+		vector<thread> writers;
+		for (int w = 0; w < NUM_WRITERS; w++) {
+			writers.push_back(thread([&bds, w]() {
+				for (int i = 0; i < NUM_WRITES; i++) {
+					bds.write(to_string(w) + ":" + to_string(i) + ";");
+				}
+			}));
+		}
+		for (size_t w = 0; w < writers.size(); w++) {
+			writers[w].join();
+		}
+		bds.flush();
+		assert(cds.records().size() == size_t(NUM_WRITERS * NUM_WRITES));
+
+		  // every writer's entries, in the order they were written
+		vector<int> expected(NUM_WRITERS, 0);
+		for (const Record& r : cds.records()) {
+			string e(r.data);
+			size_t colon = e.find(':');
+			int w = stoi(e.substr(0, colon));
+			assert(stoi(e.substr(colon + 1)) == expected[w]);
+			expected[w]++;
+		}
+
+		BufferedDataStore::Stats s = bds.stats();
+		assert(s.writes == (unsigned long long)(NUM_WRITERS * NUM_WRITES));
+		assert(s.published == s.writes && s.publishLatency.count() == s.writes);
+		assert(s.rounds > 0 && s.storeWrites <= s.published);
+
+		  // the writers are gone, and so are their buffers once they're
+		  // empty, but not what they wrote
+		bds.flush();
+		s = bds.stats();
+		assert(s.buffers == 0 && s.writes == (unsigned long long)(NUM_WRITERS * NUM_WRITES));
+	}
+
+	  // two threads taking turns - each write is made after the other
+	  // thread's last one, so they have to come out alternating
+	ConcurrentDataStore turns(60);
+	{
+		BufferedDataStore bds(turns, chrono::milliseconds(1));
+		atomic<int> turn(0);
+		auto player = [&bds, &turn](int me) {
+			for (int i = me; i < 2000; i += 2) {
+				while (turn.load() != i) {
+					this_thread::yield();
+				}
+				bds.write(to_string(i));
+				turn.store(i + 1);
+			}
+		};
+		thread a(player, 0), b(player, 1);
+		a.join(); b.join();
+		  // what's left gets published on the way out
+	}
+	int next = 0;
+	for (const Record& r : turns.records()) {
+		assert(string(r.data) == to_string(next++));
+	}
+	assert(next == 2000);
+
+	  // a batch stays together and on its channel, and flush makes your
+	  // own writes visible
+	ConcurrentDataStore batches(60);
+	BufferedDataStore bds(batches, chrono::seconds(10), 1000);
+	thread other([&bds]() {
+		for (int i = 0; i < 100; i++) {
+			bds.write(Channel(2), "o");
+		}
+	});
+	vector<string> batch(50, "b");
+	bds.write(Channel(1), batch);
+	other.join();
+	bds.flush();
+	assert(bds.view(Channel(1).mask()).str() == string(50, 'b'));
+	assert(bds.view(Channel(2).mask()).str() == string(100, 'o'));
+	string all = bds.view().str();
+	assert(all.find(string(50, 'b')) != string::npos);
+}
+
+
+/*
+	readRange and recordsRange only hand back what was written in a
+	window of time, inclusive at both ends.
+*/
+void testReadRange()
+{
+	BasicDataStore<VirtualClock> m(5);
+	  // a write every 10ms, alternating channels, "0" at time 0 to "99"
+	  // at 990
+	for (int i = 0; i < 100; i++) {
+		m.write(Channel(i % 2), to_string(i) + ",");
+		m.advance(10);
+	}
+
+	assert(m.readRange(200, 230).str() == "20,21,22,23,");
+	assert(m.readRange(195, 205).str() == "20,");
+	assert(m.readRange(201, 209).empty());
+	assert(m.readRange(2000, 3000).empty() && m.readRange(-100, -1).empty());
+	assert(m.readRange(-100, 1e9).str() == m.view().str());
+	assert(m.readRange(200, 250, Channel(1).mask()).str() == "21,23,25,");
+
+	  // the last 50ms, the way you'd ask for them
+	RecordView recent = m.recordsRange(m.elapsed() - 50, m.elapsed());
+	assert(recent.size() == 5 && string(recent[0].data) == "95," && recent[0].time == 950);
+
+	  // nothing that's expired, even if it's in the range
+	m.setExpireOnRead(false);
+	m.write(Channel(0), "short", 0.1);
+	m.advance(200);
+	assert(m.readRange(1000, 1000).empty());
+	assert(m.recordsRange(990, 1200).size() == 1);
+
+	  // and the front coming off doesn't throw the search off
+	m.advance(4000);
+	m.expire();
+	assert(m.readRange(0, 1e9).str() == m.view().str());
+	assert(m.readRange(0, 300).str() == "21,22,23,24,25,26,27,28,29,30,");
+	m.advance(2000);
+	m.expire();
+	assert(m.readRange(0, 1e9).empty());
+	m.write("fresh");
+	assert(m.readRange(m.elapsed(), m.elapsed()).str() == "fresh");
+	assert(m.readRange(0, m.elapsed() - 1).empty());
+}
+
+
+#if __cplusplus >= 202002L
+/*
+	AsyncDataStore's coroutines wake up when there's something for them,
+	whoever wrote it, and lots of Applications can share a few threads
+	that way.
+*/
+void testAsync()
+{
+	{
+		  // a reader parked on a writer, both on one thread
+		Scheduler s;
+		DataStore ds(60);
+		AsyncDataStore<DataStore> ads(ds, s);
+		vector<string> events;
+
+		auto reader = [&]() -> Task<> {
+			auto sub = ads.subscribe(Channel(2).mask());
+			RecordView r = co_await sub.next(chrono::seconds(5));
+			assert(r.size() == 2 && r[0].data == "a" && r[1].data == "b");
+			events.push_back("read");
+			r = co_await sub.next(chrono::milliseconds(10));
+			assert(r.empty());
+			events.push_back("timeout");
+		};
+		auto writer = [&]() -> Task<> {
+			co_await s.sleepFor(chrono::milliseconds(5));
+			events.push_back("write");
+			vector<string> ab = {"a", "b"};
+			co_await ads.writeAsync(Channel(1), "other");
+			co_await ads.writeAsync(Channel(2), ab);
+		};
+		s.spawn(reader());
+		s.spawn(writer());
+		s.run();
+		assert((events == vector<string>{"write", "read", "timeout"}));
+	}
+
+	{
+		  // writes that don't go through the AsyncDataStore get noticed
+		  // too, and what a task throws comes out of run
+		Scheduler s;
+		ConcurrentDataStore cds(60);
+		AsyncDataStore<ConcurrentDataStore> ads(cds, s);
+		auto reader = [&]() -> Task<> {
+			ConcurrentDataStore::Cursor c;
+			RecordView r = co_await ads.readAsync(c, ALL_CHANNELS, chrono::seconds(5));
+			assert(r.size() == 1 && r[0].data == "direct");
+			throw runtime_error("done");
+		};
+		s.spawn(reader());
+		thread writer([&cds]() {
+			this_thread::sleep_for(chrono::milliseconds(5));
+			cds.write("direct");
+		});
+		bool threw = false;
+		try {
+			s.run();
+		}
+		catch (const runtime_error& e) {
+			threw = string(e.what()) == "done";
+		}
+		writer.join();
+		assert(threw);
+	}
+
+	{
+		  // a few hundred Applications on four threads, each finding
+		  // all the others and getting everyone's data
+		struct Character {
+			char c;
+			Character(string s) : c(s[0]) {}
+			string to_writeable() { return string {c}; }
+		};
+		using AsyncApp = Application<SimpleProtocol,SimpleEncoding,Character,SimpleStorage,
+									 AsyncDataStore<ConcurrentDataStore>>;
+		const int N = 200;
+		Scheduler s(4);
+		ConcurrentDataStore cds(60);
+		AsyncDataStore<ConcurrentDataStore> ads(cds, s);
+		vector<unique_ptr<AsyncApp>> apps;
+		for (int i = 0; i < N; i++) {
+			char addr[4];
+			snprintf(addr, sizeof(addr), "%03d", i);
+			apps.push_back(unique_ptr<AsyncApp>(new AsyncApp(addr, ads)));
+		}
+
+		atomic<int> done(0);
+		auto run = [&](AsyncApp& app) -> Task<> {
+			app.heartbeat();
+			int connected = app.connect();
+			for (int tries = 0; connected < N - 1 && tries < 10 * N; tries++) {
+				connected = co_await app.connectAsync(chrono::seconds(5));
+			}
+			assert(connected == N - 1);
+
+			app.record(Character("x"));
+			assert(co_await app.broadcastAsync() == 1);
+			int got = 0;
+			for (int tries = 0; got < N - 1 && tries < 10 * N; tries++) {
+				got += co_await app.readMessagesAsync(chrono::seconds(5));
+			}
+			assert(got == N - 1 && app.size() == N);
+			done++;
+		};
+		for (auto& app : apps) {
+			s.spawn(run(*app));
+		}
+		s.run();
+		assert(done == N && s.resumes() >= (unsigned long long)N);
+	}
+}
+#endif
@@ -0,0 +1,42 @@
+#include <iostream>
+#include <csignal>
+#include "DataStoreServer.h"
+#include "Reaper.h"
+using namespace std;
+
+/*
+	Runs a DataStore as a daemon for RemoteDataStores to connect to:
+
+		./server <socket path> [persistence in seconds]
+
+	Ctrl-C (or SIGTERM) shuts it down.
+*/
+
+static DataStoreServer* server = nullptr;
+
+static void shutdown(int)
+{
+	if (server) {
+		server->stop();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		cerr << "usage: " << argv[0] << " <socket path> [persistence]" << endl;
+		return 1;
+	}
+	int persistence = argc > 2 ? atoi(argv[2]) : 60;
+
+	ConcurrentDataStore ds(persistence);
+	Reaper<ConcurrentDataStore> reaper(ds);
+	DataStoreServer s(ds, argv[1]);
+	server = &s;
+	signal(SIGINT, shutdown);
+	signal(SIGTERM, shutdown);
+
+	cout << "serving on " << argv[1] << ", persistence " << persistence << "s" << endl;
+	s.run();
+	cout << s.connections() << " connections, " << s.requests() << " requests" << endl;
+}